@@ -22,7 +22,9 @@ fn main() {
  **/",
         )),
         after_includes: Some(
-            "#define EM_DECLARE_MODULE(...) ValidationModule create_module() { return (ValidationModule) {__VA_ARGS__}; }"
+            "#define EM_DECLARE_MODULE(...) \\
+    uint32_t module_abi_version() { return MODULE_ABI_VERSION; } \\
+    ValidationModule create_module() { return (ValidationModule) {__VA_ARGS__}; }"
                 .to_string(),
         ),
         ..Default::default()
@@ -0,0 +1,360 @@
+//!
+//! A load generator for SMTP servers. It opens a number of concurrent sessions,
+//! sends messages over each of them as quickly as the server accepts them, and
+//! reports the throughput and the latency of each transaction.
+//!
+//! It can also start a server in the same process from a configuration file,
+//! so that a build (and any modules it loads) can be measured on its own. The
+//! peak memory used by the server (this process, or the one given by `--pid`)
+//! while the sessions are open is reported per connection.
+//!
+
+use std::{
+    net::SocketAddr,
+    path::PathBuf,
+    sync::Arc,
+    time::{Duration, Instant},
+};
+
+use empath_server::{
+    delivery::{self, client::Client},
+    Server,
+};
+use tokio::{net::TcpStream, task::JoinSet};
+use tokio_rustls::TlsConnector;
+
+const USAGE: &str = "\
+Usage: empath-bench [OPTIONS]
+
+Options:
+    --address <ADDRESS>    The server to send to [default: [::1]:1025]
+    --host <NAME>          The name the server's certificate is for [default: localhost]
+    --sessions <N>         How many sessions to run at once [default: 16]
+    --messages <N>         How many messages each session sends [default: 1000]
+    --size <BYTES>         The size of each message body [default: 4096]
+    --recipients <N>       How many recipients each message has [default: 1]
+    --no-pipelining        Wait for each reply, even if the server supports pipelining
+    --tls <CERTIFICATES>   Negotiate STARTTLS, trusting the authorities in this file
+    --server <CONFIG>      Start a server from this configuration first
+    --pid <PID>            Report the peak memory of this server process
+    --help                 Show this message
+";
+
+/// How long to wait for a server started with `--server` to begin listening
+const STARTUP_TIMEOUT: Duration = Duration::from_secs(10);
+
+struct Options {
+    address: SocketAddr,
+    host: String,
+    sessions: usize,
+    messages: usize,
+    size: usize,
+    recipients: usize,
+    pipelining: bool,
+    tls: Option<PathBuf>,
+    server: Option<String>,
+    pid: Option<u32>,
+}
+
+impl Default for Options {
+    fn default() -> Self {
+        Self {
+            address: SocketAddr::from(([0, 0, 0, 0, 0, 0, 0, 1], 1025)),
+            host: String::from("localhost"),
+            sessions: 16,
+            messages: 1000,
+            size: 4096,
+            recipients: 1,
+            pipelining: true,
+            tls: None,
+            server: None,
+            pid: None,
+        }
+    }
+}
+
+impl Options {
+    fn parse(mut args: impl Iterator<Item = String>) -> Result<Self, String> {
+        let mut options = Self::default();
+
+        while let Some(arg) = args.next() {
+            let mut value = || args.next().ok_or_else(|| format!("{arg} needs a value"));
+            let number = |value: String| {
+                value
+                    .parse::<usize>()
+                    .map_err(|err| format!("Invalid value for {arg}: {err}"))
+            };
+
+            match arg.as_str() {
+                "--address" => {
+                    options.address = value()?
+                        .parse()
+                        .map_err(|err| format!("Invalid address: {err}"))?;
+                }
+                "--host" => options.host = value()?,
+                "--sessions" => options.sessions = number(value()?)?.max(1),
+                "--messages" => options.messages = number(value()?)?,
+                "--size" => options.size = number(value()?)?,
+                "--recipients" => options.recipients = number(value()?)?.max(1),
+                "--no-pipelining" => options.pipelining = false,
+                "--tls" => options.tls = Some(PathBuf::from(value()?)),
+                "--server" => options.server = Some(value()?),
+                "--pid" => {
+                    options.pid = Some(
+                        value()?
+                            .parse()
+                            .map_err(|err| format!("Invalid value for --pid: {err}"))?,
+                    );
+                }
+                "--help" => return Err(String::new()),
+                _ => return Err(format!("Unknown option '{arg}'")),
+            }
+        }
+
+        Ok(options)
+    }
+}
+
+/// A message body of roughly `size` bytes, made up of lines of a typical length
+fn body(size: usize) -> Vec<u8> {
+    let mut body = b"Subject: empath-bench\r\n\r\n".to_vec();
+    let line = [b'x'; 76];
+
+    while body.len() < size {
+        let remaining = (size - body.len()).saturating_sub(2).min(line.len());
+        body.extend_from_slice(&line[..remaining]);
+        body.extend_from_slice(b"\r\n");
+    }
+
+    body
+}
+
+#[derive(Default)]
+struct Results {
+    /// How long each accepted message took, from `MAIL FROM` to the final reply
+    latencies: Vec<Duration>,
+    rejected: usize,
+}
+
+async fn session(
+    options: Arc<Options>,
+    tls: Option<TlsConnector>,
+    body: Arc<Vec<u8>>,
+) -> std::io::Result<Results> {
+    let stream = TcpStream::connect(options.address).await?;
+    stream.set_nodelay(true)?;
+
+    let mut client = Client::handshake(stream, &options.host, "empath-bench", tls.as_ref()).await?;
+    if !options.pipelining {
+        client.disable_pipelining();
+    }
+
+    let recipients = (0..options.recipients)
+        .map(|idx| format!("recipient{idx}@example.org"))
+        .collect::<Vec<_>>();
+
+    let mut results = Results {
+        latencies: Vec::with_capacity(options.messages),
+        rejected: 0,
+    };
+
+    for _ in 0..options.messages {
+        let start = Instant::now();
+        let transaction = client
+            .send("sender@example.com", &recipients, false, body.as_slice())
+            .await?;
+
+        if transaction.outcome(0).is_positive() {
+            results.latencies.push(start.elapsed());
+        } else {
+            results.rejected += 1;
+        }
+    }
+
+    client.quit().await;
+
+    Ok(results)
+}
+
+/// The latency that `percentile` of messages were accepted within
+fn percentile(sorted: &[Duration], percentile: f64) -> Duration {
+    if sorted.is_empty() {
+        return Duration::ZERO;
+    }
+
+    #[allow(
+        clippy::cast_possible_truncation,
+        clippy::cast_sign_loss,
+        clippy::cast_precision_loss
+    )]
+    let idx = ((sorted.len() - 1) as f64 * percentile).round() as usize;
+
+    sorted[idx]
+}
+
+///
+/// The memory the server is using now, and the most that it has used since
+/// `reset_peak` was last called, in bytes. `None` is this process.
+///
+fn memory(pid: Option<u32>) -> std::io::Result<(u64, u64)> {
+    let status = std::fs::read_to_string(match pid {
+        Some(pid) => format!("/proc/{pid}/status"),
+        None => String::from("/proc/self/status"),
+    })?;
+
+    let field = |name: &str| {
+        status
+            .lines()
+            .find_map(|line| line.strip_prefix(name))
+            .and_then(|value| {
+                value
+                    .trim()
+                    .trim_end_matches("kB")
+                    .trim()
+                    .parse::<u64>()
+                    .ok()
+            })
+            .map(|kb| kb * 1024)
+            .ok_or_else(|| std::io::Error::other(format!("No {name} in the process status")))
+    };
+
+    Ok((field("VmRSS:")?, field("VmHWM:")?))
+}
+
+/// Start measuring the peak memory of the server from its current usage, so
+/// that anything it did before the run isn't counted
+fn reset_peak(pid: Option<u32>) {
+    let path = match pid {
+        Some(pid) => format!("/proc/{pid}/clear_refs"),
+        None => String::from("/proc/self/clear_refs"),
+    };
+
+    // Not every kernel supports this, in which case the peak is since the
+    // process started
+    let _ = std::fs::write(path, "5");
+}
+
+/// Wait for a server started in this process to begin accepting connections
+async fn wait_for(address: SocketAddr) -> std::io::Result<()> {
+    let deadline = Instant::now() + STARTUP_TIMEOUT;
+
+    loop {
+        match TcpStream::connect(address).await {
+            Ok(_) => return Ok(()),
+            Err(err) if Instant::now() >= deadline => return Err(err),
+            Err(_) => tokio::time::sleep(Duration::from_millis(50)).await,
+        }
+    }
+}
+
+#[tokio::main]
+async fn main() -> std::io::Result<()> {
+    let options = match Options::parse(std::env::args().skip(1)) {
+        Ok(options) => Arc::new(options),
+        Err(err) => {
+            if !err.is_empty() {
+                eprintln!("{err}\n");
+            }
+            eprint!("{USAGE}");
+            std::process::exit(i32::from(!err.is_empty()) * 2);
+        }
+    };
+
+    if let Some(ref config) = options.server {
+        let server = Server::from_config(config)?;
+        tokio::spawn(async move {
+            if let Err(err) = server.run().await {
+                eprintln!("Server stopped: {err}");
+            }
+        });
+
+        wait_for(options.address).await?;
+    }
+
+    let tls = options
+        .tls
+        .as_deref()
+        .map(delivery::connector)
+        .transpose()?;
+    let body = Arc::new(body(options.size));
+
+    // Only a server started here, or named explicitly, can be measured
+    let measured = (options.server.is_some() || options.pid.is_some()).then_some(options.pid);
+    let before = match measured {
+        Some(pid) => {
+            reset_peak(pid);
+            Some(memory(pid)?.0)
+        }
+        None => None,
+    };
+
+    let start = Instant::now();
+    let mut sessions = JoinSet::new();
+    for _ in 0..options.sessions {
+        sessions.spawn(session(
+            Arc::clone(&options),
+            tls.clone(),
+            Arc::clone(&body),
+        ));
+    }
+
+    let mut latencies = Vec::with_capacity(options.sessions * options.messages);
+    let (mut rejected, mut failed) = (0, 0);
+
+    while let Some(result) = sessions.join_next().await {
+        match result.map_err(std::io::Error::other)? {
+            Ok(results) => {
+                latencies.extend(results.latencies);
+                rejected += results.rejected;
+            }
+            Err(err) => {
+                eprintln!("Session failed: {err}");
+                failed += 1;
+            }
+        }
+    }
+
+    let elapsed = start.elapsed();
+    latencies.sort_unstable();
+
+    let peak = match measured {
+        Some(pid) => Some(memory(pid)?.1),
+        None => None,
+    };
+
+    println!(
+        "{} sessions, {} byte messages, pipelining {}, {}",
+        options.sessions,
+        body.len(),
+        if options.pipelining { "on" } else { "off" },
+        if tls.is_some() { "STARTTLS" } else { "plain" }
+    );
+    println!(
+        "accepted {} / rejected {rejected} / failed sessions {failed} in {elapsed:.2?}",
+        latencies.len()
+    );
+    println!(
+        "throughput: {:.1} msgs/s",
+        latencies.len() as f64 / elapsed.as_secs_f64()
+    );
+    println!(
+        "latency: p50 {:.2?} / p90 {:.2?} / p99 {:.2?} / p99.9 {:.2?} / max {:.2?}",
+        percentile(&latencies, 0.5),
+        percentile(&latencies, 0.9),
+        percentile(&latencies, 0.99),
+        percentile(&latencies, 0.999),
+        latencies.last().copied().unwrap_or_default()
+    );
+
+    if let (Some(before), Some(peak)) = (before, peak) {
+        let growth = peak.saturating_sub(before);
+        println!(
+            "memory: {} KiB before / {} KiB peak / {:.1} KiB peak per connection",
+            before / 1024,
+            peak / 1024,
+            growth as f64 / 1024.0 / options.sessions as f64
+        );
+    }
+
+    Ok(())
+}
@@ -0,0 +1,72 @@
+use criterion::{black_box, criterion_group, criterion_main, Criterion};
+use empath_common::{
+    context::{
+        context_get_recipients, context_recipient_at, context_view_data, Addresses, Context,
+    },
+    ffi::string::{String, StringVector, StringView},
+};
+
+fn context() -> Context {
+    Context {
+        mail_from: Addresses::from(&mailparse::addrparse("sender@example.com").unwrap()),
+        rcpt_to: Addresses::from(
+            &mailparse::addrparse(
+                &(0..16)
+                    .map(|idx| format!("recipient{idx}@example.org"))
+                    .collect::<Vec<_>>()
+                    .join(", "),
+            )
+            .unwrap(),
+        ),
+        data: Some(b"Subject: Benchmark\r\n\r\n".repeat(64)),
+        ..Default::default()
+    }
+}
+
+fn strings(c: &mut Criterion) {
+    let mut group = c.benchmark_group("string");
+    let id = "client.example.com";
+    let recipients = (0..16)
+        .map(|idx| format!("RCPT TO:recipient{idx}@example.org"))
+        .collect::<Vec<_>>();
+
+    group.bench_function("string", |b| {
+        b.iter(|| String::from(black_box(id)));
+    });
+
+    group.bench_function("string_vector", |b| {
+        b.iter(|| StringVector::from(black_box(&recipients)));
+    });
+
+    group.bench_function("string_view", |b| {
+        b.iter(|| StringView::from(black_box(id)));
+    });
+
+    group.finish();
+}
+
+fn accessors(c: &mut Criterion) {
+    let mut group = c.benchmark_group("context");
+    let vctx = context();
+
+    group.bench_function("get_recipients", |b| {
+        b.iter(|| context_get_recipients(black_box(&vctx)));
+    });
+
+    group.bench_function("recipient_at", |b| {
+        b.iter(|| {
+            for idx in 0..vctx.recipient_count() {
+                black_box(context_recipient_at(black_box(&vctx), idx));
+            }
+        });
+    });
+
+    group.bench_function("view_data", |b| {
+        b.iter(|| context_view_data(black_box(&vctx)));
+    });
+
+    group.finish();
+}
+
+criterion_group!(benches, strings, accessors);
+criterion_main!(benches);
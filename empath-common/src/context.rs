@@ -1,16 +1,50 @@
-use std::{ffi::CStr, fmt::Debug};
-
-use mailparse::MailAddrList;
+use std::{
+    cell::RefCell,
+    ffi::CStr,
+    fmt::Debug,
+    ops::{Deref, DerefMut},
+};
 
 use crate::{ffi, internal};
 
+mod addresses;
+mod spill;
+
+pub use addresses::{Address, Addresses};
+pub use spill::Spill;
+
+/// Bodies larger than this aren't kept for reuse, so that a single large
+/// message doesn't hold on to its memory for the rest of the session
+const MAX_RETAINED_BODY: usize = 1 << 20;
+
+/// The most contexts each thread keeps for reuse
+const POOL_SIZE: usize = 64;
+
+thread_local! {
+    static POOL: RefCell<Vec<Context>> = const { RefCell::new(Vec::new()) };
+}
+
 #[derive(Default, Debug)]
 pub struct Context {
     pub id: String,
-    pub mail_from: Option<MailAddrList>,
-    pub rcpt_to: Option<MailAddrList>,
+    /// The IP address of the client, as text
+    pub peer: String,
+    /// This is empty for the null sender
+    pub mail_from: Addresses,
+    pub rcpt_to: Addresses,
     pub data: Option<Vec<u8>>,
+    /// The body, if it was too large to be kept in `data`
+    pub spilled: Option<Spill>,
+    /// The size of the message declared by the client in `MAIL FROM`
+    pub declared_size: Option<usize>,
+    /// Whether the client declared the body to be `8BITMIME` in `MAIL FROM`
+    /// ([RFC-6152](https://www.ietf.org/rfc/rfc6152.txt)), so that it's only
+    /// relayed to servers that support it
+    pub eight_bit: bool,
     pub data_response: Option<String>,
+    /// The text of the reply to a command a module has just rejected, before
+    /// the message was sent
+    pub response: Option<String>,
 }
 
 impl Context {
@@ -18,40 +52,137 @@ impl Context {
         &self.id
     }
 
+    ///
+    /// Clear the envelope and body, ready for the next transaction on the same
+    /// session. Their allocations are kept to be reused.
+    ///
+    pub fn reset(&mut self) {
+        self.mail_from.clear();
+        self.rcpt_to.clear();
+        self.data_response = None;
+        self.response = None;
+        self.spilled = None;
+        self.declared_size = None;
+        self.eight_bit = false;
+
+        if let Some(ref mut data) = self.data {
+            data.clear();
+
+            if data.capacity() > MAX_RETAINED_BODY {
+                *data = Vec::new();
+            }
+        }
+    }
+
+    ///
+    /// Prepare to receive the body of a message. If it is to be `buffered`, it
+    /// is held in the context, reusing the buffer of the last message if there
+    /// is one.
+    ///
+    pub fn begin_data(&mut self, buffered: bool) {
+        self.spilled = None;
+        self.data = buffered.then(|| {
+            let mut data = self.data.take().unwrap_or_default();
+            data.clear();
+            data
+        });
+    }
+
+    /// The body of the message, wherever it is being kept
+    pub fn body(&self) -> Option<&[u8]> {
+        self.spilled
+            .as_ref()
+            .and_then(Spill::as_slice)
+            .or(self.data.as_deref())
+    }
+
     pub fn message(&self) -> String {
-        self.data.as_deref().map_or_else(Default::default, |data| {
-            std::str::from_utf8(data).map_or_else(|_| format!("{:#?}", self.data), str::to_string)
+        self.body().map_or_else(Default::default, |data| {
+            std::str::from_utf8(data).map_or_else(|_| format!("{data:#?}"), str::to_string)
         })
     }
 
     pub fn sender(&self) -> String {
-        self.mail_from
-            .clone()
-            .map(|sender| sender.to_string())
-            .unwrap_or_default()
+        self.mail_from.to_string()
+    }
+
+    /// The bare address of the sender, borrowed from the context. This will
+    /// be empty for the null sender.
+    pub fn sender_address(&self) -> &str {
+        self.mail_from.first().map_or("", |sender| sender.address)
+    }
+
+    /// The number of recipients currently in the envelope
+    pub fn recipient_count(&self) -> usize {
+        self.rcpt_to.len()
+    }
+
+    /// The bare address of the recipient at `index`, borrowed from the context
+    pub fn recipient_address(&self, index: usize) -> Option<&str> {
+        self.rcpt_to.get(index).map(|rcpt| rcpt.address)
     }
 
     pub fn recipients(&self) -> Vec<String> {
         self.rcpt_to
-            .clone()
-            .map(|addrs| {
-                addrs
-                    .iter()
-                    .map(|addr| match addr {
-                        mailparse::MailAddr::Group(group) => {
-                            format!("RCPT TO:{}", group.group_name)
-                        }
-                        mailparse::MailAddr::Single(single) => {
-                            format!(
-                                "RCPT TO:{}{}",
-                                single.display_name.clone().unwrap_or_default(),
-                                single.addr
-                            )
-                        }
-                    })
-                    .collect()
+            .iter()
+            .map(|rcpt| {
+                format!(
+                    "RCPT TO:{}{}",
+                    rcpt.display_name.unwrap_or_default(),
+                    rcpt.address
+                )
             })
-            .unwrap_or_default()
+            .collect()
+    }
+}
+
+///
+/// A context taken from this thread's pool, which is reset and returned to the
+/// pool of whichever thread it is dropped on
+///
+#[derive(Debug)]
+pub struct Pooled(Option<Context>);
+
+impl Default for Pooled {
+    fn default() -> Self {
+        Self(Some(
+            POOL.with(|pool| pool.borrow_mut().pop())
+                .unwrap_or_default(),
+        ))
+    }
+}
+
+impl Deref for Pooled {
+    type Target = Context;
+
+    fn deref(&self) -> &Context {
+        self.0.as_ref().expect("Pooled context has been released")
+    }
+}
+
+impl DerefMut for Pooled {
+    fn deref_mut(&mut self) -> &mut Context {
+        self.0.as_mut().expect("Pooled context has been released")
+    }
+}
+
+impl Drop for Pooled {
+    fn drop(&mut self) {
+        let Some(mut vctx) = self.0.take() else {
+            return;
+        };
+
+        vctx.reset();
+        vctx.id.clear();
+        vctx.peer.clear();
+
+        // The thread may be shutting down, in which case it's simply dropped
+        let _ = POOL.try_with(|pool| {
+            let mut pool = pool.borrow_mut();
+            if pool.len() < POOL_SIZE {
+                pool.push(vctx);
+            }
+        });
     }
 }
 
@@ -67,6 +198,13 @@ pub extern "C" fn context_get_id(vctx: &Context) -> ffi::string::String {
     vctx.id().into()
 }
 
+///
+/// Retrieve a copy of every recipient, formatted as `RCPT TO:<address>`, which
+/// must be freed with `free_string_vector`.
+///
+/// This allocates every time it's called, so modules should prefer
+/// `context_recipient_count` and `context_recipient_at`.
+///
 #[no_mangle]
 #[allow(clippy::module_name_repetitions)]
 pub extern "C" fn context_get_recipients(vctx: &Context) -> ffi::string::StringVector {
@@ -95,7 +233,7 @@ pub unsafe extern "C" fn context_set_sender(
     sender: *const libc::c_char,
 ) -> i32 {
     if sender.is_null() {
-        vctx.mail_from = None;
+        vctx.mail_from.clear();
         return 0;
     }
 
@@ -104,7 +242,7 @@ pub unsafe extern "C" fn context_set_sender(
     match sender.to_str() {
         Ok(sender) => match mailparse::addrparse(sender) {
             Ok(sender) => {
-                vctx.mail_from = Some(sender);
+                vctx.mail_from.set(Some(&sender));
                 0
             }
             Err(err) => {
@@ -119,14 +257,92 @@ pub unsafe extern "C" fn context_set_sender(
     }
 }
 
+///
+/// Retrieve a copy of the message body, which must be freed with `free_string`.
+///
+/// This copies the entire message, so modules that only need to read it should
+/// prefer `context_view_data`.
+///
 #[no_mangle]
 #[allow(clippy::module_name_repetitions)]
 pub extern "C" fn context_get_data(vctx: &Context) -> ffi::string::String {
-    vctx.data.as_ref().map_or_else(Default::default, |data| {
-        ffi::string::String::try_from(data.as_slice()).unwrap_or_default()
+    vctx.body().map_or_else(Default::default, |data| {
+        ffi::string::String::try_from(data).unwrap_or_default()
     })
 }
 
+///
+/// Retrieve a borrowed view of the id associated with this context.
+///
+/// Unlike `context_get_id`, this does not allocate, and the result must not be
+/// freed. It is only valid until the callback it was retrieved in returns.
+///
+#[no_mangle]
+#[allow(clippy::module_name_repetitions)]
+pub extern "C" fn context_view_id(vctx: &Context) -> ffi::string::StringView {
+    vctx.id().into()
+}
+
+///
+/// Retrieve a borrowed view of the IP address of the client, as text. This is
+/// only valid until the callback it was retrieved in returns.
+///
+#[no_mangle]
+#[allow(clippy::module_name_repetitions)]
+pub extern "C" fn context_view_peer(vctx: &Context) -> ffi::string::StringView {
+    vctx.peer.as_str().into()
+}
+
+///
+/// Retrieve a borrowed view of the message body, without copying it. Large
+/// bodies are mapped from disk, rather than held in memory.
+///
+/// If there is no message yet, the view will have a NULL data pointer. The body
+/// may contain arbitrary bytes (including NUL), so `len` must be respected. This
+/// is only valid until the callback it was retrieved in returns.
+///
+#[no_mangle]
+#[allow(clippy::module_name_repetitions)]
+pub extern "C" fn context_view_data(vctx: &Context) -> ffi::string::StringView {
+    vctx.body().map_or_else(Default::default, Into::into)
+}
+
+///
+/// Retrieve a borrowed view of the senders address (without any display name).
+///
+/// This is empty for the null sender. As with the other views, it is only valid
+/// until the callback it was retrieved in returns, or until the sender is changed
+/// with `context_set_sender`.
+///
+#[no_mangle]
+#[allow(clippy::module_name_repetitions)]
+pub extern "C" fn context_view_sender(vctx: &Context) -> ffi::string::StringView {
+    vctx.sender_address().into()
+}
+
+///
+/// Retrieve the number of recipients for this message, for use with
+/// `context_recipient_at`.
+///
+#[no_mangle]
+#[allow(clippy::module_name_repetitions)]
+pub extern "C" fn context_recipient_count(vctx: &Context) -> usize {
+    vctx.recipient_count()
+}
+
+///
+/// Retrieve a borrowed view of the address of the recipient at `index`.
+///
+/// If `index` is out of range, the view will have a NULL data pointer. This is
+/// only valid until the callback it was retrieved in returns.
+///
+#[no_mangle]
+#[allow(clippy::module_name_repetitions)]
+pub extern "C" fn context_recipient_at(vctx: &Context, index: usize) -> ffi::string::StringView {
+    vctx.recipient_address(index)
+        .map_or_else(Default::default, Into::into)
+}
+
 ///
 /// # Safety
 ///
@@ -148,11 +364,34 @@ pub unsafe extern "C" fn context_set_data_response(
     0
 }
 
+///
+/// Set the text of the reply, for when a module rejects a command before the
+/// message was sent (from `on_connect`, `on_helo`, `on_mail_from` or
+/// `on_rcpt_to`).
+///
+/// # Safety
+///
+/// Even if provided with a null pointer, that would simply set the response to `None`
+///
+#[no_mangle]
+#[allow(clippy::module_name_repetitions)]
+pub unsafe extern "C" fn context_set_response(
+    vctx: &mut Context,
+    response: *const libc::c_char,
+) -> i32 {
+    vctx.response =
+        (!response.is_null()).then(|| CStr::from_ptr(response).to_string_lossy().into_owned());
+
+    0
+}
+
 #[cfg(test)]
 mod test {
     use crate::context::{
-        context_get_data, context_get_id, context_get_recipients, context_set_data_response,
-        Context,
+        context_get_data, context_get_id, context_get_recipients, context_recipient_at,
+        context_recipient_count, context_set_data_response, context_set_response,
+        context_view_data, context_view_peer, context_view_sender, Addresses, Context, Pooled,
+        Spill,
     };
     use std::{
         ffi::{CStr, CString},
@@ -190,7 +429,7 @@ mod test {
 
         let mut recipients = mailparse::addrparse("test@gmail.com").unwrap();
         recipients.extend_from_slice(&mailparse::addrparse("test@test.com").unwrap()[..]);
-        vctx.rcpt_to = Some(recipients);
+        vctx.rcpt_to = Addresses::from(&recipients);
 
         let buffer = context_get_recipients(&vctx);
         assert_eq!(buffer.len, 2);
@@ -218,7 +457,6 @@ mod test {
     fn test_set_sender() {
         let mut vctx = Context {
             id: String::from("Testing"),
-            mail_from: None,
             ..Default::default()
         };
 
@@ -226,7 +464,7 @@ mod test {
             assert_eq!(context_set_sender(&mut vctx, cstr!("test@test.com")), 0);
             assert_eq!(
                 vctx.mail_from,
-                Some(mailparse::addrparse("test@test.com").unwrap())
+                Addresses::from(&mailparse::addrparse("test@test.com").unwrap())
             );
         }
     }
@@ -235,13 +473,13 @@ mod test {
     fn test_null_sender() {
         let mut vctx = Context {
             id: String::from("Testing"),
-            mail_from: Some(mailparse::addrparse("test@test.com").unwrap()),
+            mail_from: Addresses::from(&mailparse::addrparse("test@test.com").unwrap()),
             ..Default::default()
         };
 
         unsafe {
             assert_eq!(context_set_sender(&mut vctx, null()), 0);
-            assert_eq!(vctx.mail_from, None);
+            assert!(vctx.mail_from.is_empty());
         }
     }
 
@@ -251,13 +489,13 @@ mod test {
 
         let mut vctx = Context {
             id: String::from("Testing"),
-            mail_from: Some(sender.clone()),
+            mail_from: Addresses::from(&sender),
             ..Default::default()
         };
 
         unsafe {
             assert_eq!(context_set_sender(&mut vctx, cstr!("---")), 1);
-            assert_eq!(vctx.mail_from, Some(sender));
+            assert_eq!(vctx.mail_from, Addresses::from(&sender));
         }
     }
 
@@ -288,6 +526,129 @@ mod test {
         assert_eq!(context_get_data(&vctx).data, null());
     }
 
+    #[test]
+    fn test_view_data() {
+        let vctx = Context {
+            data: Some(b"Testing\0Data".to_vec()),
+            ..Default::default()
+        };
+
+        let view = context_view_data(&vctx);
+        assert_eq!(view.data, vctx.data.as_ref().unwrap().as_ptr());
+
+        let data = unsafe { std::slice::from_raw_parts(view.data, view.len) };
+        assert_eq!(data, b"Testing\0Data");
+    }
+
+    #[test]
+    fn test_view_no_data() {
+        let vctx = Context::default();
+
+        let view = context_view_data(&vctx);
+        assert_eq!(view.len, 0);
+        assert_eq!(view.data, null());
+    }
+
+    #[test]
+    fn test_view_spilled() {
+        let mut spill = Spill::create(&std::env::temp_dir()).unwrap();
+        spill.write(b"Spilled\0Data").unwrap();
+        spill.map().unwrap();
+
+        let vctx = Context {
+            data: Some(Vec::new()),
+            spilled: Some(spill),
+            ..Default::default()
+        };
+
+        let view = context_view_data(&vctx);
+        let data = unsafe { std::slice::from_raw_parts(view.data, view.len) };
+        assert_eq!(data, b"Spilled\0Data");
+    }
+
+    #[test]
+    fn test_view_sender() {
+        let vctx = Context {
+            mail_from: Addresses::from(&mailparse::addrparse("Test <test@test.com>").unwrap()),
+            ..Default::default()
+        };
+
+        let view = context_view_sender(&vctx);
+        let sender = unsafe { std::slice::from_raw_parts(view.data, view.len) };
+        assert_eq!(sender, b"test@test.com");
+
+        assert_eq!(context_view_sender(&Context::default()).len, 0);
+    }
+
+    #[test]
+    fn test_recipient_at() {
+        let mut vctx = Context::default();
+
+        let mut recipients = mailparse::addrparse("test@gmail.com").unwrap();
+        recipients.extend_from_slice(&mailparse::addrparse("test@test.com").unwrap()[..]);
+        vctx.rcpt_to = Addresses::from(&recipients);
+
+        assert_eq!(context_recipient_count(&vctx), 2);
+
+        let view = context_recipient_at(&vctx, 1);
+        let recipient = unsafe { std::slice::from_raw_parts(view.data, view.len) };
+        assert_eq!(recipient, b"test@test.com");
+
+        assert_eq!(context_recipient_at(&vctx, 2).data, null());
+    }
+
+    #[test]
+    fn test_reset() {
+        let mut vctx = Context {
+            id: String::from("test"),
+            peer: String::from("::1"),
+            mail_from: Addresses::from(&mailparse::addrparse("test@gmail.com").unwrap()),
+            rcpt_to: Addresses::from(&mailparse::addrparse("test@test.com").unwrap()),
+            data: Some(b"Hello".to_vec()),
+            spilled: Some(Spill::create(&std::env::temp_dir()).unwrap()),
+            declared_size: Some(5),
+            eight_bit: true,
+            data_response: Some(String::from("Ok")),
+            response: Some(String::from("Rejected")),
+        };
+
+        vctx.reset();
+        assert_eq!(vctx.id, "test");
+        assert_eq!(vctx.peer, "::1");
+        assert_eq!(vctx.response, None);
+        assert!(vctx.mail_from.is_empty());
+        assert_eq!(vctx.recipient_count(), 0);
+        assert_eq!(vctx.data.as_deref(), Some(&b""[..]));
+        assert!(vctx.data_response.is_none());
+        assert!(vctx.spilled.is_none());
+        assert!(vctx.declared_size.is_none());
+        assert!(!vctx.eight_bit);
+
+        let capacity = vctx.data.as_ref().unwrap().capacity();
+        vctx.begin_data(true);
+        assert_eq!(vctx.data.as_ref().unwrap().capacity(), capacity);
+
+        vctx.begin_data(false);
+        assert!(vctx.data.is_none());
+    }
+
+    #[test]
+    fn test_pooled() {
+        let data = {
+            let mut vctx = Pooled::default();
+            vctx.id = String::from("test");
+            vctx.begin_data(true);
+            vctx.data.as_mut().unwrap().extend_from_slice(b"Hello");
+            vctx.data.as_ref().unwrap().as_ptr()
+        };
+
+        // The same context is handed out again, reset but with its buffers intact
+        let vctx = Pooled::default();
+        assert!(vctx.id.is_empty());
+        assert_eq!(vctx.data.as_ref().unwrap().as_ptr(), data);
+        assert!(vctx.data.as_ref().unwrap().is_empty());
+    }
+
     #[test]
     fn test_set_data_response() {
         let mut vctx = Context::default();
@@ -308,4 +669,22 @@ mod test {
         assert_eq!(ans, 0);
         assert_eq!(vctx.data_response, None);
     }
+
+    #[test]
+    fn test_response() {
+        let mut vctx = Context {
+            peer: String::from("192.0.2.1"),
+            ..Default::default()
+        };
+
+        let peer = context_view_peer(&vctx);
+        let peer = unsafe { std::slice::from_raw_parts(peer.data, peer.len) };
+        assert_eq!(peer, b"192.0.2.1");
+
+        unsafe { context_set_response(&mut vctx, cstr!("Go away")) };
+        assert_eq!(vctx.response.as_deref(), Some("Go away"));
+
+        vctx.reset();
+        assert_eq!(vctx.response, None);
+    }
 }
@@ -0,0 +1,205 @@
+use std::fmt::{Display, Formatter};
+
+use mailparse::{MailAddr, MailAddrList};
+
+/// Where a single address is in the buffer of the `Addresses` it belongs to
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+struct Span {
+    /// The start of the display name, which ends where the address starts
+    start: usize,
+    /// The start of the address
+    address: usize,
+    /// Where the `@` separating the local part from the domain is, or the end
+    /// of the address if there isn't one
+    at: usize,
+    end: usize,
+    /// A group is kept as its name, with none of its members
+    group: bool,
+}
+
+///
+/// A borrowed view of a single address
+///
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct Address<'a> {
+    pub display_name: Option<&'a str>,
+    /// The bare address, or the name of a group
+    pub address: &'a str,
+    at: usize,
+    group: bool,
+}
+
+impl<'a> Address<'a> {
+    /// Everything before the `@`, or the whole address if there isn't one
+    pub fn local_part(&self) -> &'a str {
+        &self.address[..self.at]
+    }
+
+    /// Everything after the `@`, which is empty if there isn't one
+    pub fn domain(&self) -> &'a str {
+        self.address.get(self.at + 1..).unwrap_or_default()
+    }
+}
+
+impl Display for Address<'_> {
+    fn fmt(&self, fmt: &mut Formatter<'_>) -> std::fmt::Result {
+        match self.display_name {
+            _ if self.group => write!(fmt, "{}:;", self.address),
+            Some(name) => write!(fmt, "\"{name}\" <{}>", self.address),
+            None => fmt.write_str(self.address),
+        }
+    }
+}
+
+///
+/// A list of envelope addresses, parsed once when they're received. They're
+/// all held in a single buffer, with each address just being offsets into it,
+/// so that reading them never needs to allocate, and clearing them keeps the
+/// buffer for the next transaction.
+///
+#[derive(Clone, Debug, Default, PartialEq, Eq)]
+pub struct Addresses {
+    buffer: String,
+    spans: Vec<Span>,
+}
+
+impl Addresses {
+    pub fn len(&self) -> usize {
+        self.spans.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.spans.is_empty()
+    }
+
+    /// Remove every address, keeping the allocations
+    pub fn clear(&mut self) {
+        self.buffer.clear();
+        self.spans.clear();
+    }
+
+    /// Keep only the first `len` addresses
+    pub fn truncate(&mut self, len: usize) {
+        if let Some(span) = self.spans.get(len) {
+            self.buffer.truncate(span.start);
+            self.spans.truncate(len);
+        }
+    }
+
+    /// Replace every address with `addrs`, or none at all
+    pub fn set(&mut self, addrs: Option<&MailAddrList>) {
+        self.clear();
+
+        if let Some(addrs) = addrs {
+            self.extend(addrs);
+        }
+    }
+
+    pub fn push(&mut self, addr: &MailAddr) {
+        let start = self.buffer.len();
+
+        let (address, group) = match addr {
+            MailAddr::Group(group) => (group.group_name.as_str(), true),
+            MailAddr::Single(single) => {
+                if let Some(ref name) = single.display_name {
+                    self.buffer.push_str(name);
+                }
+                (single.addr.as_str(), false)
+            }
+        };
+
+        let offset = self.buffer.len();
+        self.buffer.push_str(address);
+
+        self.spans.push(Span {
+            start,
+            address: offset,
+            at: offset + address.rfind('@').unwrap_or(address.len()),
+            end: self.buffer.len(),
+            group,
+        });
+    }
+
+    pub fn extend(&mut self, addrs: &[MailAddr]) {
+        for addr in addrs {
+            self.push(addr);
+        }
+    }
+
+    pub fn get(&self, index: usize) -> Option<Address<'_>> {
+        self.spans.get(index).map(|span| Address {
+            display_name: (span.start != span.address)
+                .then(|| &self.buffer[span.start..span.address]),
+            address: &self.buffer[span.address..span.end],
+            at: span.at - span.address,
+            group: span.group,
+        })
+    }
+
+    pub fn first(&self) -> Option<Address<'_>> {
+        self.get(0)
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = Address<'_>> {
+        (0..self.len()).filter_map(|index| self.get(index))
+    }
+}
+
+impl From<&MailAddrList> for Addresses {
+    fn from(addrs: &MailAddrList) -> Self {
+        let mut addresses = Self::default();
+        addresses.extend(addrs);
+        addresses
+    }
+}
+
+impl Display for Addresses {
+    fn fmt(&self, fmt: &mut Formatter<'_>) -> std::fmt::Result {
+        for (index, address) in self.iter().enumerate() {
+            if index > 0 {
+                fmt.write_str(", ")?;
+            }
+            write!(fmt, "{address}")?;
+        }
+
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::Addresses;
+
+    #[test]
+    fn test_addresses() {
+        let mut addresses = Addresses::from(
+            &mailparse::addrparse("Test <test@test.com>, other@gmail.com").unwrap(),
+        );
+        assert_eq!(addresses.len(), 2);
+
+        let first = addresses.first().unwrap();
+        assert_eq!(first.display_name, Some("Test"));
+        assert_eq!(first.address, "test@test.com");
+        assert_eq!(first.local_part(), "test");
+        assert_eq!(first.domain(), "test.com");
+
+        let second = addresses.get(1).unwrap();
+        assert_eq!(second.display_name, None);
+        assert_eq!(second.domain(), "gmail.com");
+        assert!(addresses.get(2).is_none());
+
+        assert_eq!(
+            addresses.to_string(),
+            "\"Test\" <test@test.com>, other@gmail.com"
+        );
+
+        addresses.truncate(1);
+        assert_eq!(addresses.to_string(), "\"Test\" <test@test.com>");
+        addresses.push(&mailparse::addrparse("again@gmail.com").unwrap()[0]);
+        assert_eq!(addresses.get(1).unwrap().address, "again@gmail.com");
+
+        addresses.set(None);
+        assert!(addresses.is_empty());
+        assert_eq!(addresses.to_string(), "");
+    }
+}
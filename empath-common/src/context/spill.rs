@@ -0,0 +1,255 @@
+use std::{
+    collections::hash_map::RandomState,
+    fmt::Debug,
+    fs::{File, OpenOptions},
+    hash::{BuildHasher, Hasher},
+    io::Write,
+    os::{fd::AsRawFd, unix::fs::OpenOptionsExt},
+    path::Path,
+    sync::atomic::{AtomicU64, Ordering},
+};
+
+/// Used to give every spill file created by this process a unique name
+static SPILLS: AtomicU64 = AtomicU64::new(0);
+
+/// A read-only mapping of a whole spill file
+struct Mapping {
+    ptr: *mut libc::c_void,
+    len: usize,
+}
+
+// SAFETY: The mapping is private and read only, so it can't change underneath
+// whoever is reading it, and it is only unmapped when dropped
+unsafe impl Send for Mapping {}
+unsafe impl Sync for Mapping {}
+
+impl Drop for Mapping {
+    fn drop(&mut self) {
+        unsafe {
+            libc::munmap(self.ptr, self.len);
+        }
+    }
+}
+
+///
+/// A message body that was too large to hold in memory, written to a file
+/// instead. The file never has a name where the system allows it, and is
+/// otherwise unlinked as soon as it is created, so it disappears with the
+/// process even if it isn't cleaned up. Only this user can open it either way.
+///
+/// Once the whole body has been written, it is mapped so that it can be read
+/// as a slice like any other body.
+///
+pub struct Spill {
+    file: File,
+    len: usize,
+    mapping: Option<Mapping>,
+}
+
+impl Debug for Spill {
+    fn fmt(&self, fmt: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        fmt.debug_struct("Spill")
+            .field("len", &self.len)
+            .field("mapped", &self.mapping.is_some())
+            .finish_non_exhaustive()
+    }
+}
+
+impl Spill {
+    ///
+    /// Create an empty spill file in `directory`
+    ///
+    /// # Errors
+    /// If the file can't be created
+    ///
+    pub fn create(directory: &Path) -> std::io::Result<Self> {
+        let file = match Self::anonymous(directory) {
+            Ok(file) => file,
+            Err(err) if !Self::unsupported(&err) => return Err(err),
+            Err(_) => Self::named(directory)?,
+        };
+
+        Ok(Self {
+            file,
+            len: 0,
+            mapping: None,
+        })
+    }
+
+    /// A file in `directory` that never has a name, so that nothing else can
+    /// ever open it
+    #[cfg(target_os = "linux")]
+    fn anonymous(directory: &Path) -> std::io::Result<File> {
+        OpenOptions::new()
+            .read(true)
+            .write(true)
+            .mode(0o600)
+            .custom_flags(libc::O_TMPFILE)
+            .open(directory)
+    }
+
+    #[cfg(not(target_os = "linux"))]
+    fn anonymous(_directory: &Path) -> std::io::Result<File> {
+        Err(std::io::ErrorKind::Unsupported.into())
+    }
+
+    /// Whether `err` means `directory` can't hold files without names
+    fn unsupported(err: &std::io::Error) -> bool {
+        err.kind() == std::io::ErrorKind::Unsupported
+            || matches!(
+                err.raw_os_error(),
+                Some(libc::EOPNOTSUPP | libc::EISDIR | libc::EINVAL)
+            )
+    }
+
+    /// A file in `directory` only this user can open, with a name no one else
+    /// can guess ahead of time, unlinked straight away
+    fn named(directory: &Path) -> std::io::Result<File> {
+        let mut random = RandomState::new().build_hasher();
+        random.write_u64(SPILLS.fetch_add(1, Ordering::Relaxed));
+
+        let path = directory.join(format!(
+            "empath-{}-{:016x}.spill",
+            std::process::id(),
+            random.finish()
+        ));
+
+        let file = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create_new(true)
+            .mode(0o600)
+            .custom_flags(libc::O_NOFOLLOW)
+            .open(&path)?;
+        std::fs::remove_file(&path)?;
+
+        Ok(file)
+    }
+
+    ///
+    /// Append `bytes` to the body
+    ///
+    /// # Errors
+    /// If writing to the file fails, or the body has already been mapped
+    ///
+    pub fn write(&mut self, bytes: &[u8]) -> std::io::Result<()> {
+        if self.mapping.is_some() {
+            return Err(std::io::ErrorKind::PermissionDenied.into());
+        }
+
+        self.file.write_all(bytes)?;
+        self.len += bytes.len();
+
+        Ok(())
+    }
+
+    ///
+    /// Another handle to the file the body is in, so that it can be copied
+    /// elsewhere without going through the mapping. The handle shares the
+    /// file's offset, so it should only be read with positioned reads.
+    ///
+    /// # Errors
+    /// If the file can't be duplicated
+    ///
+    pub fn file(&self) -> std::io::Result<File> {
+        self.file.try_clone()
+    }
+
+    pub const fn len(&self) -> usize {
+        self.len
+    }
+
+    pub const fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    ///
+    /// Map the body, once all of it has been written. Nothing more can be
+    /// written after this.
+    ///
+    /// # Errors
+    /// If the file can't be mapped
+    ///
+    pub fn map(&mut self) -> std::io::Result<()> {
+        // A zero length mapping is invalid, and there's nothing to read anyway
+        if self.mapping.is_some() || self.len == 0 {
+            return Ok(());
+        }
+
+        let ptr = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                self.len,
+                libc::PROT_READ,
+                libc::MAP_PRIVATE,
+                self.file.as_raw_fd(),
+                0,
+            )
+        };
+
+        if ptr == libc::MAP_FAILED {
+            return Err(std::io::Error::last_os_error());
+        }
+
+        // Modules almost always read the body front to back, so ask for it to
+        // be read ahead. This is only advice, so it failing doesn't matter.
+        unsafe {
+            libc::madvise(ptr, self.len, libc::MADV_SEQUENTIAL);
+        }
+
+        self.mapping = Some(Mapping { ptr, len: self.len });
+
+        Ok(())
+    }
+
+    /// The whole body, if it has been mapped
+    pub fn as_slice(&self) -> Option<&[u8]> {
+        if self.mapping.is_none() && self.len == 0 {
+            return Some(&[]);
+        }
+
+        self.mapping
+            .as_ref()
+            .map(|mapping| unsafe { std::slice::from_raw_parts(mapping.ptr.cast(), mapping.len) })
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::Spill;
+
+    #[test]
+    fn test_spill() {
+        let mut spill = Spill::create(&std::env::temp_dir()).unwrap();
+        spill.write(b"Hello ").unwrap();
+        spill.write(b"World").unwrap();
+        assert_eq!(spill.len(), 11);
+        assert!(spill.as_slice().is_none());
+
+        spill.map().unwrap();
+        assert_eq!(spill.as_slice(), Some(&b"Hello World"[..]));
+        assert!(spill.write(b"!").is_err());
+
+        let mut body = [0; 5];
+        std::os::unix::fs::FileExt::read_exact_at(&spill.file().unwrap(), &mut body, 6).unwrap();
+        assert_eq!(&body, b"World");
+    }
+
+    #[test]
+    fn test_private() {
+        let directory = std::env::temp_dir();
+        let spills = [
+            Spill::create(&directory).unwrap().file,
+            Spill::named(&directory).unwrap(),
+        ];
+
+        for file in &spills {
+            let metadata = file.metadata().unwrap();
+            assert_eq!(
+                std::os::unix::fs::PermissionsExt::mode(&metadata.permissions()) & 0o777,
+                0o600
+            );
+            assert_eq!(std::os::unix::fs::MetadataExt::nlink(&metadata), 0);
+        }
+    }
+}
@@ -1,13 +1,31 @@
 use std::{
-    fmt::Display,
-    sync::{LazyLock, RwLock},
+    ffi::{CStr, CString, OsStr},
+    fmt::{Display, Write},
+    fs::{File, OpenOptions},
+    os::unix::{ffi::OsStrExt, fs::OpenOptionsExt},
+    path::{Path, PathBuf},
+    sync::{
+        atomic::{AtomicUsize, Ordering},
+        Arc, LazyLock, Mutex, Once,
+    },
+    time::Duration,
 };
 
+use arc_swap::{ArcSwap, Guard};
 use libloading::Library;
 use serde::{Deserialize, Serialize};
 use thiserror::Error;
+use tokio::{
+    sync::{mpsc, oneshot, Semaphore},
+    task::JoinSet,
+    time::Instant,
+};
 
-use crate::{context::Context, internal};
+use crate::{
+    context::Context,
+    internal,
+    metrics::{self, Histogram},
+};
 
 use super::string::StringVector;
 
@@ -15,19 +33,123 @@ use super::string::StringVector;
 #[derive(Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
 pub enum Event {
     ValidateData,
+    DataEnd,
+    Connect,
+    Helo,
+    MailFrom,
+    RcptTo,
+}
+
+impl Event {
+    /// How many events there are, for indexing the dispatch tables
+    const COUNT: usize = 6;
+
+    /// This event's bit in `Registry::subscribed`
+    const fn bit(self) -> u32 {
+        1 << self as u32
+    }
 }
 
 impl Display for Event {
     fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
         match self {
             Self::ValidateData => f.write_str("validate_data"),
+            Self::DataEnd => f.write_str("on_data_end"),
+            Self::Connect => f.write_str("on_connect"),
+            Self::Helo => f.write_str("on_helo"),
+            Self::MailFrom => f.write_str("on_mail_from"),
+            Self::RcptTo => f.write_str("on_rcpt_to"),
         }
     }
 }
 
+type Validator = unsafe extern "C" fn(&mut Context) -> i32;
+type ChunkValidator = unsafe extern "C" fn(&mut Context, *const u8, usize) -> i32;
+/// The same as a `Validator`, but only ever given shared access to the context
+type SharedValidator = unsafe extern "C" fn(*const Context) -> i32;
+type AsyncValidator = unsafe extern "C" fn(*mut Context, *mut Completion);
+type BatchValidator = unsafe extern "C" fn(*mut *mut Context, usize, *mut i32);
+
+///
+/// Set in `ValidationModule::flags` by modules that never modify the context
+/// from any of their synchronous callbacks. These can be run at the same time
+/// as each other, against the same context.
+///
+pub const MODULE_CONCURRENT: u32 = 1;
+
+///
+/// The version of the layout of `ValidationModule`, which has to be the same
+/// as the one a module was built against for it to be loaded. This goes up
+/// whenever a field is added to it, or to `Validators`. `EM_DECLARE_MODULE`
+/// exports it from the module as `module_abi_version`.
+///
+pub const MODULE_ABI_VERSION: u32 = 1;
+
+/// What an asynchronous validation that isn't completed in time is answered
+/// with, so that the client tries again later
+const TIMED_OUT: i32 = 451;
+
+///
+/// Set in `ValidationModule::capabilities`, one for each of the `Validators` a
+/// module implements. Only the callbacks declared here are ever called. A
+/// module that leaves `capabilities` as 0 has it worked out from whichever of
+/// its callbacks are set.
+///
+pub const CAPABILITY_VALIDATE_DATA: u32 = 1 << 0;
+pub const CAPABILITY_DATA_CHUNK: u32 = 1 << 1;
+pub const CAPABILITY_DATA_END: u32 = 1 << 2;
+pub const CAPABILITY_VALIDATE_DATA_ASYNC: u32 = 1 << 3;
+pub const CAPABILITY_VALIDATE_DATA_BATCH: u32 = 1 << 4;
+pub const CAPABILITY_CONNECT: u32 = 1 << 5;
+pub const CAPABILITY_HELO: u32 = 1 << 6;
+pub const CAPABILITY_MAIL_FROM: u32 = 1 << 7;
+pub const CAPABILITY_RCPT_TO: u32 = 1 << 8;
+
+///
+/// The callbacks a module can register. For all of these, returning non-zero
+/// will reject the message.
+///
+/// Modules should implement either `validate_data`, which is called once the
+/// whole message has been received, or `on_data_chunk` and `on_data_end` if they
+/// are loaded in streaming mode. In streaming mode, each chunk of the body is
+/// passed to the module as it is read from the client, and is only valid for
+/// the duration of that call. `validate_data` can also return a 4xx reply code
+/// (e.g. 451), to have the client try the message again later.
+///
+/// Modules that need to wait on something else (e.g. a network service) can
+/// implement `validate_data_async` instead of `validate_data`. It should start
+/// the validation and return straight away, then call `context_complete` with
+/// the handle it was given, from any thread, once it has an answer. The
+/// context stays valid until then. If it doesn't answer within the module's
+/// `timeout`, the message is turned away with a 451 without waiting any longer.
+///
+/// Modules that are more efficient when given several messages at once can
+/// implement `validate_data_batch` instead. It is given an array of contexts,
+/// and should write the result for each of them into the matching entry of the
+/// results array. Messages from concurrent sessions are collected into batches
+/// as configured by the module's `batching`.
+///
+/// Modules can also turn clients away before they send a message at all, with
+/// `on_connect`, `on_helo`, `on_mail_from` and `on_rcpt_to`. Each is called
+/// once the command has been received, but before it is replied to, and
+/// rejecting it rejects just that command (or the whole session, for
+/// `on_connect`). The address of the client is available from
+/// `context_view_peer`, and in `on_rcpt_to` the recipients given by the command
+/// are the last ones in the context. These can return the reply code to reject
+/// with (e.g. 450 or 554), or any other non-zero value for a 550, and can set
+/// the text of the reply with `context_set_response`.
+///
 #[repr(C)]
 pub struct Validators {
     pub validate_data: Option<unsafe extern "C" fn(&mut Context) -> i32>,
+    pub on_data_chunk: Option<unsafe extern "C" fn(&mut Context, *const u8, usize) -> i32>,
+    pub on_data_end: Option<unsafe extern "C" fn(&mut Context) -> i32>,
+    pub validate_data_async: Option<unsafe extern "C" fn(*mut Context, *mut Completion)>,
+    pub validate_data_batch: Option<unsafe extern "C" fn(*mut *mut Context, usize, *mut i32)>,
+    pub on_connect: Option<unsafe extern "C" fn(&mut Context) -> i32>,
+    pub on_helo: Option<unsafe extern "C" fn(&mut Context) -> i32>,
+    pub on_mail_from: Option<unsafe extern "C" fn(&mut Context) -> i32>,
+    pub on_rcpt_to: Option<unsafe extern "C" fn(&mut Context) -> i32>,
 }
 
 #[repr(C)]
@@ -36,20 +158,78 @@ pub struct ValidationModule {
     pub module_name: *const libc::c_char,
     pub init: unsafe extern "C" fn(StringVector) -> i32,
     pub validators: Validators,
+    /// Any of the `MODULE_*` flags, describing how the module can be called
+    pub flags: u32,
+    /// Any of the `CAPABILITY_*` flags, for the callbacks the module implements
+    pub capabilities: u32,
 }
 
 unsafe impl Send for ValidationModule {}
 unsafe impl Sync for ValidationModule {}
 
 impl ValidationModule {
-    ///
-    /// Emit an event to this library's validation module
-    ///
-    pub fn emit(&self, event: Event, context: &mut Context) {
-        match event {
-            Event::ValidateData => {
-                unsafe { self.validators.validate_data.map(|func| func(context)) };
-            }
+    /// The `CAPABILITY_*` flags for whichever callbacks are set
+    fn implemented(&self) -> u32 {
+        let validators = &self.validators;
+
+        [
+            (validators.validate_data.is_some(), CAPABILITY_VALIDATE_DATA),
+            (validators.on_data_chunk.is_some(), CAPABILITY_DATA_CHUNK),
+            (validators.on_data_end.is_some(), CAPABILITY_DATA_END),
+            (
+                validators.validate_data_async.is_some(),
+                CAPABILITY_VALIDATE_DATA_ASYNC,
+            ),
+            (
+                validators.validate_data_batch.is_some(),
+                CAPABILITY_VALIDATE_DATA_BATCH,
+            ),
+            (validators.on_connect.is_some(), CAPABILITY_CONNECT),
+            (validators.on_helo.is_some(), CAPABILITY_HELO),
+            (validators.on_mail_from.is_some(), CAPABILITY_MAIL_FROM),
+            (validators.on_rcpt_to.is_some(), CAPABILITY_RCPT_TO),
+        ]
+        .into_iter()
+        .filter_map(|(set, capability)| set.then_some(capability))
+        .fold(0, |capabilities, capability| capabilities | capability)
+    }
+
+    /// The callbacks this module has, as declared, or as worked out from
+    /// whichever are set if it didn't declare any
+    fn capabilities(&self) -> u32 {
+        if self.capabilities == 0 {
+            self.implemented()
+        } else {
+            self.capabilities
+        }
+    }
+
+    /// The callbacks this module has, with any it didn't declare left out
+    fn validators(&self) -> Validators {
+        let capabilities = self.capabilities();
+        let has = |capability: u32| capabilities & capability != 0;
+        let validators = &self.validators;
+
+        Validators {
+            validate_data: validators
+                .validate_data
+                .filter(|_| has(CAPABILITY_VALIDATE_DATA)),
+            on_data_chunk: validators
+                .on_data_chunk
+                .filter(|_| has(CAPABILITY_DATA_CHUNK)),
+            on_data_end: validators.on_data_end.filter(|_| has(CAPABILITY_DATA_END)),
+            validate_data_async: validators
+                .validate_data_async
+                .filter(|_| has(CAPABILITY_VALIDATE_DATA_ASYNC)),
+            validate_data_batch: validators
+                .validate_data_batch
+                .filter(|_| has(CAPABILITY_VALIDATE_DATA_BATCH)),
+            on_connect: validators.on_connect.filter(|_| has(CAPABILITY_CONNECT)),
+            on_helo: validators.on_helo.filter(|_| has(CAPABILITY_HELO)),
+            on_mail_from: validators
+                .on_mail_from
+                .filter(|_| has(CAPABILITY_MAIL_FROM)),
+            on_rcpt_to: validators.on_rcpt_to.filter(|_| has(CAPABILITY_RCPT_TO)),
         }
     }
 }
@@ -75,6 +255,45 @@ pub enum Error {
     Validation(String),
 }
 
+/// How a module's callbacks are called
+#[derive(Serialize, Deserialize, Clone, Copy, PartialEq, Eq, Debug, Default)]
+pub enum Execution {
+    /// Called directly from the session, which is fine for modules that
+    /// return quickly
+    #[default]
+    Inline,
+    /// Called on a blocking thread pool, so that a slow module only holds up
+    /// the session waiting on it, and not every other session scheduled on the
+    /// same worker thread
+    Blocking,
+}
+
+/// How messages are collected into batches, for modules implementing
+/// `validate_data_batch`
+#[derive(Serialize, Deserialize, Clone, Copy, PartialEq, Eq, Debug)]
+#[serde(default)]
+pub struct Batching {
+    /// The most messages to hand to the module at once
+    pub size: usize,
+    /// How long to wait for a batch to fill up, in milliseconds, after the
+    /// first message arrives
+    pub wait: u64,
+}
+
+impl Default for Batching {
+    fn default() -> Self {
+        Self { size: 32, wait: 2 }
+    }
+}
+
+const fn default_timeout() -> u64 {
+    30_000
+}
+
+fn default_workers() -> usize {
+    std::thread::available_parallelism().map_or(1, std::num::NonZeroUsize::get)
+}
+
 #[allow(
     clippy::unsafe_derive_deserialize,
     reason = "The unsafe aspects have nothing to do with the struct"
@@ -83,6 +302,22 @@ pub enum Error {
 pub struct SharedLibrary {
     pub name: String,
     pub arguments: Vec<String>,
+    /// When enabled, the module is handed the message body in chunks as it is
+    /// received (via `on_data_chunk` and `on_data_end`), instead of the whole
+    /// message in `validate_data`.
+    #[serde(default)]
+    pub streaming: bool,
+    #[serde(default)]
+    pub execution: Execution,
+    /// The most calls that can be in flight to a blocking module at once.
+    /// Sessions wait for one of these to free up before calling the module.
+    #[serde(default = "default_workers")]
+    pub workers: usize,
+    #[serde(default)]
+    pub batching: Batching,
+    /// How long an asynchronous validation has to complete, in milliseconds
+    #[serde(default = "default_timeout")]
+    pub timeout: u64,
     #[serde(skip)]
     module: Option<ValidationModule>,
     #[serde(skip)]
@@ -99,11 +334,35 @@ impl Display for SharedLibrary {
 }
 
 impl SharedLibrary {
-    fn init(&mut self) -> Result<(), Error> {
+    fn init(&mut self, generation: usize) -> Result<(), Error> {
         unsafe {
-            let lib = Library::new(&self.name)?;
+            let lib = if generation == 0 {
+                Library::new(&self.name)?
+            } else {
+                self.load_copy(generation)?
+            };
+
+            // Modules built before the ABI was versioned don't export it at all
+            let version = lib
+                .get::<unsafe extern "C" fn() -> u32>(b"module_abi_version")
+                .map_or(0, |version| version());
+            if version != MODULE_ABI_VERSION {
+                return Err(Error::Init(format!(
+                    "{} was built for version {version} of the module ABI, rather than \
+                     {MODULE_ABI_VERSION}, and needs to be rebuilt",
+                    self.name
+                )));
+            }
 
             let module = lib.get::<unsafe extern "C" fn() -> ValidationModule>(b"create_module")?();
+
+            let missing = module.capabilities() & !module.implemented();
+            if missing != 0 {
+                return Err(Error::Init(format!(
+                    "{} declares callbacks it doesn't implement ({missing:#x})",
+                    self.name
+                )));
+            }
             let arguments = self.arguments.clone();
             match std::panic::catch_unwind(|| (module.init)(arguments.into())) {
                 Ok(response) => {
@@ -117,19 +376,510 @@ impl SharedLibrary {
         }
     }
 
-    fn emit(&self, event: Event, vctx: &mut Context) {
-        if let Some(ref module) = self.module {
-            module.emit(event, vctx);
+    ///
+    /// Load a fresh copy of the library when reloading. Loading the same path
+    /// again, while the previous modules are still in use, would just hand back
+    /// the library that is already loaded rather than whatever is on disk now.
+    ///
+    /// The copy is made in a directory of its own that only this user can
+    /// reach, so nobody else can swap it for something else before it's loaded.
+    ///
+    unsafe fn load_copy(&self, generation: usize) -> Result<Library, Error> {
+        let path = Path::new(&self.name);
+
+        // Libraries found through the search path can't be copied, and will
+        // only be picked up again once the old ones are unloaded
+        let Some(file_name) = path.file_name().filter(|_| path.is_file()) else {
+            return Ok(Library::new(&self.name)?);
+        };
+
+        let copy_failed =
+            |err: std::io::Error| Error::Init(format!("Unable to copy {}: {err}", self.name));
+
+        let directory = PrivateDir::create().map_err(copy_failed)?;
+        let copy = directory
+            .0
+            .join(format!("{generation}-{}", file_name.to_string_lossy()));
+
+        // Creating the copy fails rather than following anything already there
+        let mut target = OpenOptions::new()
+            .write(true)
+            .create_new(true)
+            .custom_flags(libc::O_NOFOLLOW)
+            .mode(0o700)
+            .open(&copy)
+            .map_err(copy_failed)?;
+        std::io::copy(&mut File::open(path).map_err(copy_failed)?, &mut target)
+            .map_err(copy_failed)?;
+        drop(target);
+
+        // Once loaded, the copy is only needed for as long as it's mapped, so
+        // it goes along with the directory
+        Ok(Library::new(&copy)?)
+    }
+
+    /// Add the callbacks this library handles to the dispatch tables
+    fn register(&self, registry: &mut Registry) {
+        let Some(ref module) = self.module else {
+            return;
+        };
+
+        // Modules can name themselves, otherwise they're known by their path
+        let name = if module.module_name.is_null() {
+            self.name.clone()
+        } else {
+            unsafe { CStr::from_ptr(module.module_name) }
+                .to_string_lossy()
+                .into_owned()
+        };
+
+        let workers = (self.execution == Execution::Blocking)
+            .then(|| Arc::new(Semaphore::new(self.workers.max(1))));
+        let concurrent = module.flags & MODULE_CONCURRENT != 0;
+
+        let validators = &module.validators();
+
+        // The commands before the message can be screened whatever mode the
+        // module is loaded in
+        for (event, validator) in [
+            (Event::Connect, validators.on_connect),
+            (Event::Helo, validators.on_helo),
+            (Event::MailFrom, validators.on_mail_from),
+            (Event::RcptTo, validators.on_rcpt_to),
+        ] {
+            if let Some(validator) = validator {
+                let handler = Handler::new(Callback::Sync(validator), workers.clone());
+                registry.add(&name, event, concurrent, handler);
+            }
+        }
+
+        if self.streaming {
+            if let Some(validator) = validators.on_data_end {
+                let handler = Handler::new(Callback::Sync(validator), workers);
+                registry.add(&name, Event::DataEnd, concurrent, handler);
+            }
+
+            if let Some(validator) = validators.on_data_chunk {
+                registry.add_chunk(&name, validator);
+            }
+        } else if let Some(validator) = validators.validate_data_batch {
+            let batcher = Batcher::new(validator, self.batching);
+            let handler = Handler::new(Callback::Batch(Arc::new(batcher)), None);
+            registry.add(&name, Event::ValidateData, false, handler);
+        } else if let Some(validator) = validators.validate_data_async {
+            // These don't hold up a thread while they run, and are handed the
+            // context outright, so are always run on their own
+            let timeout = Duration::from_millis(self.timeout);
+            let handler = Handler::new(Callback::Async(validator, timeout), None);
+            registry.add(&name, Event::ValidateData, false, handler);
+        } else if let Some(validator) = validators.validate_data {
+            let handler = Handler::new(Callback::Sync(validator), workers);
+            registry.add(&name, Event::ValidateData, concurrent, handler);
         }
     }
 }
 
+///
+/// A freshly made directory that only this user can reach, which is removed,
+/// along with everything in it, when dropped
+///
+struct PrivateDir(PathBuf);
+
+impl PrivateDir {
+    fn create() -> std::io::Result<Self> {
+        let template = std::env::temp_dir().join("empath-XXXXXX");
+        let mut template = CString::new(template.as_os_str().as_bytes())
+            .map_err(|err| std::io::Error::new(std::io::ErrorKind::InvalidInput, err))?
+            .into_bytes_with_nul();
+
+        // Picks a name that doesn't exist yet, and creates it with mode 0700
+        if unsafe { libc::mkdtemp(template.as_mut_ptr().cast()) }.is_null() {
+            return Err(std::io::Error::last_os_error());
+        }
+
+        template.pop();
+        Ok(Self(PathBuf::from(OsStr::from_bytes(&template))))
+    }
+}
+
+impl Drop for PrivateDir {
+    fn drop(&mut self) {
+        let _ = std::fs::remove_dir_all(&self.0);
+    }
+}
+
 #[derive(Serialize, Deserialize)]
 pub enum Module {
     SharedLibrary(SharedLibrary),
 }
 
-static MODULE_STORE: LazyLock<RwLock<Vec<Module>>> = LazyLock::new(RwLock::default);
+///
+/// The handle given to `validate_data_async`. This owns the context until the
+/// module completes the validation.
+///
+pub struct Completion {
+    context: *mut Context,
+    sender: oneshot::Sender<(Box<Context>, i32)>,
+    /// Keeps the module loaded until it has completed
+    registry: Arc<Registry>,
+}
+
+///
+/// Complete a validation started by `validate_data_async`, with the same
+/// meaning for `status` as the return value of `validate_data`.
+///
+/// This can be called from any thread, and must be called exactly once for
+/// each validation. Neither the handle nor the context can be used afterwards.
+///
+/// # Safety
+/// The handle must be one given to `validate_data_async`, that hasn't already
+/// been completed
+///
+#[no_mangle]
+pub unsafe extern "C" fn context_complete(handle: *mut Completion, status: i32) {
+    let completion = Box::from_raw(handle);
+    let context = Box::from_raw(completion.context);
+
+    // The session may have gone away in the meantime, in which case the
+    // context is simply dropped
+    let _ = completion.sender.send((context, status));
+    drop(completion.registry);
+}
+
+/// A message waiting to be validated as part of a batch
+struct Job {
+    context: Box<Context>,
+    sender: oneshot::Sender<(Box<Context>, i32)>,
+    /// Keeps the module loaded until the batch has been run
+    registry: Arc<Registry>,
+}
+
+///
+/// Collects messages from concurrent sessions into batches for a module. The
+/// task doing so is only started when the first message arrives, and stops
+/// once the module is unloaded.
+///
+struct Batcher {
+    validator: BatchValidator,
+    batching: Batching,
+    sender: mpsc::Sender<Job>,
+    receiver: Mutex<Option<mpsc::Receiver<Job>>>,
+    started: Once,
+}
+
+impl Batcher {
+    fn new(validator: BatchValidator, batching: Batching) -> Self {
+        let batching = Batching {
+            size: batching.size.max(1),
+            ..batching
+        };
+        // Once there's a full batch waiting, sessions have to wait for it to be
+        // picked up before they can add to the next one
+        let (sender, receiver) = mpsc::channel(batching.size);
+
+        Self {
+            validator,
+            batching,
+            sender,
+            receiver: Mutex::new(Some(receiver)),
+            started: Once::new(),
+        }
+    }
+
+    /// Add a message to the next batch, and wait for the module to validate it
+    async fn submit(&self, registry: &Arc<Registry>, vctx: &mut Context) -> i32 {
+        self.started.call_once(|| {
+            let receiver = self
+                .receiver
+                .lock()
+                .expect("Unable to start batching")
+                .take()
+                .expect("Batching has already been started");
+
+            tokio::spawn(Self::collect(self.validator, self.batching, receiver));
+        });
+
+        let (sender, receiver) = oneshot::channel();
+        let job = Job {
+            context: Box::new(std::mem::take(vctx)),
+            sender,
+            registry: Arc::clone(registry),
+        };
+
+        if self.sender.send(job).await.is_err() {
+            unreachable!("Batches are collected for as long as the module is loaded");
+        }
+
+        let (context, response) = receiver.await.expect("Batch was dropped");
+
+        *vctx = *context;
+        response
+    }
+
+    async fn collect(
+        validator: BatchValidator,
+        batching: Batching,
+        mut receiver: mpsc::Receiver<Job>,
+    ) {
+        let wait = Duration::from_millis(batching.wait);
+
+        while let Some(job) = receiver.recv().await {
+            let mut jobs = Vec::with_capacity(batching.size);
+            jobs.push(job);
+
+            let deadline = Instant::now() + wait;
+            while jobs.len() < batching.size {
+                match tokio::time::timeout_at(deadline, receiver.recv()).await {
+                    Ok(Some(job)) => jobs.push(job),
+                    Ok(None) | Err(_) => break,
+                }
+            }
+
+            // The batch is run on the blocking pool, so that the next one can be
+            // collected in the meantime
+            tokio::task::spawn_blocking(move || Self::run(validator, jobs));
+        }
+    }
+
+    fn run(validator: BatchValidator, mut jobs: Vec<Job>) {
+        let mut contexts = jobs
+            .iter_mut()
+            .map(|job| std::ptr::addr_of_mut!(*job.context))
+            .collect::<Vec<_>>();
+        let mut results = vec![0; jobs.len()];
+
+        unsafe { validator(contexts.as_mut_ptr(), contexts.len(), results.as_mut_ptr()) };
+
+        for (job, response) in jobs.into_iter().zip(results) {
+            // The session may have gone away in the meantime
+            let _ = job.sender.send((job.context, response));
+            drop(job.registry);
+        }
+    }
+}
+
+enum Callback {
+    Sync(Validator),
+    /// With how long the module has to complete each validation
+    Async(AsyncValidator, Duration),
+    Batch(Arc<Batcher>),
+}
+
+/// A callback for an event, and how it should be called
+struct Handler {
+    callback: Callback,
+    /// For blocking modules, limits how many calls can be in flight at once
+    workers: Option<Arc<Semaphore>>,
+    latency: Arc<Histogram>,
+}
+
+impl Handler {
+    fn new(callback: Callback, workers: Option<Arc<Semaphore>>) -> Self {
+        Self {
+            callback,
+            workers,
+            latency: Arc::default(),
+        }
+    }
+
+    /// Call this handler, recording how long it took (including any time spent
+    /// waiting for a worker or a batch)
+    async fn call(&self, registry: &Arc<Registry>, vctx: &mut Context) -> i32 {
+        let start = Instant::now();
+        let response = self.invoke(registry, vctx).await;
+        self.latency.record(start.elapsed(), response != 0);
+
+        response
+    }
+
+    async fn invoke(&self, registry: &Arc<Registry>, vctx: &mut Context) -> i32 {
+        let validator = match self.callback {
+            Callback::Sync(validator) => validator,
+            Callback::Async(validator, timeout) => {
+                return Self::call_async(validator, timeout, registry, vctx).await;
+            }
+            Callback::Batch(ref batcher) => return batcher.submit(registry, vctx).await,
+        };
+
+        let Some(ref workers) = self.workers else {
+            return unsafe { validator(vctx) };
+        };
+
+        let _permit = workers
+            .acquire()
+            .await
+            .expect("Module worker pool has been closed");
+
+        // The context is moved onto the blocking thread for the duration of the
+        // call, along with the registry, so that the library can't be unloaded
+        // out from under it even if the session goes away in the meantime.
+        let registry = Arc::clone(registry);
+        let mut context = std::mem::take(vctx);
+        let (context, response) = tokio::task::spawn_blocking(move || {
+            let response = unsafe { validator(&mut context) };
+            drop(registry);
+            (context, response)
+        })
+        .await
+        .expect("Blocking module panicked");
+
+        *vctx = context;
+        response
+    }
+
+    ///
+    /// Start an asynchronous validation, and wait up to `timeout` for the
+    /// module to complete it. If it doesn't, the module keeps the context, and
+    /// the session carries on with a fresh one for the same client.
+    ///
+    async fn call_async(
+        validator: AsyncValidator,
+        timeout: Duration,
+        registry: &Arc<Registry>,
+        vctx: &mut Context,
+    ) -> i32 {
+        let (id, peer) = (vctx.id.clone(), vctx.peer.clone());
+        let (sender, receiver) = oneshot::channel();
+        let context = Box::into_raw(Box::new(std::mem::take(vctx)));
+        let completion = Box::into_raw(Box::new(Completion {
+            context,
+            sender,
+            registry: Arc::clone(registry),
+        }));
+
+        unsafe { validator(context, completion) };
+
+        let Ok(completed) = tokio::time::timeout(timeout, receiver).await else {
+            internal!(
+                level = WARN,
+                "Asynchronous module didn't complete in {timeout:?}"
+            );
+            *vctx = Context {
+                id,
+                peer,
+                ..Default::default()
+            };
+            return TIMED_OUT;
+        };
+
+        let (context, response) = completed.expect("Asynchronous module dropped its completion");
+        *vctx = *context;
+        response
+    }
+
+    /// Call this handler with shared access to the context, from the blocking
+    /// thread pool
+    async fn spawn_shared(
+        &self,
+        tasks: &mut JoinSet<i32>,
+        registry: &Arc<Registry>,
+        context: &Arc<Context>,
+    ) {
+        let permit = match self.workers {
+            Some(ref workers) => Some(
+                Arc::clone(workers)
+                    .acquire_owned()
+                    .await
+                    .expect("Module worker pool has been closed"),
+            ),
+            None => None,
+        };
+
+        let Callback::Sync(validator) = self.callback else {
+            unreachable!("Only synchronous modules are run concurrently");
+        };
+
+        // SAFETY: A reference and a pointer to the context are ABI compatible,
+        // and concurrent modules have promised not to write through it
+        let validator = unsafe { std::mem::transmute::<Validator, SharedValidator>(validator) };
+        let registry = Arc::clone(registry);
+        let context = Arc::clone(context);
+        let latency = Arc::clone(&self.latency);
+        let start = Instant::now();
+
+        tasks.spawn_blocking(move || {
+            let response = unsafe { validator(Arc::as_ptr(&context)) };
+            latency.record(start.elapsed(), response != 0);
+            drop((permit, context, registry));
+            response
+        });
+    }
+}
+
+///
+/// An immutable snapshot of every loaded module, with the callbacks for each
+/// event flattened into their own array. Dispatching only has to load the
+/// current snapshot and call straight through those, and a new set of modules
+/// can be swapped in without blocking sessions that are mid-dispatch.
+///
+#[derive(Default)]
+struct Registry {
+    /// A bit for every event that has any callbacks, so that dispatching an
+    /// event nobody handles doesn't have to look any further
+    subscribed: u32,
+    /// The callbacks for each event, indexed by `Event`
+    validators: [Vec<Handler>; Event::COUNT],
+    /// The callbacks for each event that can all be run at once, as they won't
+    /// modify the context
+    concurrent: [Vec<Handler>; Event::COUNT],
+    /// Chunks are always handed to modules inline, as they are only valid for
+    /// the duration of the call
+    on_data_chunk: Vec<(ChunkValidator, Arc<Histogram>)>,
+    /// The latency of every callback, along with the labels identifying it
+    latencies: Vec<(String, Arc<Histogram>)>,
+    /// The modules the callbacks belong to, which have to be kept around for
+    /// as long as the callbacks are, as dropping them unloads the libraries
+    modules: Vec<Module>,
+}
+
+impl Registry {
+    fn new(modules: Vec<Module>) -> Self {
+        let mut registry = Self::default();
+
+        for module in &modules {
+            module.register(&mut registry);
+        }
+
+        registry.modules = modules;
+        registry
+    }
+
+    const fn subscribes(&self, event: Event) -> bool {
+        self.subscribed & event.bit() != 0
+    }
+
+    fn add(&mut self, name: &str, event: Event, concurrent: bool, handler: Handler) {
+        self.latencies.push((
+            format!("module=\"{}\",event=\"{event}\"", metrics::escape(name)),
+            Arc::clone(&handler.latency),
+        ));
+        self.subscribed |= event.bit();
+
+        if concurrent {
+            self.concurrent[event as usize].push(handler);
+        } else {
+            self.validators[event as usize].push(handler);
+        }
+    }
+
+    fn add_chunk(&mut self, name: &str, validator: ChunkValidator) {
+        let latency = Arc::<Histogram>::default();
+        self.latencies.push((
+            format!(
+                "module=\"{}\",event=\"on_data_chunk\"",
+                metrics::escape(name)
+            ),
+            Arc::clone(&latency),
+        ));
+        self.on_data_chunk.push((validator, latency));
+    }
+}
+
+static MODULE_STORE: LazyLock<ArcSwap<Registry>> = LazyLock::new(ArcSwap::default);
+
+/// How many times modules have been initialised, so that libraries loaded by a
+/// reload can tell they are replacing ones that may still be in use
+static GENERATION: AtomicUsize = AtomicUsize::new(0);
 
 impl Display for Module {
     fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
@@ -140,58 +890,359 @@ impl Display for Module {
 }
 
 impl Module {
-    fn emit(&self, event: Event, vctx: &mut Context) {
+    fn register(&self, registry: &mut Registry) {
         match self {
-            Self::SharedLibrary(ref lib) => lib.emit(event, vctx),
+            Self::SharedLibrary(ref lib) => lib.register(registry),
         }
     }
 }
 
-/// Initialise all modules
+/// Initialise all modules, replacing any that were previously loaded. Sessions
+/// already dispatching to the old modules finish with them, and they are then
+/// unloaded.
 ///
 /// # Errors
 /// This can error in two scenarios:
 ///   1. The module is invalid (e.g. the shared library cannot be found/has issues)
 ///   2. The modules init has an issue
 ///
-/// # Panics
-/// This will panic if it is unable to write to the module store
-///
-pub fn init(modules: Vec<Module>) -> Result<(), Error> {
+pub fn init(mut modules: Vec<Module>) -> Result<(), Error> {
     internal!(level = INFO, "Initialising modules ...");
 
-    for mut module in modules {
+    let generation = GENERATION.fetch_add(1, Ordering::Relaxed);
+
+    for module in &mut modules {
         internal!("Init: {module}");
 
         match module {
-            Module::SharedLibrary(ref mut lib) => lib.init()?,
+            Module::SharedLibrary(ref mut lib) => lib.init(generation)?,
         }
-
-        MODULE_STORE
-            .write()
-            .expect("Unable to write module")
-            .push(module);
     }
 
+    MODULE_STORE.store(Arc::new(Registry::new(modules)));
+
     internal!(level = INFO, "Modules initialised");
 
     Ok(())
 }
 
-/// Dispatch an event to all modules
+/// Dispatch an event to all modules, returning `true` if none of them
+/// rejected it.
 ///
-/// # Errors
-/// The events being dispatched are handled with a panic handler, which should
-/// catch some possible errors. If these are caught, they are returned to the
-/// caller to handle.
+/// # Panics
+/// This will panic if a blocking module panics
+///
+pub async fn dispatch(event: Event, vctx: &mut Context) -> bool {
+    validate(event, vctx).await == 0
+}
+
+/// Dispatch an event to all modules, returning 0 if none of them rejected it,
+/// or otherwise the response of the first that did. Every module is called,
+/// even once one has rejected it.
 ///
 /// # Panics
-/// This will panic if it fails to read the Module Store
+/// This will panic if a blocking module panics
 ///
-pub fn dispatch(event: Event, vctx: &mut Context) {
-    let store = MODULE_STORE.read().expect("Unable to load modules");
+pub async fn validate(event: Event, vctx: &mut Context) -> i32 {
+    let registry = MODULE_STORE.load();
+    if !registry.subscribes(event) {
+        return 0;
+    }
 
     internal!("Dispatching: {}", event);
 
-    store.iter().for_each(|module| module.emit(event, vctx));
+    let registry = Guard::into_inner(registry);
+    let mut response = fan_out(&registry, event, vctx).await;
+
+    // Modules that could change the context are run one at a time, after the
+    // concurrent ones, so that they can't change it from under them
+    for handler in &registry.validators[event as usize] {
+        let rejected = handler.call(&registry, vctx).await;
+        if response == 0 {
+            response = rejected;
+        }
+    }
+
+    response
+}
+
+/// Run all of the concurrent modules for an event at once, against the same
+/// context, returning 0 if none of them rejected it, or otherwise the response
+/// of the first that did
+async fn fan_out(registry: &Arc<Registry>, event: Event, vctx: &mut Context) -> i32 {
+    let handlers = &registry.concurrent[event as usize];
+
+    match handlers.as_slice() {
+        [] => return 0,
+        [handler] => return handler.call(registry, vctx).await,
+        _ => {}
+    }
+
+    let context = Arc::new(std::mem::take(vctx));
+    let mut tasks = JoinSet::new();
+
+    for handler in handlers {
+        handler.spawn_shared(&mut tasks, registry, &context).await;
+    }
+
+    let mut response = 0;
+    while let Some(rejected) = tasks.join_next().await {
+        let rejected = rejected.expect("Concurrent module panicked");
+        if response == 0 {
+            response = rejected;
+        }
+    }
+
+    // Every task has finished, and so has given up its reference to the context
+    *vctx = Arc::into_inner(context).expect("Context is still shared");
+
+    response
+}
+
+/// Dispatch a chunk of the message body to all streaming modules, returning
+/// `true` if none of them rejected it.
+///
+pub fn dispatch_chunk(vctx: &mut Context, chunk: &[u8]) -> bool {
+    MODULE_STORE
+        .load()
+        .on_data_chunk
+        .iter()
+        .fold(true, |accepted, (validator, latency)| {
+            let start = Instant::now();
+            let response = unsafe { validator(vctx, chunk.as_ptr(), chunk.len()) };
+            latency.record(start.elapsed(), response != 0);
+
+            response == 0 && accepted
+        })
+}
+
+/// Whether any loaded module needs the whole message body to be held in
+/// memory. If every module is streaming, the body never needs to be buffered.
+///
+pub fn requires_message() -> bool {
+    MODULE_STORE.load().subscribes(Event::ValidateData)
+}
+
+/// Write out the latency of every module's callbacks, in the Prometheus text
+/// format
+pub fn write_metrics(out: &mut String) {
+    let registry = MODULE_STORE.load();
+
+    let _ = writeln!(out, "# TYPE empath_module_latency_seconds histogram");
+    for (labels, latency) in &registry.latencies {
+        latency.write(out, "empath_module_latency_seconds", labels);
+    }
+
+    let _ = writeln!(out, "# TYPE empath_module_latency_max_seconds gauge");
+    for (labels, latency) in &registry.latencies {
+        let max = latency.max().as_secs_f64();
+        let _ = writeln!(out, "empath_module_latency_max_seconds{{{labels}}} {max}");
+    }
+
+    let _ = writeln!(out, "# TYPE empath_module_rejections_total counter");
+    for (labels, latency) in &registry.latencies {
+        let rejected = latency.rejected();
+        let _ = writeln!(out, "empath_module_rejections_total{{{labels}}} {rejected}");
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use std::{sync::Arc, time::Duration};
+
+    use crate::{context::Context, ffi::string::StringVector};
+
+    use super::{
+        context_complete, dispatch, validate, Batcher, Batching, Callback, Completion, Event,
+        Handler, PrivateDir, Registry, ValidationModule, Validators, CAPABILITY_DATA_CHUNK,
+        CAPABILITY_DATA_END, CAPABILITY_RCPT_TO, CAPABILITY_VALIDATE_DATA, MODULE_STORE,
+    };
+
+    unsafe extern "C" fn init(_: StringVector) -> i32 {
+        0
+    }
+
+    #[test]
+    fn test_private_dir() {
+        use std::os::unix::fs::PermissionsExt;
+
+        let directory = PrivateDir::create().unwrap();
+        let path = directory.0.clone();
+        std::fs::write(path.join("copy"), b"library").unwrap();
+
+        let mode = std::fs::metadata(&path).unwrap().permissions().mode();
+        assert_eq!(mode & 0o777, 0o700);
+
+        // Every copy is made in a directory of its own
+        assert_ne!(PrivateDir::create().unwrap().0, path);
+
+        drop(directory);
+        assert!(!path.exists());
+    }
+
+    unsafe extern "C" fn accept(_: &mut Context) -> i32 {
+        0
+    }
+
+    unsafe extern "C" fn reject(_: &mut Context) -> i32 {
+        1
+    }
+
+    unsafe extern "C" fn greylist(_: &mut Context) -> i32 {
+        450
+    }
+
+    unsafe extern "C" fn respond(vctx: &mut Context) -> i32 {
+        vctx.data_response = Some(vctx.id.clone());
+        0
+    }
+
+    unsafe extern "C" fn respond_later(vctx: *mut Context, handle: *mut Completion) {
+        let (vctx, handle) = (vctx as usize, handle as usize);
+
+        std::thread::spawn(move || unsafe {
+            let vctx = &mut *(vctx as *mut Context);
+            vctx.data_response = Some(String::from("later"));
+            context_complete(handle as *mut Completion, 0);
+        });
+    }
+
+    unsafe extern "C" fn respond_too_late(_: *mut Context, handle: *mut Completion) {
+        let handle = handle as usize;
+
+        std::thread::spawn(move || unsafe {
+            std::thread::sleep(Duration::from_millis(100));
+            context_complete(handle as *mut Completion, 0);
+        });
+    }
+
+    unsafe extern "C" fn respond_batch(contexts: *mut *mut Context, len: usize, results: *mut i32) {
+        let contexts = std::slice::from_raw_parts(contexts, len);
+        let results = std::slice::from_raw_parts_mut(results, len);
+
+        for (vctx, result) in contexts.iter().zip(results) {
+            let vctx = &mut **vctx;
+            vctx.data_response = Some(len.to_string());
+            *result = i32::from(vctx.id == "reject");
+        }
+    }
+
+    fn handler(validator: super::Validator) -> Handler {
+        Handler::new(Callback::Sync(validator), None)
+    }
+
+    #[tokio::test]
+    async fn test_dispatch() {
+        let mut registry = Registry::default();
+        for _ in 0..3 {
+            registry.add("accept", Event::ValidateData, true, handler(accept));
+        }
+        registry.add("respond", Event::ValidateData, false, handler(respond));
+        registry.add("accept", Event::DataEnd, true, handler(accept));
+        registry.add("reject", Event::DataEnd, true, handler(reject));
+        registry.add("accept", Event::RcptTo, false, handler(accept));
+        registry.add("greylist", Event::RcptTo, false, handler(greylist));
+        registry.add("reject", Event::RcptTo, false, handler(reject));
+        MODULE_STORE.store(Arc::new(registry));
+
+        let mut vctx = Context {
+            id: String::from("test"),
+            ..Default::default()
+        };
+
+        assert!(dispatch(Event::ValidateData, &mut vctx).await);
+        assert_eq!(vctx.data_response.as_deref(), Some("test"));
+        assert!(!dispatch(Event::DataEnd, &mut vctx).await);
+        assert_eq!(vctx.id, "test");
+
+        // The first rejection is the one that decides the reply
+        assert_eq!(validate(Event::RcptTo, &mut vctx).await, 450);
+        assert_eq!(validate(Event::Connect, &mut vctx).await, 0);
+
+        let mut registry = Registry::default();
+        let later = Handler::new(Callback::Async(respond_later, Duration::MAX), None);
+        registry.add("later", Event::ValidateData, false, later);
+        MODULE_STORE.store(Arc::new(registry));
+
+        assert!(dispatch(Event::ValidateData, &mut vctx).await);
+        assert_eq!(vctx.data_response.as_deref(), Some("later"));
+        assert_eq!(vctx.id, "test");
+
+        // Nothing handles the end of the data anymore
+        assert!(dispatch(Event::DataEnd, &mut vctx).await);
+
+        let mut registry = Registry::default();
+        let late = Callback::Async(respond_too_late, Duration::from_millis(10));
+        registry.add("late", Event::ValidateData, false, Handler::new(late, None));
+        MODULE_STORE.store(Arc::new(registry));
+
+        // The session isn't held up, and still knows who it's talking to
+        assert_eq!(validate(Event::ValidateData, &mut vctx).await, 451);
+        assert_eq!(vctx.data_response, None);
+        assert_eq!(vctx.id, "test");
+
+        let mut registry = Registry::default();
+        let batcher = Batcher::new(
+            respond_batch,
+            Batching {
+                size: 2,
+                wait: 1000,
+            },
+        );
+        let batch = Handler::new(Callback::Batch(Arc::new(batcher)), None);
+        registry.add("batch", Event::ValidateData, false, batch);
+        MODULE_STORE.store(Arc::new(registry));
+
+        let mut rejected = Context {
+            id: String::from("reject"),
+            ..Default::default()
+        };
+
+        let (accepted, rejected_accepted) = tokio::join!(
+            dispatch(Event::ValidateData, &mut vctx),
+            dispatch(Event::ValidateData, &mut rejected)
+        );
+        assert!(accepted);
+        assert!(!rejected_accepted);
+        assert_eq!(vctx.data_response.as_deref(), Some("2"));
+        assert_eq!(rejected.data_response.as_deref(), Some("2"));
+    }
+
+    #[test]
+    fn test_capabilities() {
+        let mut module = ValidationModule {
+            module_name: std::ptr::null(),
+            init,
+            validators: Validators {
+                validate_data: Some(accept),
+                on_data_chunk: None,
+                on_data_end: Some(reject),
+                validate_data_async: None,
+                validate_data_batch: None,
+                on_connect: None,
+                on_helo: None,
+                on_mail_from: None,
+                on_rcpt_to: Some(reject),
+            },
+            flags: 0,
+            capabilities: 0,
+        };
+
+        // Without any declared, everything that is set is used
+        assert_eq!(
+            module.capabilities(),
+            CAPABILITY_VALIDATE_DATA | CAPABILITY_DATA_END | CAPABILITY_RCPT_TO
+        );
+
+        module.capabilities = CAPABILITY_DATA_END;
+        let validators = module.validators();
+        assert!(validators.validate_data.is_none());
+        assert!(validators.on_data_end.is_some());
+
+        module.capabilities = CAPABILITY_DATA_CHUNK;
+        assert_eq!(
+            module.capabilities() & !module.implemented(),
+            CAPABILITY_DATA_CHUNK
+        );
+    }
 }
@@ -38,6 +38,46 @@ impl Drop for StringVector {
     }
 }
 
+///
+/// A borrowed view over bytes owned by the server.
+///
+/// Unlike [`String`], nothing is allocated when one of these is handed out,
+/// so it must never be passed to `free_string`. The data is not guaranteed
+/// to be NUL-terminated, and is only valid for the duration of the callback
+/// it was obtained in.
+///
+#[repr(C)]
+#[derive(Clone, Copy)]
+#[allow(clippy::module_name_repetitions)]
+pub struct StringView {
+    pub len: usize,
+    pub data: *const u8,
+}
+
+impl Default for StringView {
+    fn default() -> Self {
+        Self {
+            len: 0,
+            data: null(),
+        }
+    }
+}
+
+impl From<&[u8]> for StringView {
+    fn from(value: &[u8]) -> Self {
+        Self {
+            len: value.len(),
+            data: value.as_ptr(),
+        }
+    }
+}
+
+impl From<&str> for StringView {
+    fn from(value: &str) -> Self {
+        Self::from(value.as_bytes())
+    }
+}
+
 impl TryFrom<&[u8]> for String {
     type Error = Utf8Error;
 
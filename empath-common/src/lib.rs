@@ -6,3 +6,4 @@ pub mod context;
 pub mod ffi;
 pub mod listener;
 pub mod logging;
+pub mod metrics;
@@ -1,5 +1,75 @@
+use std::sync::Arc;
+
+use tokio::sync::watch;
+
 #[typetag::serde]
 #[async_trait::async_trait]
 pub trait Listener: Send + Sync {
+    ///
+    /// Get everything ready that the listener needs to accept connections,
+    /// e.g. its sockets and certificates. This is called before the listener
+    /// is spawned, or replaces any other, so that one that can't start fails
+    /// here, leaving whatever is already running as it is.
+    ///
+    /// # Errors
+    /// If the listener won't be able to accept connections
+    ///
+    fn open(&mut self) -> std::io::Result<()>;
+
+    /// Accept connections, on what was opened by `open`, until the listener is
+    /// stopped, and then wait for the sessions it accepted to finish
     async fn spawn(&self);
+
+    /// Stop accepting connections. Sessions that have already been accepted
+    /// are left to finish.
+    fn stop(&self);
+}
+
+///
+/// Tells a listener, and every clone of it, to stop accepting connections.
+/// Once triggered, it stays triggered.
+///
+#[derive(Clone)]
+pub struct Shutdown(Arc<watch::Sender<bool>>);
+
+impl Default for Shutdown {
+    fn default() -> Self {
+        Self(Arc::new(watch::channel(false).0))
+    }
+}
+
+impl Shutdown {
+    pub fn trigger(&self) {
+        self.0.send_replace(true);
+    }
+
+    /// Wait until the shutdown has been triggered, returning immediately if it
+    /// already has been
+    pub async fn wait(&self) {
+        let mut stopped = self.0.subscribe();
+        let _ = stopped.wait_for(|stopped| *stopped).await;
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use std::time::Duration;
+
+    use super::Shutdown;
+
+    #[tokio::test]
+    async fn test_shutdown() {
+        let shutdown = Shutdown::default();
+        let clone = shutdown.clone();
+
+        let waiting = tokio::spawn(async move { clone.wait().await });
+        tokio::time::sleep(Duration::from_millis(10)).await;
+        assert!(!waiting.is_finished());
+
+        shutdown.trigger();
+        waiting.await.unwrap();
+
+        // Anything waiting after the fact doesn't wait at all
+        shutdown.wait().await;
+    }
 }
@@ -1,10 +1,54 @@
+mod buffer;
+mod profile;
+
+use std::{
+    fs::File,
+    io::{BufWriter, Write},
+    sync::{
+        atomic::{AtomicU64, Ordering},
+        Arc, LazyLock, Mutex, OnceLock,
+    },
+    time::Duration,
+};
+
 use chrono::Utc;
 use tracing::metadata::LevelFilter;
 use tracing_subscriber::{
-    filter::FilterFn, fmt::time::FormatTime, prelude::__tracing_subscriber_SubscriberExt,
-    util::SubscriberInitExt, Layer,
+    filter::FilterFn,
+    fmt::{time::FormatTime, writer::BoxMakeWriter},
+    prelude::__tracing_subscriber_SubscriberExt,
+    util::SubscriberInitExt,
+    Layer,
 };
 
+use buffer::{Buffer, Overflow};
+use profile::Profile;
+
+pub use profile::TARGET;
+
+/// How long to wait for buffered log records to be written out at shutdown
+const FLUSH_TIMEOUT: Duration = Duration::from_secs(5);
+
+/// Set when logging through a buffer, instead of writing directly to stdout
+static BUFFER: OnceLock<Buffer> = OnceLock::new();
+
+/// Set when the time spent in sampled sessions is being written out
+static PROFILE: OnceLock<Arc<Mutex<BufWriter<File>>>> = OnceLock::new();
+
+/// One in how many sessions are traced, or 0 for none of them
+static SAMPLE_INTERVAL: AtomicU64 = AtomicU64::new(0);
+
+/// How many sessions there have been
+static SESSIONS: AtomicU64 = AtomicU64::new(0);
+
+/// When the first session started, in seconds since the epoch, so that session
+/// ids differ between runs of the server
+static STARTED: LazyLock<u64> = LazyLock::new(|| {
+    std::time::SystemTime::now()
+        .duration_since(std::time::UNIX_EPOCH)
+        .map_or(0, |since| since.as_secs())
+});
+
 struct Time;
 
 impl FormatTime for Time {
@@ -57,7 +101,117 @@ macro_rules! internal {
     };
 }
 
+/// How many log records have been dropped, because they were logged faster than
+/// they could be written out
+pub fn dropped() -> u64 {
+    BUFFER.get().map_or(0, Buffer::dropped)
+}
+
+/// Wait for any buffered log records to be written out, giving up on them if
+/// that takes longer than `FLUSH_TIMEOUT`
+pub fn flush() {
+    if let Some(buffer) = BUFFER.get() {
+        if !buffer.flush(FLUSH_TIMEOUT) {
+            // There's nothing else left to report this through
+            eprintln!("Some log records couldn't be written out in {FLUSH_TIMEOUT:?}");
+        }
+    }
+
+    if let Some(profile) = PROFILE.get() {
+        if let Ok(mut profile) = profile.lock() {
+            let _ = profile.flush();
+        }
+    }
+}
+
+///
+/// Number a new session, and decide whether it should be traced. The number
+/// is when the server started (the upper 32 bits) and how many sessions came
+/// before it (the lower 32 bits), so its log records can be told apart from
+/// those of every other session, including from earlier runs. Sessions that
+/// aren't traced should create no spans inside their own, so that they cost
+/// nothing more than the logging they already do.
+///
+pub fn session() -> (u64, bool) {
+    let count = SESSIONS.fetch_add(1, Ordering::Relaxed);
+    let traced = count.checked_rem(SAMPLE_INTERVAL.load(Ordering::Relaxed)) == Some(0);
+
+    (*STARTED << 32 | (count & u64::from(u32::MAX)), traced)
+}
+
+///
+/// Set `TRACE_SAMPLE` to the fraction of sessions to trace (e.g. `0.01` for one
+/// in every hundred). Each of those gets spans inside its own session span,
+/// timing each part of the session. Set `TRACE_PROFILE` to a file to have the
+/// time spent in each of them written there, ready to be turned into a flame
+/// graph.
+///
+/// # Errors
+/// If the profile can't be written to `TRACE_PROFILE`
+///
+#[allow(
+    clippy::cast_possible_truncation,
+    clippy::cast_sign_loss,
+    reason = "The rate has already been checked to be between 0 and 1"
+)]
+fn profile() -> std::io::Result<Option<Profile<BufWriter<File>>>> {
+    let Some(rate) = std::env::var("TRACE_SAMPLE")
+        .ok()
+        .and_then(|rate| rate.parse::<f64>().ok())
+        .filter(|rate| *rate > 0.0 && *rate <= 1.0)
+    else {
+        return Ok(None);
+    };
+
+    SAMPLE_INTERVAL.store((1.0 / rate).round() as u64, Ordering::Relaxed);
+
+    let Ok(path) = std::env::var("TRACE_PROFILE") else {
+        return Ok(None);
+    };
+
+    let file = File::create(&path).map_err(|err| {
+        std::io::Error::new(
+            err.kind(),
+            format!("Unable to write profile to {path}: {err}"),
+        )
+    })?;
+    let profile = Profile::new(BufWriter::new(file));
+    let _ = PROFILE.set(profile.writer());
+
+    Ok(Some(profile))
+}
+
+///
+/// Set `LOG_BUFFER` to a number of records to have them formatted on the
+/// logging thread, but written out on a dedicated one, through a buffer of that
+/// size. When the buffer is full, records are dropped unless `LOG_OVERFLOW` is
+/// set to `block`, in which case the logging thread waits for room instead.
+///
+fn writer() -> BoxMakeWriter {
+    let Some(capacity) = std::env::var("LOG_BUFFER")
+        .ok()
+        .and_then(|capacity| capacity.parse::<usize>().ok())
+        .filter(|&capacity| capacity > 0)
+    else {
+        return BoxMakeWriter::new(std::io::stdout);
+    };
+
+    let overflow = match std::env::var("LOG_OVERFLOW") {
+        Ok(overflow) if overflow.eq_ignore_ascii_case("block") => Overflow::Block,
+        _ => Overflow::Drop,
+    };
+
+    let buffer = BUFFER.get_or_init(|| Buffer::new(capacity, overflow));
+    buffer.start();
+
+    BoxMakeWriter::new(buffer)
+}
+
 pub fn init() {
+    let (profile, profiled) = match profile() {
+        Ok(profile) => (profile, Ok(())),
+        Err(err) => (None, Err(err)),
+    };
     let level = std::env::var("LOG_LEVEL").map_or(
         if cfg!(debug_assertions) {
             LevelFilter::TRACE
@@ -82,6 +236,7 @@ pub fn init() {
                     .with_line_number(false)
             })
             .compact()
+            .with_writer(writer())
             .with_ansi(true)
             .with_timer(Time)
             .with_level(false)
@@ -90,5 +245,36 @@ pub fn init() {
                 metadata.target().starts_with("empath")
             })),
         )
+        .with(profile.map(|profile| {
+            profile.with_filter(FilterFn::new(|metadata| metadata.target() == TARGET))
+        }))
         .init();
+
+    // Only now is there anywhere to say so
+    if let Err(err) = profiled {
+        internal!(level = ERROR, "{err}");
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use std::collections::HashSet;
+
+    use super::session;
+
+    #[test]
+    fn test_session() {
+        let sessions = (0..64).map(|_| session()).collect::<Vec<_>>();
+
+        // Nothing is traced unless sampling was asked for
+        assert!(sessions.iter().all(|(_, traced)| !traced));
+        assert_eq!(
+            sessions
+                .iter()
+                .map(|(id, _)| id)
+                .collect::<HashSet<_>>()
+                .len(),
+            sessions.len()
+        );
+    }
 }
@@ -0,0 +1,389 @@
+use std::{
+    cell::UnsafeCell,
+    io::Write,
+    mem::MaybeUninit,
+    sync::{
+        atomic::{AtomicU64, AtomicUsize, Ordering},
+        Condvar, Mutex, OnceLock, PoisonError,
+    },
+    thread::Thread,
+    time::{Duration, Instant},
+};
+
+use tracing_subscriber::fmt::MakeWriter;
+
+/// How long the writer waits for more records, before checking again anyway
+const IDLE: Duration = Duration::from_millis(50);
+
+/// What to do with a record when the buffer is full
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+pub enum Overflow {
+    /// Drop the record, and count it as dropped
+    Drop,
+    /// Wait for the writer to make room
+    Block,
+}
+
+struct Slot {
+    /// Which lap of the ring this slot is ready for, as per Vyukov's bounded queue
+    sequence: AtomicUsize,
+    record: UnsafeCell<MaybeUninit<Vec<u8>>>,
+}
+
+///
+/// A bounded, lock-free, queue of formatted log records, which are written out
+/// by a dedicated thread so that sessions never wait on stdout.
+///
+pub struct Buffer {
+    slots: Box<[Slot]>,
+    mask: usize,
+    head: AtomicUsize,
+    tail: AtomicUsize,
+    overflow: Overflow,
+    dropped: AtomicU64,
+    /// How many records have been written out and flushed, which lags behind
+    /// `head` while the writer is still writing the records it has taken
+    written: AtomicUsize,
+    /// Notified whenever `written` goes up
+    flushed: (Mutex<()>, Condvar),
+    writer: OnceLock<Thread>,
+}
+
+// Each record is only ever accessed by whoever has claimed its slot
+unsafe impl Sync for Buffer {}
+
+impl Buffer {
+    /// Create a buffer that can hold at least `capacity` records
+    pub fn new(capacity: usize, overflow: Overflow) -> Self {
+        let capacity = capacity.max(2).next_power_of_two();
+
+        Self {
+            slots: (0..capacity)
+                .map(|sequence| Slot {
+                    sequence: AtomicUsize::new(sequence),
+                    record: UnsafeCell::new(MaybeUninit::uninit()),
+                })
+                .collect(),
+            mask: capacity - 1,
+            head: AtomicUsize::new(0),
+            tail: AtomicUsize::new(0),
+            overflow,
+            dropped: AtomicU64::new(0),
+            written: AtomicUsize::new(0),
+            flushed: (Mutex::new(()), Condvar::new()),
+            writer: OnceLock::new(),
+        }
+    }
+
+    ///
+    /// Start the thread that writes out the buffered records to stdout
+    ///
+    /// # Panics
+    /// This will panic if the thread can't be spawned
+    ///
+    pub fn start(&'static self) {
+        let writer = std::thread::Builder::new()
+            .name(String::from("empath-logging"))
+            .spawn(|| self.write_out(&mut std::io::stdout()))
+            .expect("Unable to start logging thread");
+
+        let _ = self.writer.set(writer.thread().clone());
+    }
+
+    /// How many records have been dropped because the buffer was full
+    pub fn dropped(&self) -> u64 {
+        self.dropped.load(Ordering::Relaxed)
+    }
+
+    fn push(&self, record: Vec<u8>) {
+        let mut record = record;
+
+        loop {
+            match self.try_push(record) {
+                Ok(()) => break,
+                Err(rejected) if self.overflow == Overflow::Block => {
+                    record = rejected;
+                    std::thread::yield_now();
+                }
+                Err(_) => {
+                    self.dropped.fetch_add(1, Ordering::Relaxed);
+                    break;
+                }
+            }
+        }
+
+        if let Some(writer) = self.writer.get() {
+            writer.unpark();
+        }
+    }
+
+    #[allow(
+        clippy::cast_possible_wrap,
+        reason = "The distance between a slot and its lap is meant to be signed"
+    )]
+    fn try_push(&self, record: Vec<u8>) -> Result<(), Vec<u8>> {
+        let mut tail = self.tail.load(Ordering::Relaxed);
+
+        loop {
+            let slot = &self.slots[tail & self.mask];
+            let sequence = slot.sequence.load(Ordering::Acquire);
+
+            match sequence.wrapping_sub(tail) as isize {
+                0 => match self.tail.compare_exchange_weak(
+                    tail,
+                    tail.wrapping_add(1),
+                    Ordering::Relaxed,
+                    Ordering::Relaxed,
+                ) {
+                    Ok(_) => {
+                        unsafe { (*slot.record.get()).write(record) };
+                        slot.sequence.store(tail.wrapping_add(1), Ordering::Release);
+                        return Ok(());
+                    }
+                    Err(current) => tail = current,
+                },
+                // The slot still holds a record from the last lap, so the buffer is full
+                diff if diff < 0 => return Err(record),
+                _ => tail = self.tail.load(Ordering::Relaxed),
+            }
+        }
+    }
+
+    #[allow(
+        clippy::cast_possible_wrap,
+        reason = "The distance between a slot and its lap is meant to be signed"
+    )]
+    fn pop(&self) -> Option<Vec<u8>> {
+        let mut head = self.head.load(Ordering::Relaxed);
+
+        loop {
+            let slot = &self.slots[head & self.mask];
+            let sequence = slot.sequence.load(Ordering::Acquire);
+
+            match sequence.wrapping_sub(head.wrapping_add(1)) as isize {
+                0 => match self.head.compare_exchange_weak(
+                    head,
+                    head.wrapping_add(1),
+                    Ordering::Relaxed,
+                    Ordering::Relaxed,
+                ) {
+                    Ok(_) => {
+                        let record = unsafe { (*slot.record.get()).assume_init_read() };
+                        slot.sequence
+                            .store(head.wrapping_add(self.mask + 1), Ordering::Release);
+                        return Some(record);
+                    }
+                    Err(current) => head = current,
+                },
+                // Nothing has been written to this slot yet, so the buffer is empty
+                diff if diff < 0 => return None,
+                _ => head = self.head.load(Ordering::Relaxed),
+            }
+        }
+    }
+
+    fn write_out(&self, out: &mut impl Write) {
+        loop {
+            let mut written = 0;
+
+            while let Some(record) = self.pop() {
+                let _ = out.write_all(&record);
+                written += 1;
+            }
+
+            if written > 0 {
+                let _ = out.flush();
+
+                let (ref lock, ref flushed) = self.flushed;
+                let _guard = lock.lock().unwrap_or_else(PoisonError::into_inner);
+                self.written.fetch_add(written, Ordering::Release);
+                flushed.notify_all();
+            }
+
+            std::thread::park_timeout(IDLE);
+        }
+    }
+
+    ///
+    /// Wait for everything buffered so far to have been written out, for up to
+    /// `timeout`, returning whether it was
+    ///
+    #[allow(
+        clippy::cast_possible_wrap,
+        reason = "The distance between the counters is meant to be signed"
+    )]
+    pub fn flush(&self, timeout: Duration) -> bool {
+        let buffered = self.tail.load(Ordering::Acquire);
+        let deadline = Instant::now() + timeout;
+
+        let (ref lock, ref flushed) = self.flushed;
+        let mut guard = lock.lock().unwrap_or_else(PoisonError::into_inner);
+
+        loop {
+            if self.written.load(Ordering::Acquire).wrapping_sub(buffered) as isize >= 0 {
+                return true;
+            }
+
+            let Some(remaining) = deadline.checked_duration_since(Instant::now()) else {
+                return false;
+            };
+
+            if let Some(writer) = self.writer.get() {
+                writer.unpark();
+            }
+
+            guard = flushed
+                .wait_timeout(guard, remaining.min(IDLE))
+                .unwrap_or_else(PoisonError::into_inner)
+                .0;
+        }
+    }
+}
+
+impl Drop for Buffer {
+    fn drop(&mut self) {
+        while self.pop().is_some() {}
+    }
+}
+
+/// Formats a single record, which is handed to the buffer once it's complete
+pub struct Record<'a> {
+    buffer: &'a Buffer,
+    record: Vec<u8>,
+}
+
+impl Write for Record<'_> {
+    fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+        self.record.extend_from_slice(buf);
+        Ok(buf.len())
+    }
+
+    fn flush(&mut self) -> std::io::Result<()> {
+        Ok(())
+    }
+}
+
+impl Drop for Record<'_> {
+    fn drop(&mut self) {
+        if !self.record.is_empty() {
+            self.buffer.push(std::mem::take(&mut self.record));
+        }
+    }
+}
+
+impl<'a> MakeWriter<'a> for &'static Buffer {
+    type Writer = Record<'a>;
+
+    fn make_writer(&'a self) -> Self::Writer {
+        Record {
+            buffer: self,
+            record: Vec::with_capacity(256),
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use std::{
+        io::Write,
+        sync::{Arc, Mutex},
+        time::Duration,
+    };
+
+    use super::{Buffer, Overflow};
+
+    /// Writes slowly, so that records are held by the writer for a while
+    /// after they've been taken from the buffer
+    struct Slow(Arc<Mutex<Vec<u8>>>);
+
+    impl Write for Slow {
+        fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+            std::thread::sleep(Duration::from_millis(2));
+            self.0.lock().unwrap().extend_from_slice(buf);
+            Ok(buf.len())
+        }
+
+        fn flush(&mut self) -> std::io::Result<()> {
+            Ok(())
+        }
+    }
+
+    #[test]
+    fn test_flush() {
+        let buffer: &'static Buffer = Box::leak(Box::new(Buffer::new(128, Overflow::Block)));
+        let out = Arc::new(Mutex::new(Vec::new()));
+
+        let mut slow = Slow(Arc::clone(&out));
+        let writer = std::thread::spawn(move || buffer.write_out(&mut slow));
+        let _ = buffer.writer.set(writer.thread().clone());
+
+        for record in 0..100u8 {
+            buffer.push(vec![record]);
+        }
+
+        assert!(buffer.flush(Duration::from_secs(10)));
+        assert_eq!(*out.lock().unwrap(), (0..100).collect::<Vec<_>>());
+
+        // Nothing was buffered since, so there's nothing to wait for
+        assert!(buffer.flush(Duration::ZERO));
+    }
+
+    #[test]
+    fn test_fifo() {
+        let buffer = Buffer::new(4, Overflow::Drop);
+
+        for record in 0..6u8 {
+            buffer.push(vec![record]);
+        }
+
+        assert_eq!(buffer.dropped(), 2);
+
+        for record in 0..4u8 {
+            assert_eq!(buffer.pop(), Some(vec![record]));
+        }
+        assert_eq!(buffer.pop(), None);
+
+        // Slots are reused once they've been written out
+        buffer.push(vec![4]);
+        assert_eq!(buffer.pop(), Some(vec![4]));
+    }
+
+    #[test]
+    fn test_concurrent() {
+        let buffer = Buffer::new(1024, Overflow::Block);
+        let mut received = Vec::new();
+
+        std::thread::scope(|scope| {
+            for thread in 0..4u8 {
+                let buffer = &buffer;
+                scope.spawn(move || {
+                    for record in 0..1000u16 {
+                        let mut bytes = vec![thread];
+                        bytes.extend_from_slice(&record.to_le_bytes());
+                        buffer.push(bytes);
+                    }
+                });
+            }
+
+            while received.len() < 4000 {
+                if let Some(record) = buffer.pop() {
+                    received.push(record);
+                }
+            }
+        });
+
+        assert_eq!(buffer.dropped(), 0);
+        assert_eq!(buffer.pop(), None);
+
+        // Each thread's records arrive in the order they were sent
+        for thread in 0..4u8 {
+            let records = received
+                .iter()
+                .filter(|record| record[0] == thread)
+                .map(|record| u16::from_le_bytes([record[1], record[2]]))
+                .collect::<Vec<_>>();
+
+            assert_eq!(records, (0..1000).collect::<Vec<_>>());
+        }
+    }
+}
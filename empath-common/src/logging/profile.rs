@@ -0,0 +1,136 @@
+use std::{
+    io::Write,
+    sync::{Arc, Mutex},
+    time::{Duration, Instant},
+};
+
+use tracing::{span, Subscriber};
+use tracing_subscriber::{layer::Context, registry::LookupSpan, Layer};
+
+/// The target of the spans that make up a sampled session
+pub const TARGET: &str = "empath::session";
+
+/// How long a span has been entered for, and how much of that was spent in
+/// the spans inside it
+#[derive(Default)]
+struct Timing {
+    entered: Option<Instant>,
+    busy: Duration,
+    children: Duration,
+}
+
+///
+/// Writes out how long was spent in each span, not counting the spans inside
+/// it, as collapsed stacks (e.g. `session;dispatch 1234`, in nanoseconds). This
+/// is the format taken by `flamegraph.pl` and `inferno-flamegraph`, which sum
+/// up every line with the same stack.
+///
+/// Only the time a span is entered for counts, so a session waiting on the
+/// client costs nothing, and the result shows where the work actually goes.
+///
+pub struct Profile<W: Write> {
+    out: Arc<Mutex<W>>,
+}
+
+impl<W: Write> Profile<W> {
+    pub fn new(out: W) -> Self {
+        Self {
+            out: Arc::new(Mutex::new(out)),
+        }
+    }
+
+    /// Where the stacks are written, to be flushed independently of the layer
+    pub fn writer(&self) -> Arc<Mutex<W>> {
+        Arc::clone(&self.out)
+    }
+}
+
+impl<S, W> Layer<S> for Profile<W>
+where
+    S: Subscriber + for<'a> LookupSpan<'a>,
+    W: Write + Send + 'static,
+{
+    fn on_new_span(&self, _: &span::Attributes<'_>, id: &span::Id, ctx: Context<'_, S>) {
+        if let Some(span) = ctx.span(id) {
+            span.extensions_mut().insert(Timing::default());
+        }
+    }
+
+    fn on_enter(&self, id: &span::Id, ctx: Context<'_, S>) {
+        if let Some(span) = ctx.span(id) {
+            if let Some(timing) = span.extensions_mut().get_mut::<Timing>() {
+                timing.entered = Some(Instant::now());
+            }
+        }
+    }
+
+    fn on_exit(&self, id: &span::Id, ctx: Context<'_, S>) {
+        if let Some(span) = ctx.span(id) {
+            if let Some(timing) = span.extensions_mut().get_mut::<Timing>() {
+                if let Some(entered) = timing.entered.take() {
+                    timing.busy += entered.elapsed();
+                }
+            }
+        }
+    }
+
+    fn on_close(&self, id: span::Id, ctx: Context<'_, S>) {
+        let Some(span) = ctx.span(&id) else {
+            return;
+        };
+        let Some(timing) = span.extensions_mut().remove::<Timing>() else {
+            return;
+        };
+
+        if let Some(parent) = span.parent() {
+            if let Some(parent) = parent.extensions_mut().get_mut::<Timing>() {
+                parent.children += timing.busy;
+            }
+        }
+
+        let mut stack = String::new();
+        for (idx, span) in span.scope().from_root().enumerate() {
+            if idx > 0 {
+                stack.push(';');
+            }
+            stack.push_str(span.name());
+        }
+
+        let own = timing.busy.saturating_sub(timing.children);
+        let mut out = self.out.lock().expect("Unable to write profile");
+        let _ = writeln!(out, "{stack} {}", own.as_nanos());
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use tracing_subscriber::{filter::FilterFn, layer::SubscriberExt, Layer};
+
+    use super::{Profile, TARGET};
+
+    #[test]
+    fn test_profile() {
+        let profile = Profile::new(Vec::new());
+        let out = profile.writer();
+
+        let subscriber = tracing_subscriber::Registry::default()
+            .with(profile.with_filter(FilterFn::new(|metadata| metadata.target() == TARGET)));
+
+        tracing::subscriber::with_default(subscriber, || {
+            let session = tracing::info_span!(target: TARGET, "session").entered();
+            // Anything else is left out, even when it's inside a session
+            tracing::info_span!(target: "empath", "internal").in_scope(|| {
+                tracing::info_span!(target: TARGET, "parse").in_scope(|| {});
+            });
+            drop(session);
+        });
+
+        let out = String::from_utf8(out.lock().unwrap().clone()).unwrap();
+        let stacks = out
+            .lines()
+            .map(|line| line.rsplit_once(' ').unwrap().0)
+            .collect::<Vec<_>>();
+
+        assert_eq!(stacks, ["session;parse", "session"]);
+    }
+}
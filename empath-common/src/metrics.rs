@@ -0,0 +1,199 @@
+use std::{
+    fmt::Write,
+    sync::atomic::{AtomicU64, AtomicUsize, Ordering},
+    time::Duration,
+};
+
+/// The number of latency buckets. Each is double the last, starting at 1µs,
+/// with the last catching everything over ~16s.
+const BUCKETS: usize = 26;
+
+/// The number of shards each counter is split into
+const SHARDS: usize = 16;
+
+/// The shard the current thread should update
+fn shard() -> usize {
+    static NEXT: AtomicUsize = AtomicUsize::new(0);
+
+    thread_local! {
+        static SHARD: usize = NEXT.fetch_add(1, Ordering::Relaxed) % SHARDS;
+    }
+
+    SHARD.with(|shard| *shard)
+}
+
+/// A single shard of a counter, on its own cache line
+#[derive(Default)]
+#[repr(align(64))]
+struct Shard(AtomicU64);
+
+///
+/// A counter that is split into shards, so that threads updating it at the
+/// same time don't contend over the same cache line. The shards are only summed
+/// when it's read, e.g. when the metrics are scraped.
+///
+/// This can also be used as a gauge, as long as it's never decremented below 0.
+///
+#[derive(Default)]
+pub struct Counter {
+    shards: [Shard; SHARDS],
+}
+
+impl Counter {
+    pub fn add(&self, value: u64) {
+        self.shards[shard()].0.fetch_add(value, Ordering::Relaxed);
+    }
+
+    pub fn increment(&self) {
+        self.add(1);
+    }
+
+    /// Decrement the counter. The shard decremented may not be the one that was
+    /// incremented, so individual shards can wrap, but the total won't.
+    pub fn decrement(&self) {
+        self.shards[shard()].0.fetch_sub(1, Ordering::Relaxed);
+    }
+
+    pub fn value(&self) -> u64 {
+        self.shards.iter().fold(0, |total, shard| {
+            total.wrapping_add(shard.0.load(Ordering::Relaxed))
+        })
+    }
+}
+
+///
+/// Escape `value` to be used as the value of a label, which in the Prometheus
+/// text format can't contain a bare `\`, `"` or newline
+///
+pub fn escape(value: &str) -> String {
+    let mut escaped = String::with_capacity(value.len());
+
+    for c in value.chars() {
+        match c {
+            '\\' => escaped.push_str("\\\\"),
+            '"' => escaped.push_str("\\\""),
+            '\n' => escaped.push_str("\\n"),
+            _ => escaped.push(c),
+        }
+    }
+
+    escaped
+}
+
+///
+/// A latency histogram that can be recorded to from any thread without
+/// locking, and rendered in the Prometheus text format.
+///
+#[derive(Default)]
+pub struct Histogram {
+    buckets: [AtomicU64; BUCKETS],
+    /// The total of every recorded latency, in microseconds
+    sum: AtomicU64,
+    /// The longest recorded latency, in microseconds
+    max: AtomicU64,
+    /// How many of the recorded calls failed, or rejected the message
+    rejected: AtomicU64,
+}
+
+impl Histogram {
+    /// Record how long a single call took, and whether it rejected the message
+    pub fn record(&self, elapsed: Duration, rejected: bool) {
+        let micros = u64::try_from(elapsed.as_micros()).unwrap_or(u64::MAX);
+        // The smallest bucket that this fits in, i.e. ceil(log2(micros))
+        let bucket = (u64::BITS - micros.saturating_sub(1).leading_zeros()) as usize;
+
+        self.buckets[bucket.min(BUCKETS - 1)].fetch_add(1, Ordering::Relaxed);
+        self.sum.fetch_add(micros, Ordering::Relaxed);
+        self.max.fetch_max(micros, Ordering::Relaxed);
+
+        if rejected {
+            self.rejected.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+
+    /// The longest recorded latency
+    pub fn max(&self) -> Duration {
+        Duration::from_micros(self.max.load(Ordering::Relaxed))
+    }
+
+    /// How many of the recorded calls rejected the message
+    pub fn rejected(&self) -> u64 {
+        self.rejected.load(Ordering::Relaxed)
+    }
+
+    ///
+    /// Write out the `_bucket`, `_sum` and `_count` series of this histogram,
+    /// as `name` with the given labels. The `# TYPE` line is left to the caller,
+    /// as it's shared between every set of labels.
+    ///
+    pub fn write(&self, out: &mut String, name: &str, labels: &str) {
+        let mut count = 0;
+
+        for (bucket, value) in self.buckets.iter().enumerate() {
+            count += value.load(Ordering::Relaxed);
+
+            if bucket == BUCKETS - 1 {
+                let _ = writeln!(out, "{name}_bucket{{{labels},le=\"+Inf\"}} {count}");
+            } else {
+                let bound = Duration::from_micros(1 << bucket).as_secs_f64();
+                let _ = writeln!(out, "{name}_bucket{{{labels},le=\"{bound}\"}} {count}");
+            }
+        }
+
+        let sum = Duration::from_micros(self.sum.load(Ordering::Relaxed)).as_secs_f64();
+        let _ = writeln!(out, "{name}_sum{{{labels}}} {sum}");
+        let _ = writeln!(out, "{name}_count{{{labels}}} {count}");
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use std::time::Duration;
+
+    use super::{escape, Counter, Histogram};
+
+    #[test]
+    fn test_escape() {
+        assert_eq!(escape("[::1]:25"), "[::1]:25");
+        assert_eq!(escape("a \"b\"\\c\nd"), "a \\\"b\\\"\\\\c\\nd");
+    }
+
+    #[test]
+    fn test_counter() {
+        let counter = Counter::default();
+        counter.add(5);
+
+        std::thread::scope(|scope| {
+            for _ in 0..4 {
+                scope.spawn(|| {
+                    counter.increment();
+                    counter.decrement();
+                    counter.decrement();
+                });
+            }
+        });
+
+        assert_eq!(counter.value(), 1);
+    }
+
+    #[test]
+    fn test_histogram() {
+        let histogram = Histogram::default();
+        histogram.record(Duration::from_micros(1), false);
+        histogram.record(Duration::from_micros(3), true);
+        histogram.record(Duration::from_secs(60), false);
+
+        assert_eq!(histogram.max(), Duration::from_secs(60));
+        assert_eq!(histogram.rejected(), 1);
+
+        let mut out = String::new();
+        histogram.write(&mut out, "test", "a=\"b\"");
+
+        assert!(out.starts_with("test_bucket{a=\"b\",le=\"0.000001\"} 1\n"));
+        assert!(out.contains("test_bucket{a=\"b\",le=\"0.000002\"} 1\n"));
+        assert!(out.contains("test_bucket{a=\"b\",le=\"0.000004\"} 2\n"));
+        assert!(out.contains("test_bucket{a=\"b\",le=\"+Inf\"} 3\n"));
+        assert!(out.contains("test_sum{a=\"b\"} 60.000004\n"));
+        assert!(out.ends_with("test_count{a=\"b\"} 3\n"));
+    }
+}
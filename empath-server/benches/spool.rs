@@ -0,0 +1,89 @@
+use std::{
+    sync::Arc,
+    time::{Duration, Instant},
+};
+
+use criterion::{criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+use empath_common::context::{Addresses, Context};
+use empath_server::spool::{Config, Spool};
+
+/// How many sessions are writing to the spool at once
+const SESSIONS: u64 = 64;
+
+/// The batch windows to compare, in milliseconds
+const WINDOWS: &[u64] = &[0, 1, 2, 5];
+
+fn message() -> Context {
+    Context {
+        mail_from: Addresses::from(&mailparse::addrparse("sender@example.com").unwrap()),
+        rcpt_to: Addresses::from(&mailparse::addrparse("recipient@example.org").unwrap()),
+        data: Some(b"Subject: Benchmark\r\n\r\n".repeat(64)),
+        ..Default::default()
+    }
+}
+
+fn spool(c: &mut Criterion) {
+    let runtime = tokio::runtime::Builder::new_multi_thread()
+        .enable_all()
+        .build()
+        .unwrap();
+
+    let mut group = c.benchmark_group("spool");
+    group.throughput(Throughput::Elements(1));
+
+    for window in WINDOWS {
+        let path = std::env::temp_dir().join(format!("empath-bench-spool-{window}"));
+        let _ = std::fs::remove_dir_all(&path);
+
+        let config = Config {
+            path: path.clone(),
+            window: *window,
+            ..Default::default()
+        };
+        let spool = {
+            let _runtime = runtime.enter();
+            Arc::new(Spool::open(&config, None).unwrap())
+        };
+
+        group.bench_with_input(BenchmarkId::new("window", window), window, |b, _| {
+            b.iter_custom(|iters| {
+                runtime.block_on(async {
+                    let start = Instant::now();
+                    let sessions = (0..SESSIONS)
+                        .map(|session| {
+                            let spool = Arc::clone(&spool);
+
+                            // Spread the messages as evenly as possible between the sessions
+                            let count = iters / SESSIONS + u64::from(session < iters % SESSIONS);
+
+                            tokio::spawn(async move {
+                                let mut context = message();
+                                for _ in 0..count {
+                                    spool.write(&mut context).await.unwrap();
+                                }
+                            })
+                        })
+                        .collect::<Vec<_>>();
+
+                    for session in sessions {
+                        session.await.unwrap();
+                    }
+
+                    start.elapsed()
+                })
+            });
+        });
+
+        drop(spool);
+        let _ = std::fs::remove_dir_all(path);
+    }
+
+    group.finish();
+}
+
+criterion_group! {
+    name = benches;
+    config = Criterion::default().measurement_time(Duration::from_secs(10));
+    targets = spool
+}
+criterion_main!(benches);
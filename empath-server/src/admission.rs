@@ -0,0 +1,200 @@
+use std::{
+    collections::HashMap,
+    net::IpAddr,
+    sync::{Arc, Mutex},
+    time::Duration,
+};
+
+use serde::{Deserialize, Serialize};
+use tokio::sync::{OwnedSemaphorePermit, Semaphore};
+
+/// How long to wait before accepting again after the first failure
+const MIN_BACKOFF: Duration = Duration::from_millis(5);
+
+/// The longest to wait before accepting again, however many failures in a row
+const MAX_BACKOFF: Duration = Duration::from_secs(1);
+
+/// How many sessions are connected from each address
+type PerIp = Arc<Mutex<HashMap<IpAddr, usize>>>;
+
+///
+/// Limits on how many sessions a listener will run at once. A limit of 0 means
+/// there is no limit.
+///
+#[derive(Serialize, Deserialize, Clone, Copy, Default, PartialEq, Eq, Debug)]
+#[serde(default)]
+pub struct Limits {
+    /// The most sessions that can be connected at once
+    pub sessions: usize,
+    /// The most sessions that can be connected at once from a single address
+    pub sessions_per_ip: usize,
+}
+
+///
+/// Decides whether a new connection can be handled, given the sessions that
+/// are already running on a listener. Clones share the same counts.
+///
+#[derive(Default, Clone)]
+pub struct Admission {
+    limits: Limits,
+    sessions: Option<Arc<Semaphore>>,
+    per_ip: PerIp,
+}
+
+impl Admission {
+    pub fn new(limits: Limits) -> Self {
+        Self {
+            limits,
+            sessions: (limits.sessions > 0).then(|| Arc::new(Semaphore::new(limits.sessions))),
+            per_ip: Arc::default(),
+        }
+    }
+
+    ///
+    /// Admit a session from `peer`, if there's room for it. The session is
+    /// counted against the limits until the returned permit is dropped.
+    ///
+    /// # Panics
+    /// This will panic if the per address counts have been poisoned
+    ///
+    pub fn admit(&self, peer: IpAddr) -> Option<Permit> {
+        let session = match self.sessions {
+            Some(ref sessions) => Some(Arc::clone(sessions).try_acquire_owned().ok()?),
+            None => None,
+        };
+
+        if self.limits.sessions_per_ip > 0 {
+            let mut per_ip = self.per_ip.lock().expect("Unable to admit session");
+            let count = per_ip.entry(peer).or_default();
+
+            if *count >= self.limits.sessions_per_ip {
+                return None;
+            }
+
+            *count += 1;
+        }
+
+        Some(Permit {
+            _session: session,
+            peer: (self.limits.sessions_per_ip > 0).then(|| (Arc::clone(&self.per_ip), peer)),
+        })
+    }
+}
+
+/// A session that has been admitted, which holds its place until it's dropped
+pub struct Permit {
+    _session: Option<OwnedSemaphorePermit>,
+    peer: Option<(PerIp, IpAddr)>,
+}
+
+impl Drop for Permit {
+    fn drop(&mut self) {
+        let Some((ref per_ip, peer)) = self.peer else {
+            return;
+        };
+
+        let mut per_ip = per_ip.lock().expect("Unable to release session");
+        if let Some(count) = per_ip.get_mut(&peer) {
+            *count -= 1;
+
+            if *count == 0 {
+                per_ip.remove(&peer);
+            }
+        }
+    }
+}
+
+///
+/// How long to wait before trying to accept again, after failing to several
+/// times in a row (e.g. because the process has run out of file descriptors)
+///
+#[derive(Default)]
+pub struct Backoff {
+    delay: Option<Duration>,
+}
+
+impl Backoff {
+    /// Note a failure, returning how long to wait before trying again
+    pub fn fail(&mut self) -> Duration {
+        let delay = self
+            .delay
+            .map_or(MIN_BACKOFF, |delay| (delay * 2).min(MAX_BACKOFF));
+
+        self.delay = Some(delay);
+        delay
+    }
+
+    pub fn succeed(&mut self) {
+        self.delay = None;
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use std::{
+        net::{IpAddr, Ipv4Addr},
+        time::Duration,
+    };
+
+    use super::{Admission, Backoff, Limits, MAX_BACKOFF, MIN_BACKOFF};
+
+    const ONE: IpAddr = IpAddr::V4(Ipv4Addr::LOCALHOST);
+    const TWO: IpAddr = IpAddr::V4(Ipv4Addr::new(127, 0, 0, 2));
+
+    #[test]
+    fn test_unlimited() {
+        let admission = Admission::new(Limits::default());
+        let permits = (0..100).map(|_| admission.admit(ONE)).collect::<Vec<_>>();
+
+        assert!(permits.iter().all(Option::is_some));
+    }
+
+    #[test]
+    fn test_sessions() {
+        let admission = Admission::new(Limits {
+            sessions: 2,
+            ..Default::default()
+        });
+
+        let first = admission.admit(ONE);
+        let second = admission.admit(TWO);
+        assert!(first.is_some() && second.is_some());
+        assert!(admission.admit(ONE).is_none());
+
+        drop(first);
+        assert!(admission.admit(ONE).is_some());
+    }
+
+    #[test]
+    fn test_sessions_per_ip() {
+        let admission = Admission::new(Limits {
+            sessions_per_ip: 1,
+            ..Default::default()
+        });
+
+        let first = admission.admit(ONE);
+        assert!(first.is_some());
+        assert!(admission.admit(ONE).is_none());
+        assert!(admission.admit(TWO).is_some());
+
+        drop(first);
+        assert!(admission.admit(ONE).is_some());
+        assert!(admission.per_ip.lock().unwrap().is_empty());
+    }
+
+    #[test]
+    fn test_backoff() {
+        let mut backoff = Backoff::default();
+
+        assert_eq!(backoff.fail(), MIN_BACKOFF);
+        assert_eq!(backoff.fail(), MIN_BACKOFF * 2);
+
+        for _ in 0..20 {
+            backoff.fail();
+        }
+        assert_eq!(backoff.fail(), MAX_BACKOFF);
+
+        backoff.succeed();
+        assert_eq!(backoff.fail(), Duration::from_millis(5));
+    }
+}
@@ -0,0 +1,620 @@
+pub mod client;
+mod dns;
+mod pool;
+
+use std::{
+    collections::{BTreeMap, HashMap},
+    fs::File,
+    io::BufReader,
+    net::SocketAddr,
+    path::{Path, PathBuf},
+    sync::{
+        atomic::{AtomicUsize, Ordering},
+        Arc,
+    },
+    time::Duration,
+};
+
+use empath_common::internal;
+use serde::{Deserialize, Serialize};
+use tokio::{
+    net::TcpStream,
+    sync::{mpsc, OwnedSemaphorePermit, Semaphore},
+};
+use tokio_rustls::{
+    rustls::{Certificate, ClientConfig, RootCertStore},
+    TlsConnector,
+};
+
+use crate::spool::{self, Event, Message};
+
+use self::{
+    client::{Client, Transaction},
+    dns::Resolver,
+    pool::Pool,
+};
+
+/// How long to wait for a connection to another server to be established
+const CONNECT_TIMEOUT: Duration = Duration::from_secs(30);
+
+fn default_helo() -> String {
+    String::from("localhost")
+}
+
+const fn default_port() -> u16 {
+    25
+}
+
+const fn default_connections() -> usize {
+    4
+}
+
+const fn default_idle() -> u64 {
+    30
+}
+
+const fn default_max_recipients() -> usize {
+    100
+}
+
+const fn default_retry() -> u64 {
+    300
+}
+
+const fn default_attempts() -> u32 {
+    5
+}
+
+const fn default_in_flight() -> usize {
+    4096
+}
+
+const fn default_starttls() -> bool {
+    true
+}
+
+const fn default_require_tls() -> bool {
+    false
+}
+
+fn default_ca_certificates() -> PathBuf {
+    PathBuf::from("/etc/ssl/certs/ca-certificates.crt")
+}
+
+#[derive(Serialize, Deserialize, Clone, Debug)]
+pub struct Config {
+    /// The name to greet other servers with
+    #[serde(default = "default_helo")]
+    pub helo: String,
+    #[serde(default = "default_port")]
+    pub port: u16,
+    /// The most connections open to a single destination at once
+    #[serde(default = "default_connections")]
+    pub connections: usize,
+    /// How long a connection can be left idle before it's closed, in seconds
+    #[serde(default = "default_idle")]
+    pub idle: u64,
+    /// The most recipients sent in a single transaction
+    #[serde(default = "default_max_recipients")]
+    pub max_recipients: usize,
+    /// How long to wait before the first retry, in seconds. This doubles with
+    /// every attempt after.
+    #[serde(default = "default_retry")]
+    pub retry: u64,
+    /// How many times to try delivering a message before giving up
+    #[serde(default = "default_attempts")]
+    pub attempts: u32,
+    /// The most messages being delivered at once, including those waiting to
+    /// be retried. Once there are this many, no more are taken from the spool
+    /// until one of them has been dealt with.
+    #[serde(default = "default_in_flight")]
+    pub in_flight: usize,
+    /// Whether to negotiate TLS with servers that support it
+    #[serde(default = "default_starttls")]
+    pub starttls: bool,
+    /// Whether to refuse to deliver to servers that TLS can't be negotiated
+    /// with, rather than falling back to plaintext
+    #[serde(default = "default_require_tls")]
+    pub require_tls: bool,
+    /// The certificates that other servers' certificates are verified against
+    #[serde(default = "default_ca_certificates")]
+    pub ca_certificates: PathBuf,
+    /// The nameservers to ask, instead of those in /etc/resolv.conf
+    #[serde(default)]
+    pub nameservers: Vec<SocketAddr>,
+}
+
+/// How far through being dealt with the messages in a segment are
+#[derive(Default)]
+struct Segment {
+    outstanding: usize,
+    sealed: bool,
+}
+
+///
+/// Split the recipients of a message into transactions, one per domain (or
+/// several, if there are more than `max` recipients at the same domain)
+///
+fn transactions(recipients: &[String], max: usize) -> Vec<(String, Vec<String>)> {
+    let mut domains = BTreeMap::<String, Vec<String>>::new();
+
+    for recipient in recipients {
+        let Some((_, domain)) = recipient.rsplit_once('@') else {
+            internal!(
+                level = WARN,
+                "Unable to deliver to {recipient}, as it has no domain"
+            );
+            continue;
+        };
+
+        domains
+            .entry(domain.to_ascii_lowercase())
+            .or_default()
+            .push(recipient.clone());
+    }
+
+    domains
+        .into_iter()
+        .flat_map(|(domain, recipients)| {
+            recipients
+                .chunks(max.max(1))
+                .map(|chunk| (domain.clone(), chunk.to_vec()))
+                .collect::<Vec<_>>()
+        })
+        .collect()
+}
+
+///
+/// Build what's needed to negotiate TLS with other servers, trusting only the
+/// authorities in `certificates`
+///
+/// # Errors
+/// If the certificates can't be read
+///
+pub fn connector(certificates: &Path) -> std::io::Result<TlsConnector> {
+    let mut roots = RootCertStore::empty();
+    for certificate in rustls_pemfile::certs(&mut BufReader::new(File::open(certificates)?))? {
+        // Anything the TLS library doesn't understand is of no use anyway
+        let _ = roots.add(&Certificate(certificate));
+    }
+
+    let config = ClientConfig::builder()
+        .with_safe_defaults()
+        .with_root_certificates(roots)
+        .with_no_client_auth();
+
+    Ok(TlsConnector::from(Arc::new(config)))
+}
+
+///
+/// Relays every message committed to the spool on to the servers responsible
+/// for its recipients
+///
+struct Delivery {
+    config: Config,
+    spool: PathBuf,
+    resolver: Resolver,
+    pool: Pool,
+    tls: Option<TlsConnector>,
+    /// Limits how many messages are being delivered at once
+    in_flight: Arc<Semaphore>,
+}
+
+///
+/// Start delivering messages, beginning with any left in the spool from
+/// before a restart. This must be called before the spool is opened, and the
+/// returned sender handed to it.
+///
+/// # Errors
+/// If the messages already in the spool can't be read
+///
+pub fn start(config: &Config, spool: &spool::Config) -> std::io::Result<mpsc::Sender<Event>> {
+    let (events, receiver) = mpsc::channel(config.in_flight.max(1));
+
+    let segments = match spool::segments(&spool.path) {
+        Err(err) if err.kind() == std::io::ErrorKind::NotFound => Vec::new(),
+        segments => segments?,
+    };
+
+    // Only the envelopes are read, as the bodies are read from the spool again
+    // when they're sent
+    let mut recovered = Vec::new();
+    for number in segments {
+        let done = spool::read_done(&spool.path, number)?;
+
+        recovered.extend(
+            spool::read_segment(&spool.path, number)?
+                .into_iter()
+                .filter(|message| !done.contains(&message.id))
+                .map(Event::Committed),
+        );
+
+        // Nothing is ever added to a segment from before a restart
+        recovered.push(Event::Sealed(number));
+    }
+
+    let tls = config
+        .starttls
+        .then(|| connector(&config.ca_certificates))
+        .transpose()
+        .unwrap_or_else(|err| {
+            internal!(
+                level = WARN,
+                "Unable to load {}, so TLS won't be used for delivery: {err}",
+                config.ca_certificates.display()
+            );
+            None
+        });
+
+    let delivery = Arc::new(Delivery {
+        resolver: Resolver::new(&config.nameservers),
+        pool: Pool::new(config.connections, Duration::from_secs(config.idle)),
+        config: config.clone(),
+        spool: spool.path.clone(),
+        tls,
+        in_flight: Arc::new(Semaphore::new(config.in_flight.max(1))),
+    });
+
+    tokio::spawn(delivery.run(recovered, receiver));
+
+    Ok(events)
+}
+
+impl Delivery {
+    async fn run(self: Arc<Self>, recovered: Vec<Event>, mut events: mpsc::Receiver<Event>) {
+        let (finished, mut done) = mpsc::unbounded_channel();
+        let mut segments = HashMap::<u64, Segment>::new();
+        let mut recovered = recovered.into_iter();
+
+        loop {
+            // Whatever was left in the spool is dealt with before anything new
+            let next = async {
+                match recovered.next() {
+                    Some(event) => Some(event),
+                    None => events.recv().await,
+                }
+            };
+
+            let number = tokio::select! {
+                Some(event) = next => match event {
+                    Event::Committed(message) => {
+                        let number = message.id >> 32;
+                        segments.entry(number).or_default().outstanding += 1;
+
+                        // Nothing more is taken from the spool until there's
+                        // room for it
+                        let permit = Arc::clone(&self.in_flight)
+                            .acquire_owned()
+                            .await
+                            .expect("Delivery semaphore is never closed");
+                        self.dispatch(message, permit, &finished);
+                        number
+                    }
+                    Event::Sealed(number) => {
+                        segments.entry(number).or_default().sealed = true;
+                        number
+                    }
+                },
+                Some(id) = done.recv() => {
+                    if let Err(err) = spool::mark_done(&self.spool, id) {
+                        internal!(level = ERROR, "Unable to mark {id:016X} as done: {err}");
+                    }
+
+                    let number = id >> 32;
+                    if let Some(segment) = segments.get_mut(&number) {
+                        segment.outstanding -= 1;
+                    }
+                    number
+                }
+                else => break,
+            };
+
+            // Once everything in a full segment has been dealt with, it's no
+            // longer needed
+            if let Some(Segment {
+                outstanding: 0,
+                sealed: true,
+            }) = segments.get(&number)
+            {
+                segments.remove(&number);
+                if let Err(err) = spool::remove_segment(&self.spool, number) {
+                    internal!(
+                        level = ERROR,
+                        "Unable to remove spool segment {number}: {err}"
+                    );
+                }
+            }
+        }
+    }
+
+    /// Start delivering a message, to every domain it's addressed to at once.
+    /// The permit is held until it has been delivered to all of them.
+    fn dispatch(
+        self: &Arc<Self>,
+        message: Message,
+        permit: OwnedSemaphorePermit,
+        finished: &mpsc::UnboundedSender<u64>,
+    ) {
+        let transactions = transactions(&message.recipients, self.config.max_recipients);
+        if transactions.is_empty() {
+            let _ = finished.send(message.id);
+            return;
+        }
+
+        let message = Arc::new(message);
+        let remaining = Arc::new(AtomicUsize::new(transactions.len()));
+        let permit = Arc::new(permit);
+
+        for (domain, recipients) in transactions {
+            let delivery = Arc::clone(self);
+            let message = Arc::clone(&message);
+            let remaining = Arc::clone(&remaining);
+            let finished = finished.clone();
+            let permit = Arc::clone(&permit);
+
+            tokio::spawn(async move {
+                delivery.deliver(&message, &domain, recipients).await;
+
+                if remaining.fetch_sub(1, Ordering::AcqRel) == 1 {
+                    let _ = finished.send(message.id);
+                }
+                drop(permit);
+            });
+        }
+    }
+
+    /// Keep trying to deliver a message to `recipients` until it has been
+    /// accepted or rejected for all of them, or there are no more attempts left
+    async fn deliver(&self, message: &Message, domain: &str, mut recipients: Vec<String>) {
+        let mut delay = Duration::from_secs(self.config.retry);
+
+        for attempt in 1..=self.config.attempts.max(1) {
+            recipients = self.attempt(message, domain, recipients).await;
+
+            if recipients.is_empty() {
+                return;
+            }
+
+            if attempt < self.config.attempts {
+                internal!(
+                    level = INFO,
+                    "Retrying {:016X} to {domain} in {delay:?}",
+                    message.id
+                );
+                tokio::time::sleep(delay).await;
+                delay *= 2;
+            }
+        }
+
+        internal!(
+            level = ERROR,
+            "Giving up on delivering {:016X} to {recipients:?}",
+            message.id
+        );
+    }
+
+    ///
+    /// Try every mail exchanger for `domain` in turn, until one of them gives a
+    /// definite answer. Returns the recipients that should be tried again later.
+    ///
+    async fn attempt(
+        &self,
+        message: &Message,
+        domain: &str,
+        recipients: Vec<String>,
+    ) -> Vec<String> {
+        let exchangers = match self.resolver.exchangers(domain).await {
+            Ok(exchangers) => exchangers,
+            Err(err) if err.kind() == std::io::ErrorKind::NotFound => {
+                internal!(
+                    level = WARN,
+                    "Unable to deliver {:016X} to {recipients:?}: {err}",
+                    message.id
+                );
+                return Vec::new();
+            }
+            Err(err) => {
+                internal!(level = WARN, "Unable to look up {domain}: {err}");
+                return recipients;
+            }
+        };
+
+        for host in exchangers {
+            let addresses = match self.resolver.addresses(&host).await {
+                Ok(addresses) => addresses,
+                Err(err) => {
+                    internal!(level = WARN, "Unable to look up {host}: {err}");
+                    continue;
+                }
+            };
+
+            for address in addresses {
+                let address = SocketAddr::new(address, self.config.port);
+
+                match self.transaction(address, &host, message, &recipients).await {
+                    Ok(transaction) => {
+                        return Self::outcomes(message, &host, recipients, &transaction);
+                    }
+                    Err(err) => {
+                        internal!(
+                            level = WARN,
+                            "Unable to deliver to {host} ({address}): {err}"
+                        );
+                    }
+                }
+            }
+        }
+
+        recipients
+    }
+
+    /// Note what happened to each recipient, returning those that should be
+    /// tried again later
+    fn outcomes(
+        message: &Message,
+        host: &str,
+        recipients: Vec<String>,
+        transaction: &Transaction,
+    ) -> Vec<String> {
+        let mut deferred = Vec::new();
+
+        for (idx, recipient) in recipients.into_iter().enumerate() {
+            let reply = transaction.outcome(idx);
+
+            if reply.is_positive() {
+                internal!(
+                    level = INFO,
+                    "Delivered {:016X} to {recipient} via {host}",
+                    message.id
+                );
+            } else if reply.is_transient() {
+                deferred.push(recipient);
+            } else {
+                internal!(
+                    level = WARN,
+                    "{host} rejected {:016X} to {recipient}: {} {}",
+                    message.id,
+                    reply.code,
+                    reply.message
+                );
+            }
+        }
+
+        deferred
+    }
+
+    ///
+    /// Send the message to `recipients` in a single transaction with the
+    /// server at `address`, reusing a connection from the pool if there is one.
+    /// The body is read from the spool as it's sent. An 8-bit body isn't sent
+    /// to a server that doesn't support it at all, so that another server can
+    /// be tried, or the message retried later.
+    ///
+    async fn transaction(
+        &self,
+        address: SocketAddr,
+        host: &str,
+        message: &Message,
+        recipients: &[String],
+    ) -> std::io::Result<Transaction> {
+        let (_permit, idle) = self.pool.checkout(address).await;
+
+        // An idle connection may well have been closed by the other side in the
+        // meantime, in which case a new one is needed
+        if let Some(client) = idle {
+            match self.send(address, client, message, recipients).await {
+                Err(err) if err.kind() != std::io::ErrorKind::Unsupported => {}
+                result => return result,
+            }
+        }
+
+        let client = self.connect(address, host).await?;
+        self.send(address, client, message, recipients).await
+    }
+
+    /// Send the message over `client`, which is put back in the pool unless
+    /// the connection failed
+    async fn send(
+        &self,
+        address: SocketAddr,
+        mut client: Client<TcpStream>,
+        message: &Message,
+        recipients: &[String],
+    ) -> std::io::Result<Transaction> {
+        let body = spool::open_body(&self.spool, message).await?;
+
+        match client
+            .send(&message.sender, recipients, message.eight_bit, body)
+            .await
+        {
+            // Nothing was sent, so the connection can still be used
+            Err(err) if err.kind() == std::io::ErrorKind::Unsupported => {
+                self.pool.checkin(address, client);
+                Err(err)
+            }
+            Err(err) => Err(err),
+            Ok(transaction) => {
+                self.pool.checkin(address, client);
+                Ok(transaction)
+            }
+        }
+    }
+
+    ///
+    /// Open a new connection to the server at `address`, negotiating TLS with
+    /// it if possible. Unless TLS is required, a server that doesn't support it,
+    /// or whose certificate can't be verified, is delivered to in plaintext, as
+    /// it would be without STARTTLS at all (RFC-3207, 4.1).
+    ///
+    async fn connect(&self, address: SocketAddr, host: &str) -> std::io::Result<Client<TcpStream>> {
+        let helo = &self.config.helo;
+        let client = Client::handshake(Self::open(address).await?, host, helo, None).await?;
+
+        let refused = |reason: &str| {
+            std::io::Error::new(
+                std::io::ErrorKind::PermissionDenied,
+                format!("TLS is required, but {reason}"),
+            )
+        };
+
+        let Some(connector) = &self.tls else {
+            return if self.config.require_tls {
+                Err(refused("it can't be used"))
+            } else {
+                Ok(client)
+            };
+        };
+
+        if !client.offers_tls() {
+            if self.config.require_tls {
+                return Err(refused(&format!("{host} doesn't support it")));
+            }
+
+            internal!(level = DEBUG, "{host} doesn't support TLS");
+            return Ok(client);
+        }
+
+        match client.start_tls(connector, host, helo).await {
+            Ok(client) => Ok(client),
+            Err(err) if self.config.require_tls => Err(err),
+            Err(err) => {
+                internal!(
+                    level = WARN,
+                    "Unable to negotiate TLS with {host}, so delivering in plaintext: {err}"
+                );
+
+                // Whatever went wrong, the connection can't be used any more
+                Client::handshake(Self::open(address).await?, host, helo, None).await
+            }
+        }
+    }
+
+    async fn open(address: SocketAddr) -> std::io::Result<TcpStream> {
+        tokio::time::timeout(CONNECT_TIMEOUT, TcpStream::connect(address))
+            .await
+            .map_err(|_| std::io::Error::from(std::io::ErrorKind::TimedOut))?
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::transactions;
+
+    #[test]
+    fn test_transactions() {
+        let recipients =
+            ["a@one.com", "b@two.com", "c@ONE.com", "d@one.com", "local"].map(String::from);
+
+        assert_eq!(
+            transactions(&recipients, 2),
+            [
+                (
+                    String::from("one.com"),
+                    vec![String::from("a@one.com"), String::from("c@ONE.com")]
+                ),
+                (String::from("one.com"), vec![String::from("d@one.com")]),
+                (String::from("two.com"), vec![String::from("b@two.com")]),
+            ]
+        );
+    }
+}
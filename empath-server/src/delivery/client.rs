@@ -0,0 +1,627 @@
+use std::{fmt::Write, time::Duration};
+
+use memchr::memchr;
+use tokio::io::{AsyncRead, AsyncReadExt, AsyncWrite, AsyncWriteExt};
+use tokio_rustls::{client::TlsStream, rustls::ServerName, TlsConnector};
+
+/// How long to wait for any single reply, as suggested in section 4.5.3.2 of
+/// [RFC-5321](https://www.ietf.org/rfc/rfc5321.txt)
+const REPLY_TIMEOUT: Duration = Duration::from_secs(300);
+
+/// The longest reply line that will be accepted from a server
+const MAX_REPLY_LENGTH: usize = 4096;
+
+/// How much of a body is read at once, to be sent on
+const BODY_PIECE_SIZE: usize = 64 << 10;
+
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct Reply {
+    pub code: u16,
+    pub message: String,
+}
+
+impl Reply {
+    pub const fn is_positive(&self) -> bool {
+        self.code < 400
+    }
+
+    /// Whether trying again later might work
+    pub const fn is_transient(&self) -> bool {
+        self.code >= 400 && self.code < 500
+    }
+}
+
+///
+/// The replies to a single mail transaction
+///
+#[derive(Debug)]
+pub struct Transaction {
+    pub mail: Reply,
+    pub recipients: Vec<Reply>,
+    /// The reply to the end of the message, or to `DATA` itself if the server
+    /// wouldn't take the message. This is `None` if `DATA` was never sent, or
+    /// no recipients were accepted.
+    pub data: Option<Reply>,
+}
+
+impl Transaction {
+    /// The reply that decided what happened to the recipient at `idx`
+    pub fn outcome(&self, idx: usize) -> &Reply {
+        if !self.mail.is_positive() {
+            return &self.mail;
+        }
+
+        match (&self.recipients[idx], &self.data) {
+            (rcpt, Some(data)) if rcpt.is_positive() => data,
+            (rcpt, _) => rcpt,
+        }
+    }
+}
+
+enum Stream<S> {
+    Plain(S),
+    Tls(Box<TlsStream<S>>),
+}
+
+///
+/// A connection to another server, that messages can be relayed over. Once a
+/// transaction is complete, the connection can be used for another.
+///
+pub struct Client<S: AsyncRead + AsyncWrite + Unpin + Send> {
+    stream: Stream<S>,
+    /// Anything received that hasn't been parsed as a reply yet
+    input: Vec<u8>,
+    pipelining: bool,
+    starttls: bool,
+    eight_bit_mime: bool,
+}
+
+fn protocol(message: &str) -> std::io::Error {
+    std::io::Error::new(std::io::ErrorKind::InvalidData, message)
+}
+
+///
+/// Copies a body a piece at a time, with any line starting with a `.` escaped,
+/// remembering where the last piece ended so that lines can be split between
+/// pieces
+///
+struct Stuffing {
+    /// Whether the next byte starts a line
+    line_start: bool,
+    /// The last two bytes of the body so far
+    tail: [u8; 2],
+    empty: bool,
+}
+
+impl Default for Stuffing {
+    fn default() -> Self {
+        Self {
+            line_start: true,
+            tail: [0; 2],
+            empty: true,
+        }
+    }
+}
+
+impl Stuffing {
+    fn push(&mut self, piece: &[u8], out: &mut Vec<u8>) {
+        out.reserve(piece.len() + 5);
+        let mut rest = piece;
+
+        while !rest.is_empty() {
+            if self.line_start && rest[0] == b'.' {
+                out.push(b'.');
+            }
+
+            let end = memchr(b'\n', rest).map_or(rest.len(), |end| end + 1);
+            out.extend_from_slice(&rest[..end]);
+            self.line_start = rest[end - 1] == b'\n';
+            rest = &rest[end..];
+        }
+
+        match *piece {
+            [.., second, last] => self.tail = [second, last],
+            [last] => self.tail = [self.tail[1], last],
+            [] => {}
+        }
+        self.empty &= piece.is_empty();
+    }
+
+    /// Terminate the body with `<CRLF>.<CRLF>`
+    fn finish(self, out: &mut Vec<u8>) {
+        if !self.empty && self.tail != *b"\r\n" {
+            out.extend_from_slice(b"\r\n");
+        }
+        out.extend_from_slice(b".\r\n");
+    }
+}
+
+impl<S: AsyncRead + AsyncWrite + Unpin + Send> Client<S> {
+    ///
+    /// Greet a server over a freshly opened `stream`, negotiating TLS if both
+    /// sides support it
+    ///
+    /// # Errors
+    /// If the server doesn't greet us, or TLS negotiation fails
+    ///
+    pub async fn handshake(
+        stream: S,
+        host: &str,
+        helo: &str,
+        tls: Option<&TlsConnector>,
+    ) -> std::io::Result<Self> {
+        let mut client = Self {
+            stream: Stream::Plain(stream),
+            input: Vec::with_capacity(1024),
+            pipelining: false,
+            starttls: false,
+            eight_bit_mime: false,
+        };
+
+        let greeting = client.reply().await?;
+        if greeting.code != 220 {
+            return Err(protocol(&greeting.message));
+        }
+
+        client.ehlo(helo).await?;
+
+        match tls {
+            Some(connector) if client.offers_tls() => client.start_tls(connector, host, helo).await,
+            _ => Ok(client),
+        }
+    }
+
+    /// Whether the server supports negotiating TLS, and it hasn't been already
+    pub const fn offers_tls(&self) -> bool {
+        self.starttls
+    }
+
+    ///
+    /// Negotiate TLS with the server, verifying that its certificate is for
+    /// `host`
+    ///
+    /// # Errors
+    /// If the server refuses, or negotiation fails. Either way, the connection
+    /// can't be used any more.
+    ///
+    pub async fn start_tls(
+        mut self,
+        connector: &TlsConnector,
+        host: &str,
+        helo: &str,
+    ) -> std::io::Result<Self> {
+        let reply = self.command(b"STARTTLS\r\n").await?;
+        if reply.code != 220 {
+            return Err(protocol(&reply.message));
+        }
+
+        let Stream::Plain(stream) = self.stream else {
+            unreachable!("TLS is only negotiated once");
+        };
+
+        let name = ServerName::try_from(host).map_err(|err| protocol(&err.to_string()))?;
+        self.stream = Stream::Tls(Box::new(connector.connect(name, stream).await?));
+        self.input.clear();
+        // The server forgets everything it was told before TLS (RFC-3207)
+        self.ehlo(helo).await?;
+
+        Ok(self)
+    }
+
+    /// Send each command of the envelope on its own, even if the server
+    /// supports pipelining
+    pub fn disable_pipelining(&mut self) {
+        self.pipelining = false;
+    }
+
+    /// Whether the server accepts 8-bit bodies
+    /// ([RFC-6152](https://www.ietf.org/rfc/rfc6152.txt))
+    pub const fn offers_8bitmime(&self) -> bool {
+        self.eight_bit_mime
+    }
+
+    /// Whether the session is encrypted
+    pub const fn is_tls(&self) -> bool {
+        matches!(self.stream, Stream::Tls(_))
+    }
+
+    async fn ehlo(&mut self, helo: &str) -> std::io::Result<()> {
+        let reply = self.command(format!("EHLO {helo}\r\n").as_bytes()).await?;
+
+        if reply.code != 250 {
+            // An old server that doesn't support any extensions
+            self.pipelining = false;
+            self.eight_bit_mime = false;
+            let reply = self.command(format!("HELO {helo}\r\n").as_bytes()).await?;
+            if reply.code != 250 {
+                return Err(protocol(&reply.message));
+            }
+            return Ok(());
+        }
+
+        // The first line is the greeting, every line after it an extension
+        let extensions = reply
+            .message
+            .lines()
+            .skip(1)
+            .map(|line| line.split_whitespace().next().unwrap_or_default())
+            .collect::<Vec<_>>();
+
+        self.pipelining = extensions
+            .iter()
+            .any(|ext| ext.eq_ignore_ascii_case("PIPELINING"));
+        self.starttls = !self.is_tls()
+            && extensions
+                .iter()
+                .any(|ext| ext.eq_ignore_ascii_case("STARTTLS"));
+        self.eight_bit_mime = extensions
+            .iter()
+            .any(|ext| ext.eq_ignore_ascii_case("8BITMIME"));
+
+        Ok(())
+    }
+
+    async fn write(&mut self, buffer: &[u8]) -> std::io::Result<()> {
+        match self.stream {
+            Stream::Plain(ref mut stream) => stream.write_all(buffer).await,
+            Stream::Tls(ref mut stream) => {
+                stream.write_all(buffer).await?;
+                stream.flush().await
+            }
+        }
+    }
+
+    async fn read(&mut self) -> std::io::Result<usize> {
+        self.input.reserve(1024);
+
+        let read = async {
+            match self.stream {
+                Stream::Plain(ref mut stream) => stream.read_buf(&mut self.input).await,
+                Stream::Tls(ref mut stream) => stream.read_buf(&mut self.input).await,
+            }
+        };
+
+        match tokio::time::timeout(REPLY_TIMEOUT, read).await {
+            Ok(Ok(0)) => Err(std::io::ErrorKind::UnexpectedEof.into()),
+            Ok(result) => result,
+            Err(_) => Err(std::io::ErrorKind::TimedOut.into()),
+        }
+    }
+
+    ///
+    /// Read a single, possibly multiline, reply. The lines of a multiline reply
+    /// are joined with newlines.
+    ///
+    async fn reply(&mut self) -> std::io::Result<Reply> {
+        let mut message = String::new();
+
+        loop {
+            let Some(end) = memchr(b'\n', &self.input) else {
+                if self.input.len() > MAX_REPLY_LENGTH {
+                    return Err(protocol("Reply is too long"));
+                }
+                self.read().await?;
+                continue;
+            };
+
+            let line = String::from_utf8_lossy(&self.input[..end])
+                .trim_end()
+                .to_string();
+            self.input.drain(..=end);
+
+            let code = line
+                .get(..3)
+                .and_then(|code| code.parse::<u16>().ok())
+                .ok_or_else(|| protocol("Invalid reply"))?;
+
+            if !message.is_empty() {
+                message.push('\n');
+            }
+            message.push_str(line.get(4..).unwrap_or_default());
+
+            // The last line of a reply has a space after the code, instead of a `-`
+            if line.as_bytes().get(3) != Some(&b'-') {
+                return Ok(Reply { code, message });
+            }
+        }
+    }
+
+    async fn command(&mut self, command: &[u8]) -> std::io::Result<Reply> {
+        self.write(command).await?;
+        self.reply().await
+    }
+
+    ///
+    /// Send a message to every one of `recipients` in a single transaction. If
+    /// the server supports pipelining, the whole envelope is sent at once. The
+    /// body is read a piece at a time, as it's sent.
+    ///
+    /// An `eight_bit` body is declared as such, and is only sent to a server
+    /// that supports it (RFC-6152, 3).
+    ///
+    /// # Errors
+    /// If the connection fails part way through, or the body can't be read, in
+    /// which case the connection shouldn't be used again. If the body is
+    /// `eight_bit` and the server doesn't support that, this fails with
+    /// [`std::io::ErrorKind::Unsupported`] before anything is sent, and the
+    /// connection can still be used.
+    ///
+    pub async fn send(
+        &mut self,
+        sender: &str,
+        recipients: &[String],
+        eight_bit: bool,
+        mut body: impl AsyncRead + Unpin + Send,
+    ) -> std::io::Result<Transaction> {
+        if eight_bit && !self.eight_bit_mime {
+            return Err(std::io::Error::new(
+                std::io::ErrorKind::Unsupported,
+                "The server doesn't support 8BITMIME",
+            ));
+        }
+
+        let mut envelope = format!(
+            "MAIL FROM:<{sender}>{}\r\n",
+            if eight_bit { " BODY=8BITMIME" } else { "" }
+        );
+        for recipient in recipients {
+            let _ = write!(envelope, "RCPT TO:<{recipient}>\r\n");
+        }
+
+        let mut transaction = if self.pipelining {
+            envelope.push_str("DATA\r\n");
+            self.write(envelope.as_bytes()).await?;
+
+            let mail = self.reply().await?;
+            let mut replies = Vec::with_capacity(recipients.len());
+            for _ in recipients {
+                replies.push(self.reply().await?);
+            }
+
+            let data = self.reply().await?;
+            Transaction {
+                mail,
+                recipients: replies,
+                data: Some(data),
+            }
+        } else {
+            let mut lines = envelope.split_inclusive("\r\n");
+            let mail = self
+                .command(lines.next().unwrap_or_default().as_bytes())
+                .await?;
+            let mut replies = Vec::with_capacity(recipients.len());
+
+            if mail.is_positive() {
+                for line in lines {
+                    replies.push(self.command(line.as_bytes()).await?);
+                }
+            }
+
+            let data = if replies.iter().any(Reply::is_positive) {
+                Some(self.command(b"DATA\r\n").await?)
+            } else {
+                None
+            };
+
+            Transaction {
+                mail,
+                recipients: replies,
+                data,
+            }
+        };
+
+        match transaction.data {
+            Some(ref data) if data.code == 354 => {
+                let accepted = transaction.mail.is_positive()
+                    && transaction.recipients.iter().any(Reply::is_positive);
+
+                let mut stuffing = Stuffing::default();
+                let mut message = Vec::new();
+
+                // A server that accepts DATA without any recipients still
+                // needs the message ended, but it gets none of it
+                if accepted {
+                    let mut piece = vec![0; BODY_PIECE_SIZE];
+                    loop {
+                        let read = body.read(&mut piece).await?;
+                        if read == 0 {
+                            break;
+                        }
+
+                        message.clear();
+                        stuffing.push(&piece[..read], &mut message);
+                        self.write(&message).await?;
+                    }
+                }
+
+                message.clear();
+                stuffing.finish(&mut message);
+                self.write(&message).await?;
+
+                let reply = self.reply().await?;
+                transaction.data = accepted.then_some(reply);
+            }
+            _ => {
+                // Whatever the server said to DATA (if it was sent) is what
+                // happened to every recipient it had accepted. The server then
+                // has to forget anything it was told, before the connection is
+                // used again.
+                self.command(b"RSET\r\n").await?;
+            }
+        }
+
+        if transaction.recipients.len() < recipients.len() {
+            transaction
+                .recipients
+                .resize(recipients.len(), transaction.mail.clone());
+        }
+
+        Ok(transaction)
+    }
+
+    /// End the session politely
+    pub async fn quit(mut self) {
+        let _ = self.command(b"QUIT\r\n").await;
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use std::{
+        net::{IpAddr, Ipv6Addr, SocketAddr},
+        sync::{atomic::AtomicU64, Arc},
+    };
+
+    use tokio::io::{AsyncBufReadExt, AsyncWriteExt, BufReader};
+
+    use crate::smtp::Smtp;
+
+    use super::{Client, Stuffing};
+
+    /// A server that accepts everything, except that it answers `DATA` with
+    /// `data`
+    async fn refuse_data(stream: tokio::io::DuplexStream, data: &str) {
+        let (reader, mut writer) = tokio::io::split(stream);
+        let mut lines = BufReader::new(reader).lines();
+
+        writer.write_all(b"220 test\r\n").await.unwrap();
+        while let Some(line) = lines.next_line().await.unwrap() {
+            let reply = match line.split_whitespace().next().unwrap_or_default() {
+                "DATA" => format!("{data}\r\n"),
+                "QUIT" => String::from("221 Bye\r\n"),
+                _ => String::from("250 Ok\r\n"),
+            };
+
+            writer.write_all(reply.as_bytes()).await.unwrap();
+        }
+    }
+
+    fn stuff(pieces: &[&[u8]]) -> Vec<u8> {
+        let mut stuffing = Stuffing::default();
+        let mut out = Vec::new();
+        for piece in pieces {
+            stuffing.push(piece, &mut out);
+        }
+        stuffing.finish(&mut out);
+
+        out
+    }
+
+    #[test]
+    fn test_stuff() {
+        assert_eq!(
+            stuff(&[b".Hello\r\nWorld\r\n..\r\n"]),
+            b"..Hello\r\nWorld\r\n...\r\n.\r\n"
+        );
+        assert_eq!(stuff(&[b"No newline"]), b"No newline\r\n.\r\n");
+        assert_eq!(stuff(&[]), b".\r\n");
+
+        // Lines, and their endings, split between pieces
+        assert_eq!(
+            stuff(&[b"Hello\r\n", b".World\r", b"\n", b"Not.", b".\r\n"]),
+            b"Hello\r\n..World\r\nNot..\r\n.\r\n"
+        );
+        assert_eq!(stuff(&[b"Ends\r", b"\n"]), b"Ends\r\n.\r\n");
+    }
+
+    #[tokio::test]
+    async fn test_transaction() {
+        let (client, server) = tokio::io::duplex(4096);
+        let peer = SocketAddr::new(IpAddr::V6(Ipv6Addr::LOCALHOST), 0);
+        let session = tokio::spawn(Smtp::default().prepare().unwrap().connect(
+            Arc::new(AtomicU64::default()),
+            server,
+            peer,
+        ));
+
+        let mut client = Client::handshake(client, "localhost", "test", None)
+            .await
+            .unwrap();
+        assert!(client.pipelining);
+        assert!(client.offers_8bitmime());
+
+        let recipients = [String::from("one@test.com"), String::from("two@test.com")];
+        for queued in 0..2 {
+            let transaction = client
+                .send(
+                    "sender@test.com",
+                    &recipients,
+                    queued == 1,
+                    &b".Hello\r\n"[..],
+                )
+                .await
+                .unwrap();
+
+            assert_eq!(
+                transaction.outcome(1).message,
+                format!("Ok: queued as {queued}")
+            );
+        }
+
+        client.quit().await;
+        session.await.unwrap().unwrap();
+    }
+
+    #[tokio::test]
+    async fn test_data_refused() {
+        for (data, transient) in [("451 Try again later", true), ("554 No thanks", false)] {
+            let (client, server) = tokio::io::duplex(4096);
+            let server = tokio::spawn(refuse_data(server, data));
+
+            let mut client = Client::handshake(client, "localhost", "test", None)
+                .await
+                .unwrap();
+
+            let recipients = [String::from("one@test.com")];
+            let transaction = client
+                .send("sender@test.com", &recipients, false, &b"Hello\r\n"[..])
+                .await
+                .unwrap();
+
+            // The recipient was accepted, but the message never was
+            let outcome = transaction.outcome(0);
+            assert!(!outcome.is_positive());
+            assert_eq!(outcome.is_transient(), transient);
+            assert_eq!(format!("{} {}", outcome.code, outcome.message), data);
+
+            // The server was told to forget the message, and then goodbye
+            client.quit().await;
+            server.await.unwrap();
+        }
+    }
+
+    #[tokio::test]
+    async fn test_no_8bitmime() {
+        let (client, server) = tokio::io::duplex(4096);
+        let server = tokio::spawn(refuse_data(server, "554 No thanks"));
+
+        let mut client = Client::handshake(client, "localhost", "test", None)
+            .await
+            .unwrap();
+        assert!(!client.offers_8bitmime());
+
+        // An 8-bit body is never offered to a server that hasn't said it can
+        // take one
+        let recipients = [String::from("one@test.com")];
+        let err = client
+            .send(
+                "sender@test.com",
+                &recipients,
+                true,
+                &b"Caf\xc3\xa9\r\n"[..],
+            )
+            .await
+            .unwrap_err();
+        assert_eq!(err.kind(), std::io::ErrorKind::Unsupported);
+
+        // Nothing was sent, so the connection is still in step with the server
+        let transaction = client
+            .send("sender@test.com", &recipients, false, &b"Hello\r\n"[..])
+            .await
+            .unwrap();
+        assert_eq!(transaction.outcome(0).code, 554);
+
+        client.quit().await;
+        server.await.unwrap();
+    }
+}
@@ -0,0 +1,624 @@
+use std::{
+    collections::HashMap,
+    net::{IpAddr, Ipv4Addr, Ipv6Addr, SocketAddr},
+    sync::{
+        atomic::{AtomicU16, Ordering},
+        Arc, Mutex,
+    },
+    time::{Duration, Instant},
+};
+
+use tokio::{
+    io::{AsyncReadExt, AsyncWriteExt},
+    net::{TcpStream, UdpSocket},
+};
+
+/// How long to wait for a nameserver to answer, before trying the next one
+const QUERY_TIMEOUT: Duration = Duration::from_secs(2);
+
+/// How long to remember that a name doesn't exist, or has no records, when the
+/// nameserver doesn't say
+const NEGATIVE_TTL: Duration = Duration::from_secs(60);
+
+/// The longest any answer is cached, whatever its TTL
+const MAX_TTL: Duration = Duration::from_secs(86400);
+
+/// How often answers that have expired are forgotten about, rather than only
+/// when the same name is looked up again
+const SWEEP_INTERVAL: Duration = Duration::from_secs(60);
+
+/// The most compression pointers followed in a single name, so that a
+/// malicious answer can't send the parser round in circles
+const MAX_POINTERS: usize = 32;
+
+const TYPE_A: u16 = 1;
+const TYPE_SOA: u16 = 6;
+const TYPE_MX: u16 = 15;
+const TYPE_AAAA: u16 = 28;
+const CLASS_IN: u16 = 1;
+
+/// The name doesn't exist
+const RCODE_NXDOMAIN: u16 = 3;
+
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub enum Record {
+    Mx { preference: u16, exchange: String },
+    Address(IpAddr),
+}
+
+struct Cached {
+    expires: Instant,
+    /// `None` when the name doesn't exist
+    records: Option<Arc<[Record]>>,
+}
+
+struct Cache {
+    answers: HashMap<(String, u16), Cached>,
+    /// When answers that have expired were last forgotten about
+    swept: Instant,
+}
+
+fn invalid(message: &str) -> std::io::Error {
+    std::io::Error::new(std::io::ErrorKind::InvalidData, message)
+}
+
+fn not_found(name: &str) -> std::io::Error {
+    std::io::Error::new(
+        std::io::ErrorKind::NotFound,
+        format!("{name} does not exist"),
+    )
+}
+
+/// The nameservers listed in /etc/resolv.conf, if there are any
+fn system_nameservers() -> Vec<SocketAddr> {
+    std::fs::read_to_string("/etc/resolv.conf")
+        .unwrap_or_default()
+        .lines()
+        .filter_map(|line| line.strip_prefix("nameserver"))
+        .filter_map(|address| address.trim().parse::<IpAddr>().ok())
+        .map(|address| SocketAddr::new(address, 53))
+        .collect()
+}
+
+///
+/// Build a recursive query for the `kind` records of `name`
+///
+fn query(id: u16, name: &str, kind: u16) -> std::io::Result<Vec<u8>> {
+    let mut packet = Vec::with_capacity(name.len() + 18);
+    packet.extend_from_slice(&id.to_be_bytes());
+    // Recursion desired, and a single question
+    packet.extend_from_slice(&[0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0]);
+
+    for label in name.trim_end_matches('.').split('.') {
+        let length = u8::try_from(label.len())
+            .ok()
+            .filter(|length| (1..64).contains(length))
+            .ok_or_else(|| invalid("Invalid domain name"))?;
+
+        packet.push(length);
+        packet.extend_from_slice(label.as_bytes());
+    }
+
+    packet.push(0);
+    packet.extend_from_slice(&kind.to_be_bytes());
+    packet.extend_from_slice(&CLASS_IN.to_be_bytes());
+
+    Ok(packet)
+}
+
+fn u16_at(packet: &[u8], at: usize) -> Option<u16> {
+    Some(u16::from_be_bytes(packet.get(at..at + 2)?.try_into().ok()?))
+}
+
+fn u32_at(packet: &[u8], at: usize) -> Option<u32> {
+    Some(u32::from_be_bytes(packet.get(at..at + 4)?.try_into().ok()?))
+}
+
+///
+/// Read the (possibly compressed) name at `at`, returning it along with where
+/// the name ends in the packet
+///
+fn name_at(packet: &[u8], mut at: usize) -> Option<(String, usize)> {
+    let mut name = String::new();
+    let mut end = None;
+
+    for _ in 0..MAX_POINTERS {
+        loop {
+            let length = *packet.get(at)? as usize;
+
+            match length {
+                0 => {
+                    return Some((name, end.unwrap_or(at + 1)));
+                }
+                // A pointer to the rest of the name, somewhere earlier in the packet
+                0xc0.. => {
+                    end.get_or_insert(at + 2);
+                    at = usize::from(u16_at(packet, at)? & 0x3fff);
+                    break;
+                }
+                _ => {
+                    let label = packet.get(at + 1..at + 1 + length)?;
+                    if !name.is_empty() {
+                        name.push('.');
+                    }
+                    name.push_str(std::str::from_utf8(label).ok()?);
+                    at += 1 + length;
+                }
+            }
+        }
+    }
+
+    None
+}
+
+///
+/// Parse an answer to the query with `id`, returning the records of the type
+/// that was asked for (or `None` if the name doesn't exist), and how long the
+/// answer can be cached for
+///
+fn parse(packet: &[u8], id: u16, kind: u16) -> std::io::Result<(Option<Vec<Record>>, Duration)> {
+    let truncated = || invalid("Truncated answer");
+
+    if u16_at(packet, 0) != Some(id) {
+        return Err(invalid("Answer doesn't match the query"));
+    }
+
+    let flags = u16_at(packet, 2).ok_or_else(truncated)?;
+    let exists = match flags & 0x000f {
+        0 => true,
+        RCODE_NXDOMAIN => false,
+        rcode => return Err(invalid(&format!("Nameserver failed with {rcode}"))),
+    };
+
+    let questions = u16_at(packet, 4).ok_or_else(truncated)?;
+    let answers = u16_at(packet, 6).ok_or_else(truncated)?;
+    let authorities = u16_at(packet, 8).ok_or_else(truncated)?;
+    let mut at = 12;
+
+    for _ in 0..questions {
+        at = name_at(packet, at).ok_or_else(truncated)?.1 + 4;
+    }
+
+    let mut records = Vec::with_capacity(usize::from(answers));
+    let mut ttl = MAX_TTL;
+    // How long not having any records can be cached for, from the SOA record
+    // that comes with a negative answer (RFC 2308, 5)
+    let mut negative = None;
+
+    for idx in 0..u32::from(answers) + u32::from(authorities) {
+        at = name_at(packet, at).ok_or_else(truncated)?.1;
+
+        let answer = (|| {
+            let rtype = u16_at(packet, at)?;
+            let class = u16_at(packet, at + 2)?;
+            let seconds = u32_at(packet, at + 4)?;
+            let length = usize::from(u16_at(packet, at + 8)?);
+            let data = packet.get(at + 10..at + 10 + length)?;
+
+            // Anything else, e.g. the CNAMEs followed to get here, is skipped over
+            let record = match (rtype, class) {
+                _ if class != CLASS_IN => None,
+                (TYPE_SOA, _) if idx >= u32::from(answers) => {
+                    let minimum = u32_at(data, length.checked_sub(4)?)?;
+                    negative = Some(Duration::from_secs(u64::from(seconds.min(minimum))));
+                    None
+                }
+                _ if rtype != kind || idx >= u32::from(answers) => None,
+                (TYPE_MX, _) => Some(Record::Mx {
+                    preference: u16_at(data, 0)?,
+                    exchange: name_at(packet, at + 12)?.0,
+                }),
+                (TYPE_A, _) => Some(Record::Address(IpAddr::V4(Ipv4Addr::from(
+                    <[u8; 4]>::try_from(data).ok()?,
+                )))),
+                (TYPE_AAAA, _) => Some(Record::Address(IpAddr::V6(Ipv6Addr::from(
+                    <[u8; 16]>::try_from(data).ok()?,
+                )))),
+                _ => None,
+            };
+
+            Some((record, seconds, at + 10 + length))
+        })();
+
+        let (record, seconds, next) = answer.ok_or_else(truncated)?;
+        if let Some(record) = record {
+            ttl = ttl.min(Duration::from_secs(u64::from(seconds)));
+            records.push(record);
+        }
+        at = next;
+    }
+
+    if records.is_empty() {
+        ttl = negative.unwrap_or(NEGATIVE_TTL).min(MAX_TTL);
+    }
+
+    Ok((exists.then_some(records), ttl))
+}
+
+/// Whether the nameserver had more to say than fit in its answer (the TC bit)
+fn is_truncated(packet: &[u8]) -> bool {
+    u16_at(packet, 2).is_some_and(|flags| flags & 0x0200 != 0)
+}
+
+///
+/// A small asynchronous stub resolver, which asks the system's nameservers for
+/// MX and address records, and caches their answers for as long as they allow
+///
+pub struct Resolver {
+    nameservers: Vec<SocketAddr>,
+    cache: Mutex<Cache>,
+    next_id: AtomicU16,
+}
+
+impl Resolver {
+    /// Create a resolver that asks `nameservers`, or those in /etc/resolv.conf
+    /// if there are none
+    pub fn new(nameservers: &[SocketAddr]) -> Self {
+        let mut nameservers = nameservers.to_vec();
+        if nameservers.is_empty() {
+            nameservers = system_nameservers();
+        }
+        if nameservers.is_empty() {
+            nameservers.push(SocketAddr::new(IpAddr::V4(Ipv4Addr::LOCALHOST), 53));
+        }
+
+        // Start somewhere unpredictable, so that answers are harder to spoof
+        let seed = std::time::SystemTime::now()
+            .duration_since(std::time::UNIX_EPOCH)
+            .map_or(0, |now| now.subsec_nanos());
+
+        Self {
+            nameservers,
+            cache: Mutex::new(Cache {
+                answers: HashMap::new(),
+                swept: Instant::now(),
+            }),
+            #[allow(clippy::cast_possible_truncation, reason = "Only some bits are needed")]
+            next_id: AtomicU16::new((seed ^ std::process::id()) as u16),
+        }
+    }
+
+    /// The answer for the `kind` records of `name`, if it's cached, which fails
+    /// with `NotFound` if the name doesn't exist
+    fn cached(&self, name: &str, kind: u16) -> Option<std::io::Result<Arc<[Record]>>> {
+        let mut cache = self.cache.lock().expect("Unable to read DNS cache");
+        let key = (name.to_ascii_lowercase(), kind);
+
+        match cache.answers.get(&key) {
+            Some(cached) if cached.expires > Instant::now() => {
+                Some(cached.records.clone().ok_or_else(|| not_found(name)))
+            }
+            Some(_) => {
+                cache.answers.remove(&key);
+                None
+            }
+            None => None,
+        }
+    }
+
+    fn insert(&self, name: &str, kind: u16, records: Option<&Arc<[Record]>>, ttl: Duration) {
+        let mut cache = self.cache.lock().expect("Unable to write DNS cache");
+        Self::sweep(&mut cache, SWEEP_INTERVAL);
+
+        cache.answers.insert(
+            (name.to_ascii_lowercase(), kind),
+            Cached {
+                expires: Instant::now() + ttl,
+                records: records.cloned(),
+            },
+        );
+    }
+
+    /// Every so often, forget about every answer that has expired, so that the
+    /// cache doesn't grow with every name ever looked up
+    fn sweep(cache: &mut Cache, interval: Duration) {
+        if cache.swept.elapsed() < interval {
+            return;
+        }
+        cache.swept = Instant::now();
+
+        let now = Instant::now();
+        cache.answers.retain(|_, cached| cached.expires > now);
+    }
+
+    async fn ask(
+        &self,
+        nameserver: SocketAddr,
+        packet: &[u8],
+        id: u16,
+        kind: u16,
+    ) -> std::io::Result<(Option<Vec<Record>>, Duration)> {
+        let local = match nameserver {
+            SocketAddr::V4(_) => SocketAddr::new(IpAddr::V4(Ipv4Addr::UNSPECIFIED), 0),
+            SocketAddr::V6(_) => SocketAddr::new(IpAddr::V6(Ipv6Addr::UNSPECIFIED), 0),
+        };
+
+        // Connecting means only answers from the nameserver itself are received
+        let socket = UdpSocket::bind(local).await?;
+        socket.connect(nameserver).await?;
+        socket.send(packet).await?;
+
+        let mut answer = vec![0; 4096];
+        let length = tokio::time::timeout(QUERY_TIMEOUT, socket.recv(&mut answer))
+            .await
+            .map_err(|_| std::io::Error::from(std::io::ErrorKind::TimedOut))??;
+
+        // Only some of the records fit, so the rest have to be asked for again
+        if is_truncated(&answer[..length]) {
+            return tokio::time::timeout(QUERY_TIMEOUT, Self::ask_tcp(nameserver, packet))
+                .await
+                .map_err(|_| std::io::Error::from(std::io::ErrorKind::TimedOut))?
+                .and_then(|answer| parse(&answer, id, kind));
+        }
+
+        parse(&answer[..length], id, kind)
+    }
+
+    /// Ask a nameserver over TCP, for an answer that's too large for UDP
+    async fn ask_tcp(nameserver: SocketAddr, packet: &[u8]) -> std::io::Result<Vec<u8>> {
+        let mut stream = TcpStream::connect(nameserver).await?;
+
+        // Over TCP, every message is preceded by its length (RFC 1035, 4.2.2)
+        let length = u16::try_from(packet.len()).map_err(|_| invalid("Query is too large"))?;
+        let mut query = Vec::with_capacity(packet.len() + 2);
+        query.extend_from_slice(&length.to_be_bytes());
+        query.extend_from_slice(packet);
+        stream.write_all(&query).await?;
+
+        let length = stream.read_u16().await?;
+        let mut answer = vec![0; usize::from(length)];
+        stream.read_exact(&mut answer).await?;
+
+        if is_truncated(&answer) {
+            return Err(invalid("Truncated answer"));
+        }
+
+        Ok(answer)
+    }
+
+    ///
+    /// Look up the `kind` records of `name`, from the cache if possible
+    ///
+    async fn lookup(&self, name: &str, kind: u16) -> std::io::Result<Arc<[Record]>> {
+        if let Some(answer) = self.cached(name, kind) {
+            return answer;
+        }
+
+        let id = self.next_id.fetch_add(1, Ordering::Relaxed);
+        let packet = query(id, name, kind)?;
+        let mut last = std::io::Error::from(std::io::ErrorKind::TimedOut);
+
+        for nameserver in &self.nameservers {
+            match self.ask(*nameserver, &packet, id, kind).await {
+                Ok((Some(records), ttl)) => {
+                    let records = Arc::<[Record]>::from(records);
+                    self.insert(name, kind, Some(&records), ttl);
+                    return Ok(records);
+                }
+                Ok((None, ttl)) => {
+                    self.insert(name, kind, None, ttl);
+                    return Err(not_found(name));
+                }
+                Err(err) => last = err,
+            }
+        }
+
+        Err(last)
+    }
+
+    ///
+    /// The hosts that accept mail for `domain`, most preferred first. A domain
+    /// without any MX records is its own mail exchanger (RFC 5321, 5.1).
+    ///
+    /// # Errors
+    /// If the domain doesn't exist, or explicitly doesn't accept mail (RFC 7505),
+    /// this fails with `NotFound`. Otherwise, if none of the nameservers answer.
+    ///
+    pub async fn exchangers(&self, domain: &str) -> std::io::Result<Vec<String>> {
+        let records = self.lookup(domain, TYPE_MX).await?;
+        let mut exchangers = records
+            .iter()
+            .filter_map(|record| match record {
+                Record::Mx {
+                    preference,
+                    exchange,
+                } => Some((*preference, exchange.clone())),
+                Record::Address(_) => None,
+            })
+            .collect::<Vec<_>>();
+
+        if exchangers.is_empty() {
+            return Ok(vec![domain.to_string()]);
+        }
+
+        if exchangers.iter().any(|(_, exchange)| exchange.is_empty()) {
+            return Err(std::io::Error::new(
+                std::io::ErrorKind::NotFound,
+                format!("{domain} does not accept mail"),
+            ));
+        }
+
+        exchangers.sort_by_key(|(preference, _)| *preference);
+        Ok(exchangers
+            .into_iter()
+            .map(|(_, exchange)| exchange)
+            .collect())
+    }
+
+    ///
+    /// Every address of `host`, both IPv4 and IPv6
+    ///
+    /// # Errors
+    /// If neither lookup could be answered
+    ///
+    pub async fn addresses(&self, host: &str) -> std::io::Result<Vec<IpAddr>> {
+        if let Ok(address) = host.trim_start_matches('[').trim_end_matches(']').parse() {
+            return Ok(vec![address]);
+        }
+
+        let (v4, v6) = tokio::join!(self.lookup(host, TYPE_A), self.lookup(host, TYPE_AAAA));
+        if let (Err(err), Err(_)) = (&v4, &v6) {
+            return Err(std::io::Error::new(err.kind(), err.to_string()));
+        }
+
+        Ok([v4, v6]
+            .into_iter()
+            .flatten()
+            .flat_map(|records| records.to_vec())
+            .filter_map(|record| match record {
+                Record::Address(address) => Some(address),
+                Record::Mx { .. } => None,
+            })
+            .collect())
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use std::{
+        net::{IpAddr, Ipv4Addr},
+        sync::Arc,
+        time::Duration,
+    };
+
+    use super::{
+        is_truncated, parse, query, Record, Resolver, MAX_TTL, SWEEP_INTERVAL, TYPE_A, TYPE_MX,
+        TYPE_SOA,
+    };
+
+    /// An answer to `query(7, "example.com", MX)`, with two exchangers whose
+    /// names are compressed against the question
+    fn answer() -> Vec<u8> {
+        let mut packet = query(7, "example.com", TYPE_MX).unwrap();
+        packet[2..4].copy_from_slice(&[0x81, 0x80]);
+        packet[6..8].copy_from_slice(&[0, 2]);
+
+        for (preference, name, ttl) in [(20u16, &b"\x03mx2"[..], 300u32), (10, b"\x03mx1", 60)] {
+            // The owner name points at the question
+            packet.extend_from_slice(&[0xc0, 12]);
+            packet.extend_from_slice(&TYPE_MX.to_be_bytes());
+            packet.extend_from_slice(&[0, 1]);
+            packet.extend_from_slice(&ttl.to_be_bytes());
+            packet.extend_from_slice(&u16::try_from(2 + name.len() + 2).unwrap().to_be_bytes());
+            packet.extend_from_slice(&preference.to_be_bytes());
+            packet.extend_from_slice(name);
+            packet.extend_from_slice(&[0xc0, 12]);
+        }
+
+        packet
+    }
+
+    /// An NXDOMAIN answer to `query(9, "missing.example.com", MX)`, with the SOA
+    /// of the zone saying how long that can be cached for
+    fn nxdomain() -> Vec<u8> {
+        let mut packet = query(9, "missing.example.com", TYPE_MX).unwrap();
+        packet[2..4].copy_from_slice(&[0x81, 0x83]);
+        packet[8..10].copy_from_slice(&[0, 1]);
+
+        // The zone is the end of the question's name
+        packet.extend_from_slice(&[0xc0, 12 + 8]);
+        packet.extend_from_slice(&TYPE_SOA.to_be_bytes());
+        packet.extend_from_slice(&[0, 1]);
+        packet.extend_from_slice(&300u32.to_be_bytes());
+        packet.extend_from_slice(&(2 + 2 + 20u16).to_be_bytes());
+        packet.extend_from_slice(&[0xc0, 12 + 8, 0xc0, 12 + 8]);
+        for value in [1u32, 7200, 3600, 86400, 30] {
+            packet.extend_from_slice(&value.to_be_bytes());
+        }
+
+        packet
+    }
+
+    #[test]
+    fn test_parse() {
+        let (records, ttl) = parse(&answer(), 7, TYPE_MX).unwrap();
+
+        assert_eq!(ttl, Duration::from_secs(60));
+        assert_eq!(
+            records.unwrap(),
+            [
+                Record::Mx {
+                    preference: 20,
+                    exchange: String::from("mx2.example.com")
+                },
+                Record::Mx {
+                    preference: 10,
+                    exchange: String::from("mx1.example.com")
+                },
+            ]
+        );
+
+        // Answers to some other query are ignored
+        assert!(parse(&answer(), 8, TYPE_MX).is_err());
+        // As are truncated ones
+        assert!(parse(&answer()[..40], 7, TYPE_MX).is_err());
+        assert!(!is_truncated(&answer()));
+    }
+
+    #[tokio::test]
+    async fn test_cache() {
+        let resolver = Resolver::new(&[]);
+        let (records, ttl) = parse(&answer(), 7, TYPE_MX).unwrap();
+        resolver.insert("Example.com", TYPE_MX, Some(&records.unwrap().into()), ttl);
+        resolver.insert(
+            "mx1.example.com",
+            TYPE_A,
+            Some(&Arc::from([Record::Address(IpAddr::V4(
+                Ipv4Addr::LOCALHOST,
+            ))])),
+            ttl,
+        );
+
+        // A name that doesn't exist stays that way, rather than having no records
+        let (records, ttl) = parse(&nxdomain(), 9, TYPE_MX).unwrap();
+        assert_eq!(records, None);
+        assert_eq!(ttl, Duration::from_secs(30));
+        resolver.insert("missing.example.com", TYPE_MX, None, ttl);
+        assert_eq!(
+            resolver
+                .exchangers("missing.example.com")
+                .await
+                .unwrap_err()
+                .kind(),
+            std::io::ErrorKind::NotFound
+        );
+
+        assert_eq!(
+            resolver.exchangers("example.com").await.unwrap(),
+            ["mx1.example.com", "mx2.example.com"]
+        );
+        assert_eq!(
+            resolver.lookup("mx1.example.com", TYPE_A).await.unwrap()[..],
+            [Record::Address(IpAddr::V4(Ipv4Addr::LOCALHOST))]
+        );
+        assert_eq!(
+            resolver.addresses("[127.0.0.1]").await.unwrap(),
+            [IpAddr::V4(Ipv4Addr::LOCALHOST)]
+        );
+    }
+
+    #[test]
+    fn test_sweep() {
+        let resolver = Resolver::new(&[]);
+        let records = Arc::from([Record::Address(IpAddr::V4(Ipv4Addr::LOCALHOST))]);
+        resolver.insert(
+            "expired.example.com",
+            TYPE_A,
+            Some(&records),
+            Duration::ZERO,
+        );
+        resolver.insert("fresh.example.com", TYPE_A, Some(&records), MAX_TTL);
+
+        // Expired answers are kept until it's time to sweep them away, even if
+        // they're never looked up again
+        let mut cache = resolver.cache.lock().unwrap();
+        Resolver::sweep(&mut cache, SWEEP_INTERVAL);
+        assert_eq!(cache.answers.len(), 2);
+
+        Resolver::sweep(&mut cache, Duration::ZERO);
+        assert_eq!(
+            cache.answers.keys().collect::<Vec<_>>(),
+            [&(String::from("fresh.example.com"), TYPE_A)]
+        );
+    }
+}
@@ -0,0 +1,176 @@
+use std::{
+    collections::HashMap,
+    net::SocketAddr,
+    sync::{Arc, Mutex},
+    time::{Duration, Instant},
+};
+
+use tokio::{
+    net::TcpStream,
+    sync::{OwnedSemaphorePermit, Semaphore},
+};
+
+use super::client::Client;
+
+struct Destination {
+    /// Limits how many connections can be open to the destination at once
+    connections: Arc<Semaphore>,
+    /// Connections that aren't in use, and when they were last used
+    idle: Vec<(Instant, Client<TcpStream>)>,
+}
+
+impl Destination {
+    /// Close any connections that have been idle for too long, as they've most
+    /// likely been closed by the other side by now
+    fn expire(&mut self, idle: Duration) {
+        let (expired, fresh) = std::mem::take(&mut self.idle)
+            .into_iter()
+            .partition::<Vec<_>, _>(|(since, _)| since.elapsed() >= idle);
+        self.idle = fresh;
+
+        for (_, client) in expired {
+            tokio::spawn(client.quit());
+        }
+    }
+}
+
+struct Destinations {
+    by_address: HashMap<SocketAddr, Destination>,
+    /// When destinations that are no longer in use were last forgotten about
+    swept: Instant,
+}
+
+///
+/// Connections to other servers that are kept open between messages, so that
+/// the next message to the same destination can skip connecting, greeting and
+/// negotiating TLS
+///
+pub struct Pool {
+    destinations: Mutex<Destinations>,
+    connections: usize,
+    idle: Duration,
+}
+
+impl Pool {
+    pub fn new(connections: usize, idle: Duration) -> Self {
+        Self {
+            destinations: Mutex::new(Destinations {
+                by_address: HashMap::new(),
+                swept: Instant::now(),
+            }),
+            connections: connections.max(1),
+            idle,
+        }
+    }
+
+    ///
+    /// Wait until another connection can be used for `address`, returning an
+    /// idle one if there is one. The permit must be held for as long as the
+    /// connection is in use.
+    ///
+    /// # Panics
+    /// This will panic if the pool has been poisoned
+    ///
+    pub async fn checkout(
+        &self,
+        address: SocketAddr,
+    ) -> (OwnedSemaphorePermit, Option<Client<TcpStream>>) {
+        let connections = {
+            let mut destinations = self.destinations.lock().expect("Unable to read pool");
+            self.sweep(&mut destinations);
+
+            let destination =
+                destinations
+                    .by_address
+                    .entry(address)
+                    .or_insert_with(|| Destination {
+                        connections: Arc::new(Semaphore::new(self.connections)),
+                        idle: Vec::new(),
+                    });
+
+            Arc::clone(&destination.connections)
+        };
+
+        let permit = connections
+            .acquire_owned()
+            .await
+            .expect("Connection limits are never closed");
+
+        let mut destinations = self.destinations.lock().expect("Unable to read pool");
+        let client = destinations
+            .by_address
+            .get_mut(&address)
+            .and_then(|destination| {
+                destination.expire(self.idle);
+                destination.idle.pop().map(|(_, client)| client)
+            });
+
+        (permit, client)
+    }
+
+    /// Every so often, forget about the destinations that have no connections
+    /// open or waiting to be, so that the pool doesn't grow with every server
+    /// ever delivered to
+    fn sweep(&self, destinations: &mut Destinations) {
+        if destinations.swept.elapsed() < self.idle {
+            return;
+        }
+        destinations.swept = Instant::now();
+
+        destinations.by_address.retain(|_, destination| {
+            destination.expire(self.idle);
+
+            // Every permit for a connection in use holds on to the semaphore
+            !destination.idle.is_empty() || Arc::strong_count(&destination.connections) > 1
+        });
+    }
+
+    ///
+    /// Return a connection that is still usable, so that it can be used again
+    ///
+    /// # Panics
+    /// This will panic if the pool has been poisoned
+    ///
+    pub fn checkin(&self, address: SocketAddr, client: Client<TcpStream>) {
+        if let Some(destination) = self
+            .destinations
+            .lock()
+            .expect("Unable to write pool")
+            .by_address
+            .get_mut(&address)
+        {
+            destination.idle.push((Instant::now(), client));
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use std::{net::SocketAddr, time::Duration};
+
+    use super::Pool;
+
+    #[tokio::test]
+    async fn test_sweep() {
+        let pool = Pool::new(1, Duration::ZERO);
+        let first = SocketAddr::from(([192, 0, 2, 1], 25));
+        let second = SocketAddr::from(([192, 0, 2, 2], 25));
+
+        let (permit, client) = pool.checkout(first).await;
+        assert!(client.is_none());
+
+        // A destination stays for as long as a connection to it is in use
+        let (other, _) = pool.checkout(second).await;
+        assert_eq!(pool.destinations.lock().unwrap().by_address.len(), 2);
+
+        drop(permit);
+        drop(other);
+        let _ = pool.checkout(second).await;
+
+        let destinations = pool.destinations.lock().unwrap();
+        assert_eq!(
+            destinations.by_address.keys().collect::<Vec<_>>(),
+            [&second]
+        );
+    }
+}
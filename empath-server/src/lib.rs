@@ -1,24 +1,77 @@
+#![feature(write_all_vectored)]
+
+pub mod admission;
+pub mod delivery;
+pub mod metrics;
 pub mod smtp;
+pub mod socket;
+pub mod spool;
+pub mod tls;
 
 use std::{
     fs::File,
     io::{BufReader, Read},
     path::Path,
+    sync::Arc,
+    time::Duration,
 };
 
 use empath_common::{
-    ffi::module::{Error, Module},
+    ffi::module::{self, Error, Module},
     internal,
     listener::Listener,
     logging,
 };
-use futures_util::future::join_all;
 use serde::{Deserialize, Serialize};
 use thiserror::Error;
-// use trust_dns_resolver::{
-//     config::{ResolverConfig, ResolverOpts},
-//     Resolver,
-// };
+use tokio::{
+    signal::unix::{signal, SignalKind},
+    task::JoinSet,
+};
+
+/// How long the sockets of listeners that were replaced by a reload are kept
+/// open for, so that the listeners replacing them have time to take them over
+const RELEASE_DELAY: Duration = Duration::from_secs(10);
+
+/// A listener that has been started, along with the configuration it was
+/// started with, to tell whether a reload changes it
+struct Running {
+    config: Option<String>,
+    listener: Arc<dyn Listener>,
+}
+
+impl Running {
+    fn start(listener: Box<dyn Listener>, tasks: &mut JoinSet<()>) -> Self {
+        let config = toml::to_string(&listener).ok();
+        let listener = Arc::<dyn Listener>::from(listener);
+
+        let spawned = Arc::clone(&listener);
+        tasks.spawn(async move { spawned.spawn().await });
+
+        Self { config, listener }
+    }
+
+    fn is_unchanged(&self, listener: &(dyn Listener + 'static)) -> bool {
+        self.config.is_some() && self.config == toml::to_string(listener).ok()
+    }
+}
+
+/// What a reload does with each listener in the new configuration
+enum Replacement {
+    /// It's the same as one that is already running, which is kept as it is
+    Kept(Running),
+    /// It's new, or has changed, and has been opened ready to be started
+    Opened(Box<dyn Listener>),
+}
+
+/// Close the sockets no listener is holding anymore, once any listeners that
+/// are replacing others have had time to take theirs over
+fn release_later() {
+    tokio::spawn(async {
+        tokio::time::sleep(RELEASE_DELAY).await;
+        socket::release();
+    });
+}
 
 #[derive(Error, Debug)]
 pub enum ServerError {
@@ -29,10 +82,26 @@ pub enum ServerError {
     IO(#[from] std::io::Error),
 }
 
+#[allow(
+    clippy::unsafe_derive_deserialize,
+    reason = "The only unsafe code is from pinning in tokio::select!"
+)]
 #[derive(Serialize, Deserialize, Default)]
 pub struct Server {
     listeners: Vec<Box<dyn Listener>>,
     modules: Vec<Module>,
+    /// Where accepted messages are written, before they're acknowledged. Without
+    /// this, messages are acknowledged without being kept anywhere.
+    #[serde(default)]
+    spool: Option<spool::Config>,
+    /// How messages in the spool are relayed on to other servers. Without this,
+    /// they're only ever kept in the spool.
+    #[serde(default)]
+    delivery: Option<delivery::Config>,
+    /// The file this configuration was read from, which is read again when
+    /// the server is asked to reload
+    #[serde(skip)]
+    path: Option<String>,
 }
 
 unsafe impl Send for Server {}
@@ -50,12 +119,19 @@ impl Server {
         let mut config = String::new();
         reader.read_to_string(&mut config)?;
 
-        toml::from_str(&config).map_err(|_| std::io::ErrorKind::InvalidData.into())
+        let mut server: Self =
+            toml::from_str(&config).map_err(|_| std::io::ErrorKind::InvalidData)?;
+        server.path = Some(file.to_string_lossy().into_owned());
+
+        Ok(server)
     }
 
     /// Run the server, which will accept connections on the
     /// port it is asked to (or the default if not chosen).
     ///
+    /// On `SIGHUP`, the configuration file is read again, and the modules and
+    /// listeners are replaced with the ones it describes. See `reload`.
+    ///
     /// # Examples
     ///
     /// ```
@@ -67,14 +143,15 @@ impl Server {
     ///
     /// # Errors
     ///
-    /// This function will return an error if there is an issue accepting a connection,
-    /// or if there is an issue binding to the specific address and port combination.
+    /// This function will return an error if any of the listeners can't be
+    /// opened, e.g. if there is an issue binding to the specific address and
+    /// port combination, or loading its certificate.
     ///
     /// # Panics
     /// This will panic if it is unable to convert itself to its original configuration,
-    /// which should not be possible
+    /// which should not be possible, or if any of the listeners panic
     ///
-    pub async fn run(self) -> Result<(), ServerError> {
+    pub async fn run(mut self) -> Result<(), ServerError> {
         logging::init();
 
         internal!(
@@ -83,12 +160,149 @@ impl Server {
             toml::to_string(&self).expect("Invalid Server Configuration")
         );
 
-        empath_common::ffi::module::init(self.modules)?;
-
-        let iter = self.listeners.iter();
-        join_all(iter.map(|listener| listener.spawn())).await;
+        module::init(std::mem::take(&mut self.modules))?;
+
+        if let Some(ref config) = self.spool {
+            let events = self
+                .delivery
+                .as_ref()
+                .map(|delivery| delivery::start(delivery, config))
+                .transpose()?;
+
+            spool::init(config, events)?;
+        }
+
+        let mut listeners = std::mem::take(&mut self.listeners);
+        for listener in &mut listeners {
+            listener.open()?;
+        }
+
+        let mut hangup = signal(SignalKind::hangup())?;
+        let mut tasks = JoinSet::new();
+        let mut running = listeners
+            .into_iter()
+            .map(|listener| Running::start(listener, &mut tasks))
+            .collect::<Vec<_>>();
+
+        loop {
+            tokio::select! {
+                _ = hangup.recv() => self.reload(&mut running, &mut tasks),
+                finished = tasks.join_next() => match finished {
+                    None => return Ok(()),
+                    Some(Err(err)) if err.is_panic() => std::panic::resume_unwind(err.into_panic()),
+                    Some(_) => {}
+                },
+            }
+        }
+    }
 
-        Ok(())
+    ///
+    /// Read the configuration file again, and replace the modules and any
+    /// listeners that have changed.
+    ///
+    /// Listeners that are configured the same as before are left as they are.
+    /// The rest are stopped, and the sessions they had already accepted are
+    /// left to finish, while any new listener on the same address takes over
+    /// the socket, so that no connections are refused in between. Sessions that
+    /// are dispatching to the old modules finish with them.
+    ///
+    /// Every new listener is opened, and the modules loaded, before anything is
+    /// replaced. If any of that fails, everything is left running as it was.
+    ///
+    /// Changes to the spool and delivery only take effect on a restart.
+    ///
+    fn reload(&self, running: &mut Vec<Running>, tasks: &mut JoinSet<()>) {
+        let Some(ref path) = self.path else {
+            internal!(
+                level = WARN,
+                "Not reloading, as the configuration wasn't read from a file"
+            );
+            return;
+        };
+
+        internal!(level = INFO, "Reloading {path} ...");
+
+        let config = match Self::from_config(path) {
+            Ok(config) => config,
+            Err(err) => {
+                internal!(level = ERROR, "Unable to reload {path}: {err}");
+                return;
+            }
+        };
+
+        let mut previous = std::mem::take(running);
+        let mut replacements = Vec::with_capacity(config.listeners.len());
+        let mut failed = false;
+
+        for mut listener in config.listeners {
+            if let Some(idx) = previous
+                .iter()
+                .position(|running| running.is_unchanged(&*listener))
+            {
+                replacements.push(Replacement::Kept(previous.swap_remove(idx)));
+                continue;
+            }
+
+            match listener.open() {
+                Ok(()) => replacements.push(Replacement::Opened(listener)),
+                Err(err) => {
+                    internal!(level = ERROR, "Unable to open a listener: {err}");
+                    failed = true;
+                }
+            }
+        }
+
+        if !failed {
+            if let Err(err) = module::init(config.modules) {
+                internal!(level = ERROR, "Unable to reload modules: {err}");
+                failed = true;
+            }
+        }
+
+        if failed {
+            internal!(
+                level = ERROR,
+                "Unable to reload {path}, keeping the current listeners and modules"
+            );
+
+            running.extend(previous);
+            running.extend(
+                replacements
+                    .into_iter()
+                    .filter_map(|replacement| match replacement {
+                        Replacement::Kept(kept) => Some(kept),
+                        Replacement::Opened(_) => None,
+                    }),
+            );
+
+            // Any sockets the new listeners opened are no longer needed
+            release_later();
+            return;
+        }
+
+        if toml::to_string(&config.spool).ok() != toml::to_string(&self.spool).ok()
+            || toml::to_string(&config.delivery).ok() != toml::to_string(&self.delivery).ok()
+        {
+            internal!(
+                level = WARN,
+                "Changes to the spool or delivery will only take effect on a restart"
+            );
+        }
+
+        for replacement in replacements {
+            running.push(match replacement {
+                Replacement::Kept(kept) => kept,
+                Replacement::Opened(listener) => Running::start(listener, tasks),
+            });
+        }
+
+        for stale in previous {
+            stale.listener.stop();
+        }
+
+        release_later();
+
+        internal!(level = INFO, "Reloaded {path}");
     }
 
     #[must_use]
@@ -105,84 +319,3 @@ impl Server {
         self
     }
 }
-
-// async fn forward(vctx: &ValidationContext) -> std::io::Result<()> {
-//     println!("{vctx:#?}");
-
-//     let from = vctx.mail_from.as_ref().unwrap().split(':').nth(1).unwrap();
-//     let to = vctx
-//         .rcpt_to
-//         .as_ref()
-//         .unwrap()
-//         .iter()
-//         .map(|to| to.split(':').nth(1).unwrap())
-//         .collect::<Vec<_>>();
-
-//     let from = if let MailAddr::Single(SingleInfo { addr, .. }) =
-//         mailparse::addrparse(from).unwrap().first().unwrap()
-//     {
-//         addr.clone()
-//     } else {
-//         String::default()
-//     };
-//     let to = mailparse::addrparse(to.join(",").as_str()).unwrap();
-
-//     println!("{from:#?} --> {to:#?}");
-
-//     let resolver = Resolver::new(ResolverConfig::default(), ResolverOpts::default()).unwrap();
-
-//     if let MailAddr::Single(SingleInfo { addr, .. }) = to.first().unwrap() {
-//         let response = resolver.mx_lookup(addr.split('@').nth(1).unwrap()).unwrap();
-//         let response = response.iter().next().unwrap();
-
-//         println!("{}", response.exchange());
-
-//         let response = resolver.lookup_ip(response.exchange().to_string()).unwrap();
-
-//         let address = response.iter().next().expect("no addresses returned!");
-
-//         println!("{address}");
-
-//         let conn = Async::<TcpStream>::connect((address, 25)).await?;
-
-//         println!("{conn:#?}");
-
-//         let mut buffer = [0; 4096];
-
-//         conn.read_with(|mut conn| conn.read(&mut buffer)).await?;
-//         println!("RESPONSE: {}", std::str::from_utf8(&buffer).unwrap());
-
-//         let mut buffer = [0; 4096];
-//         conn.write_with(|mut conn| write!(conn, "EHLO test-local\r\n"))
-//             .await?;
-//         conn.read_with(|mut conn| conn.read(&mut buffer)).await?;
-//         println!("RESPONSE: {}", std::str::from_utf8(&buffer).unwrap());
-
-//         let mut buffer = [0; 4096];
-//         conn.write_with(|mut conn| write!(conn, "MAIL FROM:<{from}>\r\n"))
-//             .await?;
-//         conn.read_with(|mut conn| conn.read(&mut buffer)).await?;
-//         println!("RESPONSE: {}", std::str::from_utf8(&buffer).unwrap());
-
-//         let mut buffer = [0; 4096];
-//         conn.write_with(|mut conn| write!(conn, "RCPT TO:<{to}>\r\n"))
-//             .await?;
-//         conn.read_with(|mut conn| conn.read(&mut buffer)).await?;
-//         println!("RESPONSE: {}", std::str::from_utf8(&buffer).unwrap());
-
-//         let mut buffer = [0; 4096];
-//         conn.write_with(|mut conn| write!(conn, "DATA\r\n")).await?;
-//         conn.read_with(|mut conn| conn.read(&mut buffer)).await?;
-//         println!("RESPONSE: {}", std::str::from_utf8(&buffer).unwrap());
-
-//         let mut buffer = [0; 4096];
-//         conn.write_with(|mut conn| write!(conn, "{}\r\n", vctx.data.as_ref().unwrap()))
-//             .await?;
-//         conn.read_with(|mut conn| conn.read(&mut buffer)).await?;
-//         println!("RESPONSE: {}", std::str::from_utf8(&buffer).unwrap());
-
-//         conn.write_with(|mut conn| write!(conn, "QUIT\r\n")).await?;
-//     }
-
-//     Ok(())
-// }
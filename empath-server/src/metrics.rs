@@ -0,0 +1,387 @@
+use std::{
+    fmt::Write,
+    net::{IpAddr, Ipv6Addr, SocketAddr},
+    sync::{Arc, Mutex, Weak},
+};
+
+use empath_common::{
+    ffi::module,
+    internal,
+    listener::{Listener, Shutdown},
+    logging,
+    metrics::{self, Counter, Histogram},
+};
+use empath_smtp_proto::phase::Phase;
+use memchr::memmem;
+use serde::{Deserialize, Serialize};
+use tokio::io::{AsyncRead, AsyncReadExt, AsyncWrite, AsyncWriteExt};
+
+use crate::socket::{self, Socket};
+
+/// The most of a scrape request that will be read, before responding anyway
+const MAX_REQUEST_LENGTH: usize = 8192;
+
+/// Every phase a session can be in, in the order of their discriminants
+const PHASES: [Phase; 15] = [
+    Phase::Connect,
+    Phase::Ehlo,
+    Phase::Helo,
+    Phase::StartTLS,
+    Phase::MailFrom,
+    Phase::RcptTo,
+    Phase::Data,
+    Phase::Reading,
+    Phase::DataReceived,
+    Phase::Chunk,
+    Phase::ChunkReceived,
+    Phase::Quit,
+    Phase::InvalidCommandSequence,
+    Phase::Invalid,
+    Phase::Close,
+];
+
+/// The metrics of every SMTP listener that is running. Each is dropped along
+/// with the last of its listener's sessions.
+static SESSIONS: Mutex<Vec<Weak<SessionMetrics>>> = Mutex::new(Vec::new());
+
+///
+/// The metrics shared by every session on an SMTP listener
+///
+#[derive(Default)]
+pub struct SessionMetrics {
+    /// The address of the listener, escaped to be used as a label
+    listener: String,
+    /// How many sessions are currently connected
+    pub connections: Counter,
+    /// How many connections have been turned away, due to the listener's limits
+    pub refused: Counter,
+    /// How many bytes have been received from clients
+    pub received: Counter,
+    pub accepted: Counter,
+    pub rejected: Counter,
+    /// How many messages were refused for being larger than the listener allows,
+    /// whether up front from their declared size or once received
+    pub oversized: Counter,
+    /// How many commands were rejected by a module, before any message was sent
+    pub screened: Counter,
+    pub handshake: Histogram,
+    /// How long sessions spend in each phase, indexed by `Phase`
+    phases: [Histogram; PHASES.len()],
+}
+
+impl SessionMetrics {
+    ///
+    /// The metrics for a listener, to be included in every scrape. A listener
+    /// that is restarted on the same address, e.g. on reload, carries on with
+    /// the metrics it already had.
+    ///
+    /// # Panics
+    /// This will panic if the list of listeners has been poisoned
+    ///
+    pub fn register(listener: &str) -> Arc<Self> {
+        let listener = metrics::escape(listener);
+        let mut sessions = SESSIONS.lock().expect("Unable to register session metrics");
+
+        // Listeners that have since been removed are forgotten about
+        sessions.retain(|session| session.strong_count() > 0);
+
+        if let Some(metrics) = sessions
+            .iter()
+            .filter_map(Weak::upgrade)
+            .find(|session| session.listener == listener)
+        {
+            return metrics;
+        }
+
+        let metrics = Arc::new(Self {
+            listener,
+            ..Default::default()
+        });
+        sessions.push(Arc::downgrade(&metrics));
+
+        metrics
+    }
+
+    pub fn phase(&self, phase: Phase) -> &Histogram {
+        &self.phases[phase as usize]
+    }
+}
+
+fn write_counter(
+    out: &mut String,
+    sessions: &[Arc<SessionMetrics>],
+    name: &str,
+    kind: &str,
+    counter: impl Fn(&SessionMetrics) -> &Counter,
+) {
+    let _ = writeln!(out, "# TYPE {name} {kind}");
+    for session in sessions {
+        let value = counter(session).value();
+        let _ = writeln!(out, "{name}{{listener=\"{}\"}} {value}", session.listener);
+    }
+}
+
+/// Write out the metrics of every SMTP listener, in the Prometheus text format
+fn write_sessions(out: &mut String) {
+    let sessions = SESSIONS
+        .lock()
+        .expect("Unable to read session metrics")
+        .iter()
+        .filter_map(Weak::upgrade)
+        .collect::<Vec<_>>();
+
+    write_counter(out, &sessions, "empath_smtp_connections", "gauge", |m| {
+        &m.connections
+    });
+    write_counter(
+        out,
+        &sessions,
+        "empath_smtp_refused_connections_total",
+        "counter",
+        |m| &m.refused,
+    );
+    write_counter(
+        out,
+        &sessions,
+        "empath_smtp_received_bytes_total",
+        "counter",
+        |m| &m.received,
+    );
+    write_counter(
+        out,
+        &sessions,
+        "empath_smtp_messages_accepted_total",
+        "counter",
+        |m| &m.accepted,
+    );
+    write_counter(
+        out,
+        &sessions,
+        "empath_smtp_messages_rejected_total",
+        "counter",
+        |m| &m.rejected,
+    );
+    write_counter(
+        out,
+        &sessions,
+        "empath_smtp_messages_oversized_total",
+        "counter",
+        |m| &m.oversized,
+    );
+    write_counter(
+        out,
+        &sessions,
+        "empath_smtp_commands_rejected_total",
+        "counter",
+        |m| &m.screened,
+    );
+
+    let _ = writeln!(out, "# TYPE empath_smtp_tls_handshake_seconds histogram");
+    for session in &sessions {
+        let labels = format!("listener=\"{}\"", session.listener);
+        session
+            .handshake
+            .write(out, "empath_smtp_tls_handshake_seconds", &labels);
+    }
+
+    let _ = writeln!(out, "# TYPE empath_smtp_phase_seconds histogram");
+    for session in &sessions {
+        for phase in PHASES {
+            let labels = format!("listener=\"{}\",phase=\"{phase:?}\"", session.listener);
+            session
+                .phase(phase)
+                .write(out, "empath_smtp_phase_seconds", &labels);
+        }
+    }
+}
+
+///
+/// Serves the metrics collected by the server over HTTP, in the Prometheus
+/// text format. Every request gets the same response, whatever path it asks for.
+///
+#[derive(Serialize, Deserialize, Clone)]
+pub struct Metrics {
+    address: IpAddr,
+    port: u16,
+    /// The socket opened by `open`, until the listener is spawned
+    #[serde(skip)]
+    socket: Arc<Mutex<Option<Socket>>>,
+    #[serde(skip)]
+    shutdown: Shutdown,
+}
+
+impl Default for Metrics {
+    fn default() -> Self {
+        Self {
+            address: IpAddr::V6(Ipv6Addr::UNSPECIFIED),
+            port: 9090,
+            socket: Arc::default(),
+            shutdown: Shutdown::default(),
+        }
+    }
+}
+
+#[typetag::serde]
+#[async_trait::async_trait]
+impl Listener for Metrics {
+    fn open(&mut self) -> std::io::Result<()> {
+        let socket = socket::listen(SocketAddr::new(self.address, self.port), 0, false)?;
+        *self.socket.lock().expect("Unable to open metrics listener") = Some(socket);
+
+        Ok(())
+    }
+
+    async fn spawn(&self) {
+        internal!(
+            level = INFO,
+            "Starting Metrics Listener on: {}:{}",
+            self.address,
+            self.port
+        );
+
+        let opened = self
+            .socket
+            .lock()
+            .expect("Unable to start metrics listener")
+            .take()
+            .ok_or_else(|| std::io::Error::from(std::io::ErrorKind::NotConnected))
+            .and_then(|socket| Ok((socket::accept_on(&socket)?, socket)));
+        let (listener, _socket) = match opened {
+            Ok(opened) => opened,
+            Err(err) => {
+                internal!(
+                    level = ERROR,
+                    "Unable to start Metrics Listener on {}:{}: {err}",
+                    self.address,
+                    self.port
+                );
+                return;
+            }
+        };
+        let stopped = self.shutdown.wait();
+        tokio::pin!(stopped);
+
+        loop {
+            tokio::select! {
+                () = &mut stopped => break,
+                accepted = listener.accept() => match accepted {
+                    Ok((stream, _)) => {
+                        tokio::spawn(serve(stream));
+                    }
+                    Err(err) => internal!(level = ERROR, "Unable to accept scrape: {err}"),
+                }
+            }
+        }
+
+        internal!(
+            level = INFO,
+            "Stopped Metrics Listener on: {}:{}",
+            self.address,
+            self.port
+        );
+    }
+
+    fn stop(&self) {
+        self.shutdown.trigger();
+    }
+}
+
+/// Render every metric, in the Prometheus text format
+pub fn render() -> String {
+    let mut out = String::new();
+    write_sessions(&mut out);
+    module::write_metrics(&mut out);
+
+    let _ = writeln!(out, "# TYPE empath_log_dropped_total counter");
+    let _ = writeln!(out, "empath_log_dropped_total {}", logging::dropped());
+
+    out
+}
+
+async fn serve<Stream: AsyncRead + AsyncWrite + Unpin>(mut stream: Stream) -> std::io::Result<()> {
+    let mut request = Vec::with_capacity(1024);
+
+    while memmem::find(&request, b"\r\n\r\n").is_none() && request.len() < MAX_REQUEST_LENGTH {
+        if stream.read_buf(&mut request).await? == 0 {
+            break;
+        }
+    }
+
+    let body = render();
+    let response = format!(
+        "HTTP/1.1 200 OK\r\n\
+         Content-Type: text/plain; version=0.0.4\r\n\
+         Content-Length: {}\r\n\
+         Connection: close\r\n\r\n\
+         {body}",
+        body.len()
+    );
+
+    stream.write_all(response.as_bytes()).await?;
+    stream.shutdown().await
+}
+
+#[cfg(test)]
+mod test {
+    use std::sync::Arc;
+
+    use tokio::io::{AsyncReadExt, AsyncWriteExt};
+
+    use empath_smtp_proto::phase::Phase;
+
+    use super::{serve, write_sessions, SessionMetrics, PHASES};
+
+    #[test]
+    fn test_phases() {
+        for (idx, phase) in PHASES.into_iter().enumerate() {
+            assert_eq!(phase as usize, idx);
+        }
+    }
+
+    #[test]
+    fn test_register() {
+        let metrics = SessionMetrics::register("[::1]:2525");
+        metrics.accepted.increment();
+
+        // The same listener again, e.g. after a reload, keeps its metrics
+        let again = SessionMetrics::register("[::1]:2525");
+        assert!(Arc::ptr_eq(&metrics, &again));
+        assert_eq!(again.accepted.value(), 1);
+
+        // Once the listener is gone, so are its metrics
+        drop((metrics, again));
+        let mut out = String::new();
+        write_sessions(&mut out);
+        assert!(!out.contains("[::1]:2525"));
+        assert_eq!(SessionMetrics::register("[::1]:2525").accepted.value(), 0);
+    }
+
+    #[tokio::test]
+    async fn test_scrape() {
+        let metrics = SessionMetrics::register("test");
+        metrics.accepted.increment();
+        metrics
+            .phase(Phase::Connect)
+            .record(std::time::Duration::from_millis(1), false);
+
+        let (mut client, server) = tokio::io::duplex(1 << 16);
+        let session = tokio::spawn(serve(server));
+
+        client
+            .write_all(b"GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n")
+            .await
+            .unwrap();
+
+        let mut output = String::new();
+        client.read_to_string(&mut output).await.unwrap();
+        session.await.unwrap().unwrap();
+
+        let (headers, body) = output.split_once("\r\n\r\n").unwrap();
+        assert!(headers.starts_with("HTTP/1.1 200 OK\r\n"));
+        assert!(headers.contains(&format!("Content-Length: {}", body.len())));
+        assert!(body.contains("# TYPE empath_module_latency_seconds histogram\n"));
+        assert!(body.contains("empath_smtp_messages_accepted_total{listener=\"test\"} 1\n"));
+        assert!(body
+            .contains("empath_smtp_phase_seconds_count{listener=\"test\",phase=\"Connect\"} 1\n"));
+    }
+}
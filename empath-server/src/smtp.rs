@@ -1,31 +1,88 @@
 use std::{
-    fmt::Display,
-    fs::File,
-    io::BufReader,
+    io::Write,
     net::{IpAddr, Ipv6Addr, SocketAddr},
-    sync::{atomic::AtomicU64, Arc},
+    path::PathBuf,
+    sync::{atomic::AtomicU64, Arc, Mutex},
+    time::Instant,
 };
 
+use memchr::memchr;
+
 use empath_common::{
-    context,
+    context::{self, Spill},
     ffi::module::{self, dispatch, Error},
     incoming, internal,
-    listener::Listener,
-    outgoing,
+    listener::{Listener, Shutdown},
+    logging, outgoing,
+    tracing::{self, field, Instrument, Span},
+};
+use empath_smtp_proto::{
+    command::Command, data::Decoder, extensions::Extension, phase::Phase, status::Status,
 };
-use empath_smtp_proto::{command::Command, extensions::Extension, phase::Phase, status::Status};
 use mailparse::MailParseError;
 use serde::{Deserialize, Serialize};
 use tokio::{
     io::{AsyncRead, AsyncReadExt, AsyncWrite, AsyncWriteExt},
-    net::TcpListener,
+    net::{TcpListener, TcpStream},
+    task::JoinSet,
 };
-use tokio_rustls::{
-    rustls::{server::AllowAnyAnonymousOrAuthenticatedClient, RootCertStore, ServerConfig},
-    server::TlsStream,
-    TlsAcceptor,
+use tokio_rustls::server::TlsStream;
+
+use crate::{
+    admission::{Admission, Backoff, Limits},
+    metrics::SessionMetrics,
+    socket::{self, default_acceptors, pin_to_core, Socket},
+    spool,
+    tls::TlsContext,
 };
 
+/// How much to try to read from the client at a time
+const READ_SIZE: usize = 4096;
+
+/// The longest a command line can be, including the `<CRLF>`, as per section
+/// 4.5.3.1.4 of [RFC-5321](https://www.ietf.org/rfc/rfc5321.txt). This is
+/// generous, to allow for extension parameters.
+const MAX_LINE_LENGTH: usize = 4096;
+
+/// The most that will be reserved up front for a message body, however large
+/// the client says it is going to be
+const MAX_PREALLOCATION: usize = 64 << 20;
+
+/// The most of a `BDAT` chunk that is read from the client at once
+const CHUNK_READ_SIZE: usize = 256 << 10;
+
+/// Once a body is being spilled, it's written out in pieces of at least this
+/// size, rather than a write per read from the client
+const SPILL_WRITE_SIZE: usize = 1 << 20;
+
+const fn default_spill_threshold() -> usize {
+    8 << 20
+}
+
+const EXCEEDED_STORAGE: &str = "Message size exceeds fixed maximum message size";
+const LOCAL_ERROR: &str = "Requested action aborted: local error in processing";
+
+/// A span timing part of a traced session, inside the session's own span. For
+/// sessions that aren't being traced, nothing is created at all.
+macro_rules! stage {
+    ($smtp:expr, $name:literal) => {
+        if $smtp.traced {
+            tracing::info_span!(target: logging::TARGET, $name)
+        } else {
+            Span::none()
+        }
+    };
+}
+
+/// Append a single response line to an output buffer
+macro_rules! reply {
+    ($out:expr, $($arg:tt)*) => {{
+        // Writing into a Vec can't fail
+        let _ = write!($out, $($arg)*);
+        $out.extend_from_slice(b"\r\n");
+    }};
+}
+
 #[repr(C)]
 #[derive(PartialEq, Eq)]
 pub enum Event {
@@ -38,6 +95,21 @@ pub struct Context {
     pub state: Phase,
     pub message: Vec<u8>,
     pub sent: bool,
+    /// Set once a module has rejected the message currently being received
+    pub rejected: bool,
+    /// How much of the message body has been received so far
+    pub size: usize,
+    /// Why the message was rejected, if it wasn't by a module
+    #[serde(skip)]
+    pub failure: Option<(Status, &'static str)>,
+    /// How much of the current `BDAT` chunk is still to be received
+    pub chunk: usize,
+    /// Whether the current `BDAT` chunk is the last one of the message
+    pub last: bool,
+    /// How many recipients there were before the current command
+    pub recipients: usize,
+    #[serde(skip)]
+    pub decoder: Decoder,
 }
 
 impl Default for Context {
@@ -46,6 +118,13 @@ impl Default for Context {
             state: Phase::Connect,
             message: Vec::default(),
             sent: false,
+            rejected: false,
+            size: 0,
+            failure: None,
+            chunk: 0,
+            last: false,
+            recipients: 0,
+            decoder: Decoder::default(),
         }
     }
 }
@@ -55,8 +134,6 @@ pub struct SMTPError {
     pub message: String,
 }
 
-pub type Response = (Option<Vec<String>>, Event);
-
 impl From<MailParseError> for SMTPError {
     fn from(err: MailParseError) -> Self {
         Self {
@@ -75,18 +152,73 @@ impl From<Error> for SMTPError {
     }
 }
 
-#[derive(Serialize, Deserialize, Clone, Default)]
-pub struct TlsContext {
-    certificate: String,
-    key: String,
+///
+/// The responses that are the same for every session on a listener, so are
+/// only generated once, when the listener is started
+///
+#[derive(Default)]
+struct Responses {
+    banner: Vec<u8>,
+    /// Sent instead of the banner when there are too many sessions
+    refused: Vec<u8>,
+    /// The extension lines of the EHLO response, before TLS has been negotiated
+    extensions: Vec<u8>,
+    /// The extension lines of the EHLO response, once TLS has been negotiated
+    tls_extensions: Vec<u8>,
 }
 
-impl TlsContext {
-    fn is_enabled(&self) -> bool {
-        !self.certificate.is_empty() && !self.key.is_empty()
+impl Responses {
+    fn new(banner: &str, extensions: &[Extension]) -> Self {
+        let mut responses = Self::default();
+        let banner = if banner.is_empty() {
+            "localhost"
+        } else {
+            banner
+        };
+
+        reply!(responses.banner, "{} {}", Status::ServiceReady, banner);
+        reply!(
+            responses.refused,
+            "{} {} Too many connections, try again later",
+            Status::Unavailable,
+            banner
+        );
+
+        Self::write_extensions(&mut responses.extensions, extensions.iter());
+        // STARTTLS must not be advertised once TLS has been negotiated (RFC-3207)
+        Self::write_extensions(
+            &mut responses.tls_extensions,
+            extensions
+                .iter()
+                .filter(|extension| !matches!(extension, Extension::STARTTLS)),
+        );
+
+        responses
+    }
+
+    fn write_extensions<'a>(out: &mut Vec<u8>, extensions: impl Iterator<Item = &'a Extension>) {
+        let mut extensions = extensions.peekable();
+
+        while let Some(extension) = extensions.next() {
+            reply!(
+                out,
+                "{}{}{}",
+                Status::Ok,
+                if extensions.peek().is_none() {
+                    ' '
+                } else {
+                    '-'
+                },
+                extension
+            );
+        }
     }
 }
 
+#[allow(
+    clippy::unsafe_derive_deserialize,
+    reason = "The only unsafe code is from pinning in tokio::select!"
+)]
 #[derive(Serialize, Deserialize, Clone)]
 pub struct Smtp {
     address: IpAddr,
@@ -99,11 +231,62 @@ pub struct Smtp {
     banner: String,
     #[serde(default)]
     tls_context: TlsContext,
+    #[serde(default)]
+    limits: Limits,
+    /// How many sockets to accept connections on. With more than one, they're
+    /// each bound with `SO_REUSEPORT`, and accept independently.
+    #[serde(default = "default_acceptors")]
+    acceptors: usize,
+    /// Run each acceptor, and the sessions it accepts, on its own thread pinned
+    /// to a core, rather than on the shared runtime
+    #[serde(default)]
+    thread_per_core: bool,
+    /// The largest message that will be accepted, in bytes, or 0 for no limit
+    #[serde(default)]
+    max_message_size: usize,
+    /// Bodies larger than this are kept in a file in `spill_directory` rather
+    /// than in memory, or 0 to always keep them in memory
+    #[serde(default = "default_spill_threshold")]
+    spill_threshold: usize,
+    #[serde(default = "std::env::temp_dir")]
+    spill_directory: PathBuf,
+    #[serde(skip)]
+    responses: Arc<Responses>,
+    /// Whether TLS has been negotiated for this session
+    #[serde(skip)]
+    tls: bool,
+    #[serde(skip)]
+    metrics: Arc<SessionMetrics>,
+    /// A socket for each acceptor, opened by `open`, until the listener is
+    /// spawned. They're taken out then, so that sessions still finishing after
+    /// the listener has stopped don't keep them open.
+    #[serde(skip)]
+    sockets: Arc<Mutex<Vec<Socket>>>,
+    #[serde(skip)]
+    shutdown: Shutdown,
+    /// Whether this session was sampled to be traced
+    #[serde(skip)]
+    traced: bool,
 }
 
 #[typetag::serde]
 #[async_trait::async_trait]
 impl Listener for Smtp {
+    fn open(&mut self) -> std::io::Result<()> {
+        let prepared = self.clone().prepare()?;
+
+        let address = SocketAddr::new(self.address, self.port);
+        let acceptors = self.acceptors.max(1);
+        let sockets = (0..acceptors)
+            .map(|acceptor| socket::listen(address, acceptor, acceptors > 1))
+            .collect::<std::io::Result<Vec<_>>>()?;
+
+        *self = prepared;
+        self.sockets = Arc::new(Mutex::new(sockets));
+
+        Ok(())
+    }
+
     async fn spawn(&self) {
         internal!(
             level = INFO,
@@ -113,23 +296,200 @@ impl Listener for Smtp {
         );
 
         let smtplistener = self.clone();
-        let listener = TcpListener::bind(SocketAddr::new(smtplistener.address, smtplistener.port))
-            .await
-            .expect("Unable to start smtp session");
+        let address = SocketAddr::new(smtplistener.address, smtplistener.port);
+        let sockets = std::mem::take(&mut *self.sockets.lock().expect("Unable to read sockets"));
+        if sockets.is_empty() {
+            internal!(
+                level = ERROR,
+                "Unable to start SMTP Listener on {address}, as it hasn't been opened"
+            );
+        }
+
         let queue = Arc::new(AtomicU64::default());
 
+        if smtplistener.tls_context.is_enabled() {
+            let watch = smtplistener.tls_context.clone().watch();
+            let shutdown = smtplistener.shutdown.clone();
+            tokio::spawn(async move {
+                tokio::select! {
+                    () = watch => {}
+                    () = shutdown.wait() => {}
+                }
+            });
+        }
+
+        // The limits apply to the listener as a whole, however many acceptors it has
+        let admission = Admission::new(smtplistener.limits);
+
+        if smtplistener.thread_per_core {
+            let threads = sockets
+                .into_iter()
+                .enumerate()
+                .map(|(core, socket)| {
+                    let smtplistener = smtplistener.clone();
+                    let queue = Arc::clone(&queue);
+                    let admission = admission.clone();
+
+                    std::thread::Builder::new()
+                        .name(format!("empath-smtp-{core}"))
+                        .spawn(move || {
+                            pin_to_core(core);
+
+                            tokio::runtime::Builder::new_current_thread()
+                                .enable_all()
+                                .build()
+                                .expect("Unable to start smtp runtime")
+                                .block_on(async move {
+                                    let listener = socket::accept_on(&socket)?;
+                                    smtplistener
+                                        .accept(listener, socket, queue, admission)
+                                        .await;
+                                    Ok::<_, std::io::Error>(())
+                                })
+                        })
+                        .expect("Unable to start smtp thread")
+                })
+                .collect::<Vec<_>>();
+
+            // An acceptor that couldn't start, or panicked, is reported rather
+            // than leaving the listener with fewer acceptors than it should have
+            let mut joining = JoinSet::new();
+            for (core, thread) in threads.into_iter().enumerate() {
+                joining.spawn_blocking(move || (core, thread.join()));
+            }
+
+            while let Some(joined) = joining.join_next().await {
+                let (core, joined) = joined.expect("Unable to wait for smtp thread");
+
+                match joined {
+                    Ok(Ok(())) => {}
+                    Ok(Err(err)) => internal!(
+                        level = ERROR,
+                        "Unable to start SMTP acceptor {core} on {address}: {err}"
+                    ),
+                    Err(panic) => std::panic::resume_unwind(panic),
+                }
+            }
+        } else {
+            let mut tasks = JoinSet::new();
+
+            for (acceptor, socket) in sockets.into_iter().enumerate() {
+                let listener = match socket::accept_on(&socket) {
+                    Ok(listener) => listener,
+                    Err(err) => {
+                        internal!(
+                            level = ERROR,
+                            "Unable to start SMTP acceptor {acceptor} on {address}: {err}"
+                        );
+                        continue;
+                    }
+                };
+
+                tasks.spawn(smtplistener.clone().accept(
+                    listener,
+                    socket,
+                    Arc::clone(&queue),
+                    admission.clone(),
+                ));
+            }
+
+            while tasks.join_next().await.is_some() {}
+        }
+
+        internal!(
+            level = INFO,
+            "Stopped SMTP Listener on: {}:{}",
+            self.address,
+            self.port
+        );
+    }
+
+    fn stop(&self) {
+        self.shutdown.trigger();
+    }
+}
+
+impl Smtp {
+    ///
+    /// Accept connections on a single socket, spawning a session for each
+    /// onto the current runtime. Once the listener is stopped, the socket is
+    /// let go of, and this waits for the sessions it accepted to finish.
+    ///
+    async fn accept(
+        self,
+        listener: TcpListener,
+        socket: Socket,
+        queue: Arc<AtomicU64>,
+        admission: Admission,
+    ) {
+        let mut backoff = Backoff::default();
+        let mut sessions = JoinSet::new();
+        let stopped = self.shutdown.wait();
+        tokio::pin!(stopped);
+
         loop {
-            let (stream, address) = listener
-                .accept()
-                .await
-                .expect("Unable to accept connection");
+            // Forget about any sessions that have finished
+            while sessions.try_join_next().is_some() {}
 
-            tokio::spawn(
-                smtplistener
-                    .clone()
-                    .connect(Arc::clone(&queue), stream, address),
-            );
+            let accepted = tokio::select! {
+                () = &mut stopped => break,
+                accepted = listener.accept() => accepted,
+            };
+
+            let (stream, address) = match accepted {
+                Ok(accepted) => {
+                    backoff.succeed();
+                    accepted
+                }
+                Err(err) => {
+                    // Most likely out of file descriptors, which will hopefully
+                    // resolve itself as sessions finish
+                    let delay = backoff.fail();
+                    internal!(
+                        level = ERROR,
+                        "Unable to accept connection, retrying in {delay:?}: {err}"
+                    );
+                    tokio::time::sleep(delay).await;
+                    continue;
+                }
+            };
+
+            let Some(permit) = admission.admit(address.ip()) else {
+                self.metrics.refused.increment();
+                tokio::spawn(refuse(stream, Arc::clone(&self.responses)));
+                continue;
+            };
+
+            let session = self.clone();
+            let queue = Arc::clone(&queue);
+            sessions.spawn(async move {
+                let _permit = permit;
+                session.connect(queue, stream, address).await
+            });
         }
+
+        // Anything still waiting to be accepted is left for whoever takes the
+        // socket over next
+        drop((listener, socket));
+
+        while sessions.join_next().await.is_some() {}
+    }
+}
+
+/// Turn away a connection when there are already too many sessions
+async fn refuse(mut stream: TcpStream, responses: Arc<Responses>) {
+    outgoing!("{}", String::from_utf8_lossy(&responses.refused).trim_end());
+
+    let _ = stream.write_all(&responses.refused).await;
+    let _ = stream.shutdown().await;
+}
+
+/// Counts a session as disconnected once it's dropped, however it ends
+struct Connected(Arc<SessionMetrics>);
+
+impl Drop for Connected {
+    fn drop(&mut self) {
+        self.0.connections.decrement();
     }
 }
 
@@ -139,56 +499,22 @@ pub enum Connection<Stream: AsyncRead + AsyncWrite + Unpin + Send + Sync> {
 }
 
 impl<Stream: AsyncRead + AsyncWrite + Unpin + Send + Sync> Connection<Stream> {
-    async fn send<S: Display + Send + Sync>(&mut self, response: &S) -> std::io::Result<usize> {
+    /// Send everything that has been buffered up to the client, in a single
+    /// write
+    async fn send(&mut self, buffer: &[u8]) -> std::io::Result<()> {
         match self {
-            Self::Plain { stream } => stream.write(format!("{response}\r\n").as_bytes()).await,
-            Self::Tls { stream } => stream.write(format!("{response}\r\n").as_bytes()).await,
+            Self::Plain { stream } => stream.write_all(buffer).await,
+            Self::Tls { stream } => stream.write_all(buffer).await,
         }
     }
 
     async fn upgrade(self, tls_context: &TlsContext) -> std::io::Result<Self> {
-        if !tls_context.is_enabled() {
+        let Some(acceptor) = tls_context.acceptor() else {
             return Err(std::io::Error::new(
                 std::io::ErrorKind::Other,
                 "No tls certificate or key provided",
             ));
-        }
-
-        let certfile = File::open(&tls_context.certificate).expect("cannot open certificate file");
-        let mut reader = BufReader::new(certfile);
-        let certs = rustls_pemfile::certs(&mut reader)
-            .unwrap()
-            .iter()
-            .map(|v| tokio_rustls::rustls::Certificate(v.clone()))
-            .collect::<Vec<_>>();
-
-        let keyfile = File::open(&tls_context.key).expect("cannot open private key file");
-        let mut reader = BufReader::new(keyfile);
-
-        let key =
-            match rustls_pemfile::read_one(&mut reader).expect("cannot parse private key file") {
-                Some(
-                    rustls_pemfile::Item::RSAKey(key)
-                    | rustls_pemfile::Item::PKCS8Key(key)
-                    | rustls_pemfile::Item::ECKey(key),
-                ) => tokio_rustls::rustls::PrivateKey(key),
-                _ => panic!("Unable to determine key file"),
-            };
-
-        let config = ServerConfig::builder()
-            .with_safe_default_cipher_suites()
-            .with_safe_default_kx_groups()
-            .with_safe_default_protocol_versions()
-            .expect("Invalid TLS Configuration")
-            .with_client_cert_verifier(Arc::new(AllowAnyAnonymousOrAuthenticatedClient::new({
-                let mut cert_store = RootCertStore::empty();
-                cert_store.add(certs.first().unwrap()).unwrap();
-                cert_store
-            })))
-            .with_single_cert_with_ocsp_and_sct(certs, key, Vec::new(), Vec::new())
-            .expect("Invalid Cert Configuration");
-
-        let acceptor = TlsAcceptor::from(Arc::new(config));
+        };
 
         Ok(Self::Tls {
             stream: match self {
@@ -198,10 +524,21 @@ impl<Stream: AsyncRead + AsyncWrite + Unpin + Send + Sync> Connection<Stream> {
         })
     }
 
-    async fn receive(&mut self, buf: &mut [u8]) -> std::io::Result<usize> {
+    /// Read exactly enough from the client to fill `buf`
+    async fn receive_exact(&mut self, buf: &mut [u8]) -> std::io::Result<usize> {
+        match self {
+            Self::Plain { stream } => stream.read_exact(buf).await,
+            Self::Tls { stream } => stream.read_exact(buf).await,
+        }
+    }
+
+    /// Read whatever is available from the client onto the end of `buf`
+    async fn receive(&mut self, buf: &mut Vec<u8>) -> std::io::Result<usize> {
+        buf.reserve(READ_SIZE);
+
         match self {
-            Self::Plain { stream } => stream.read(buf).await,
-            Self::Tls { stream } => stream.read(buf).await,
+            Self::Plain { stream } => stream.read_buf(buf).await,
+            Self::Tls { stream } => stream.read_buf(buf).await,
         }
     }
 }
@@ -215,55 +552,171 @@ impl Default for Smtp {
             extensions: Vec::default(),
             banner: String::default(),
             tls_context: TlsContext::default(),
+            limits: Limits::default(),
+            acceptors: default_acceptors(),
+            thread_per_core: false,
+            max_message_size: 0,
+            spill_threshold: default_spill_threshold(),
+            spill_directory: std::env::temp_dir(),
+            responses: Arc::default(),
+            tls: false,
+            metrics: Arc::default(),
+            sockets: Arc::default(),
+            shutdown: Shutdown::default(),
+            traced: false,
         }
     }
 }
 
 impl Smtp {
-    async fn connect<Stream: AsyncRead + AsyncWrite + Unpin + Send + Sync>(
+    /// Determine the extensions this listener supports, and generate the
+    /// responses that don't change between sessions
+    ///
+    /// # Errors
+    /// If TLS is configured, but the certificate or key can't be loaded
+    ///
+    pub(crate) fn prepare(mut self) -> std::io::Result<Self> {
+        self.extensions = vec![
+            Extension::PIPELINING,
+            Extension::SIZE(self.max_message_size),
+            Extension::CHUNKING,
+            Extension::EIGHTBITMIME,
+        ];
+        if self.tls_context.is_enabled() {
+            self.tls_context.load().map_err(|err| {
+                std::io::Error::new(err.kind(), format!("Unable to load TLS certificate: {err}"))
+            })?;
+            self.extensions.push(Extension::STARTTLS);
+        }
+
+        self.responses = Arc::new(Responses::new(&self.banner, &self.extensions));
+        self.metrics =
+            SessionMetrics::register(&SocketAddr::new(self.address, self.port).to_string());
+
+        Ok(self)
+    }
+
+    ///
+    /// Handle a session with a client, until either side closes it. Every
+    /// session has a span of its own, which its log records are tagged with. A
+    /// sample of them are also traced, timing each part of the session inside
+    /// that span, and only those are profiled.
+    ///
+    pub(crate) async fn connect<Stream: AsyncRead + AsyncWrite + Unpin + Send + Sync>(
+        mut self,
+        queue: Arc<AtomicU64>,
+        stream: Stream,
+        peer: SocketAddr,
+    ) -> std::io::Result<()> {
+        let (session, traced) = logging::session();
+        self.traced = traced;
+
+        // The profile only takes spans with its own target
+        let span = if traced {
+            tracing::info_span!(
+                target: logging::TARGET,
+                "session",
+                session,
+                %peer,
+                phase = ?Phase::Connect,
+            )
+        } else {
+            tracing::info_span!("session", session, %peer, phase = ?Phase::Connect)
+        };
+
+        self.session(queue, stream, peer).instrument(span).await
+    }
+
+    async fn session<Stream: AsyncRead + AsyncWrite + Unpin + Send + Sync>(
         mut self,
         queue: Arc<AtomicU64>,
         stream: Stream,
         peer: SocketAddr,
     ) -> std::io::Result<()> {
         let mut connection = Connection::Plain { stream };
-        let mut vctx = context::Context::default();
+        let mut vctx = context::Pooled::default();
+        vctx.peer = peer.ip().to_string();
 
-        if self.tls_context.is_enabled() {
-            self.extensions.push(Extension::STARTTLS);
-        }
+        // Everything received from the client that hasn't been handled yet, and
+        // the responses that haven't been sent yet. With pipelining, there may
+        // be several commands in a single read, and their responses are batched
+        // together until there's nothing left to handle. Both are reused for
+        // the whole session.
+        let mut input = Vec::with_capacity(READ_SIZE);
+        let mut output = Vec::with_capacity(READ_SIZE);
 
         internal!("Connected to {peer}");
 
+        self.metrics.connections.increment();
+        let _connected = Connected(Arc::clone(&self.metrics));
+        // When the session entered the phase it's currently in
+        let mut entered = Instant::now();
+
         loop {
-            let (response, ev) = self.response(&queue, &mut vctx);
+            let written = output.len();
+            let ev = self.response(&queue, &mut vctx, &mut output).await;
             self.context.sent = true;
 
-            for response in response.unwrap_or_default() {
-                outgoing!("{response}");
+            // Responses are only decoded when they're going to be logged
+            if tracing::enabled!(target: "empath", tracing::Level::TRACE) {
+                for response in String::from_utf8_lossy(&output[written..]).lines() {
+                    outgoing!("{response}");
+                }
+            }
 
-                connection.send(&response).await.map_err(|err| {
-                    internal!("Error: {err}");
-                    std::io::Error::new(std::io::ErrorKind::ConnectionAborted, err.to_string())
-                })?;
+            let upgrade = self.can_upgrade() && self.context.state == Phase::StartTLS;
+
+            let flush = Event::ConnectionClose == ev || upgrade || !self.has_input(&input);
+
+            if flush && !output.is_empty() {
+                let span = stage!(self, "write");
+                connection
+                    .send(&output)
+                    .instrument(span)
+                    .await
+                    .map_err(|err| {
+                        internal!("Error: {err}");
+                        std::io::Error::new(std::io::ErrorKind::ConnectionAborted, err.to_string())
+                    })?;
+                output.clear();
             }
 
             if Event::ConnectionClose == ev {
                 return Ok(());
             }
 
-            if self.tls_context.is_enabled() && self.context.state == Phase::StartTLS {
-                connection = connection.upgrade(&self.tls_context).await?;
+            if upgrade {
+                // Anything pipelined after STARTTLS was sent in plain text, so
+                // must be discarded (see section 4.2 of RFC-3207)
+                input.clear();
+
+                let start = Instant::now();
+                let span = stage!(self, "tls");
+                let upgraded = connection.upgrade(&self.tls_context).instrument(span).await;
+                self.metrics
+                    .handshake
+                    .record(start.elapsed(), upgraded.is_err());
+
+                connection = upgraded?;
+                self.tls = true;
                 self.context = Context {
                     sent: true,
                     ..Default::default()
                 };
             } else {
+                let state = self.context.state;
                 let connection_closed = matches!(
-                    self.receive(&mut connection, &mut vctx).await,
+                    self.receive(&mut connection, &mut input, &mut vctx).await,
                     Ok(true) | Err(_)
                 );
 
+                // Something new has been received, which needs a response
+                if !self.context.sent {
+                    let now = Instant::now();
+                    self.metrics.phase(state).record(now - entered, false);
+                    entered = now;
+                }
+
                 if connection_closed {
                     internal!("Connection closed");
                     return Ok(());
@@ -273,153 +726,854 @@ impl Smtp {
     }
 
     /// Generate the response(s) that should be sent back to the client
-    /// depending on the servers state
-    fn response(&mut self, queue: &Arc<AtomicU64>, vctx: &mut context::Context) -> Response {
+    /// depending on the servers state, appending them to `out`
+    async fn response(
+        &mut self,
+        queue: &Arc<AtomicU64>,
+        vctx: &mut context::Context,
+        out: &mut Vec<u8>,
+    ) -> Event {
         if self.context.sent {
-            return (None, Event::ConnectionKeepAlive);
+            return Event::ConnectionKeepAlive;
         }
 
         if Phase::DataReceived == self.context.state {
-            dispatch(module::Event::ValidateData, vctx);
+            self.validate(vctx).await;
+        } else if let Some(ev) = self.screen(vctx, out).await {
+            return ev;
         }
 
-        let status = match self.context.state {
-            Phase::Connect => (
-                Some(vec![format!(
-                    "{} {}",
-                    Status::ServiceReady,
-                    if self.banner.is_empty() {
-                        "localhost"
-                    } else {
-                        &self.banner
-                    }
-                )]),
-                Event::ConnectionKeepAlive,
-            ),
-            Phase::Ehlo | Phase::Helo => {
-                let mut response = vec![format!(
+        match self.context.state {
+            Phase::Connect => out.extend_from_slice(&self.responses.banner),
+            Phase::Ehlo => {
+                let extensions = if self.tls {
+                    &self.responses.tls_extensions
+                } else {
+                    &self.responses.extensions
+                };
+
+                reply!(
+                    out,
                     "{}{}Hello {}",
                     Status::Ok,
-                    if self.extensions.is_empty() { ' ' } else { '-' },
-                    std::str::from_utf8(&self.context.message).unwrap()
-                )];
-
-                for (idx, extension) in self.extensions.iter().enumerate() {
-                    response.push(format!(
-                        "{}{}{}",
-                        Status::Ok,
-                        if idx == self.extensions.len() - 1 {
-                            ' '
-                        } else {
-                            '-'
-                        },
-                        extension
-                    ));
-                }
-                (Some(response), Event::ConnectionKeepAlive)
+                    if extensions.is_empty() { ' ' } else { '-' },
+                    vctx.id()
+                );
+                out.extend_from_slice(extensions);
+            }
+            Phase::Helo => reply!(out, "{} Hello {}", Status::Ok, vctx.id()),
+            Phase::StartTLS if self.can_upgrade() => {
+                reply!(out, "{} Ready to begin TLS", Status::ServiceReady);
+            }
+            Phase::MailFrom if self.exceeds_maximum(vctx.declared_size.unwrap_or_default()) => {
+                // Refused before any of the message is sent (RFC-1870)
+                self.metrics.oversized.increment();
+                reply!(out, "{} {}", Status::ExceededStorage, EXCEEDED_STORAGE);
+                vctx.reset();
+                self.context.state = Phase::Ehlo;
+            }
+            Phase::MailFrom | Phase::RcptTo | Phase::ChunkReceived => {
+                reply!(out, "{} Ok", Status::Ok);
             }
-            Phase::StartTLS if self.tls_context.is_enabled() => (
-                Some(vec![format!("{} Ready to begin TLS", Status::ServiceReady)]),
-                Event::ConnectionKeepAlive,
-            ),
-            Phase::MailFrom | Phase::RcptTo => (
-                Some(vec![format!("{} Ok", Status::Ok)]),
-                Event::ConnectionKeepAlive,
-            ),
             Phase::Data => {
                 self.context.state = Phase::Reading;
-                (
-                    Some(vec![format!(
-                        "{} End data with <CR><LF>.<CR><LF>",
-                        Status::StartMailInput
-                    )]),
-                    Event::ConnectionKeepAlive,
-                )
+                self.begin_body(vctx).await;
+                reply!(
+                    out,
+                    "{} End data with <CR><LF>.<CR><LF>",
+                    Status::StartMailInput
+                );
             }
-            Phase::DataReceived => {
-                let queue = queue.fetch_add(1, std::sync::atomic::Ordering::Relaxed);
-                let default = format!("Ok: queued as {queue}");
-                let response = vctx.data_response.as_ref().unwrap_or(&default);
-
-                (
-                    Some(vec![format!("{} {}", Status::Ok, response)]),
-                    Event::ConnectionKeepAlive,
-                )
+            Phase::DataReceived if self.context.rejected => self.refuse(vctx, out),
+            Phase::DataReceived => match Self::enqueue(queue, vctx).await {
+                Ok(id) => {
+                    self.metrics.accepted.increment();
+
+                    if let Some(ref response) = vctx.data_response {
+                        reply!(out, "{} {}", Status::Ok, response);
+                    } else {
+                        reply!(out, "{} Ok: queued as {}", Status::Ok, id);
+                    }
+                }
+                Err(err) => {
+                    internal!(level = ERROR, "Unable to spool message: {err}");
+                    reply!(out, "{} {}", Status::ActionUnavailable, LOCAL_ERROR);
+                }
+            },
+            Phase::Quit => {
+                reply!(out, "{} Bye", Status::GoodBye);
+                return Event::ConnectionClose;
             }
-            Phase::Quit => (
-                Some(vec![format!("{} Bye", Status::GoodBye)]),
-                Event::ConnectionClose,
-            ),
-            Phase::Reading | Phase::Close => (None, Event::ConnectionKeepAlive),
-            Phase::InvalidCommandSequence => (
-                Some(vec![format!(
+            Phase::Reading | Phase::Chunk | Phase::Close => {}
+            Phase::InvalidCommandSequence => {
+                reply!(
+                    out,
                     "{} {}",
                     Status::InvalidCommandSequence,
                     self.context.state
-                )]),
-                Event::ConnectionClose,
-            ),
-            _ => (
-                Some(vec![format!(
+                );
+                return Event::ConnectionClose;
+            }
+            _ => {
+                reply!(
+                    out,
                     "{} Invalid command '{}'",
                     Status::InvalidCommandSequence,
                     std::str::from_utf8(&self.context.message).unwrap()
-                )]),
-                Event::ConnectionClose,
-            ),
+                );
+                return Event::ConnectionClose;
+            }
+        }
+
+        Event::ConnectionKeepAlive
+    }
+
+    /// Tell the client why the message it just sent wasn't accepted
+    fn refuse(&self, vctx: &context::Context, out: &mut Vec<u8>) {
+        if let Some((status, message)) = self.context.failure {
+            if status == Status::ExceededStorage {
+                self.metrics.oversized.increment();
+            } else {
+                self.metrics.rejected.increment();
+            }
+
+            reply!(out, "{} {}", status, message);
+        } else {
+            self.metrics.rejected.increment();
+            reply!(
+                out,
+                "{} {}",
+                Status::Error,
+                vctx.data_response.as_deref().unwrap_or("Rejected")
+            );
+        }
+    }
+
+    /// Keep hold of an accepted message, returning the id it was queued as. The
+    /// message is only acknowledged once this returns, so with a spool it must
+    /// be durable by then.
+    async fn enqueue(queue: &AtomicU64, vctx: &mut context::Context) -> std::io::Result<String> {
+        match spool::get() {
+            Some(spool) => spool.write(vctx).await.map(|id| format!("{id:016X}")),
+            None => Ok(queue
+                .fetch_add(1, std::sync::atomic::Ordering::Relaxed)
+                .to_string()),
+        }
+    }
+
+    /// Whether a message of `size` bytes is larger than will be accepted
+    const fn exceeds_maximum(&self, size: usize) -> bool {
+        self.max_message_size != 0 && size > self.max_message_size
+    }
+
+    /// Whether a body of `size` bytes should be kept in a file
+    const fn should_spill(&self, size: usize) -> bool {
+        self.spill_threshold != 0 && size >= self.spill_threshold
+    }
+
+    ///
+    /// Prepare to receive a message body, making room for it using the size
+    /// the client declared, if it did. A body that will be too large to keep in
+    /// memory is spilled from the start.
+    ///
+    async fn begin_body(&self, vctx: &mut context::Context) {
+        // The body is only ever held in the validation context, so that it never
+        // needs to be copied to be handed to the modules, or the spool.
+        vctx.begin_data(spool::get().is_some() || module::requires_message());
+
+        let (Some(size), true) = (vctx.declared_size, vctx.data.is_some()) else {
+            return;
+        };
+
+        if self.should_spill(size) {
+            // If this fails, it's tried again once the body reaches the threshold
+            let directory = self.spill_directory.clone();
+            vctx.spilled = tokio::task::spawn_blocking(move || Spill::create(&directory))
+                .await
+                .unwrap_or_else(|err| Err(std::io::Error::other(err)))
+                .map_err(|err| internal!(level = ERROR, "Unable to spill message: {err}"))
+                .ok();
+        }
+
+        if let (None, Some(data)) = (&vctx.spilled, vctx.data.as_mut()) {
+            data.reserve(size.min(MAX_PREALLOCATION));
+        }
+    }
+
+    ///
+    /// Move the buffered body out to a file, once it is too large to keep in
+    /// memory. From then on, the buffer only holds what hasn't been written
+    /// out yet. At the `end` of the message, the file is mapped so that it can
+    /// be read like the buffer would be.
+    ///
+    /// The file is only ever touched on the blocking pool, so that a slow disk
+    /// doesn't hold up every other session on the same worker.
+    ///
+    async fn spill(
+        &self,
+        vctx: &mut context::Context,
+        data: &mut Vec<u8>,
+        end: bool,
+    ) -> std::io::Result<()> {
+        let flush = end || data.len() >= SPILL_WRITE_SIZE;
+        let create = vctx.spilled.is_none();
+
+        if (create && !self.should_spill(data.len())) || (!create && !flush) {
+            return Ok(());
+        }
+
+        let spilled = vctx.spilled.take();
+        let directory = self.spill_directory.clone();
+        let mut pending = std::mem::take(data);
+
+        let (spill, pending) = tokio::task::spawn_blocking(move || {
+            let mut spill = match spilled {
+                Some(spill) => spill,
+                None => Spill::create(&directory)?,
+            };
+
+            if flush {
+                spill.write(&pending)?;
+                pending.clear();
+            }
+
+            if end {
+                spill.map()?;
+            }
+
+            Ok::<_, std::io::Error>((spill, pending))
+        })
+        .await
+        .map_err(std::io::Error::other)??;
+
+        vctx.spilled = Some(spill);
+        // The buffer is kept, to be reused for the rest of the body
+        *data = pending;
+
+        Ok(())
+    }
+
+    /// Whether this session can still be upgraded to TLS
+    fn can_upgrade(&self) -> bool {
+        self.tls_context.is_enabled() && !self.tls
+    }
+
+    ///
+    /// Let the modules reject the command that was just received, before it is
+    /// acted on, so that clients can be turned away before they have sent any
+    /// of a message. If one does, its rejection is appended to `out`, and the
+    /// session goes back to how it was before the command.
+    ///
+    async fn screen(&mut self, vctx: &mut context::Context, out: &mut Vec<u8>) -> Option<Event> {
+        let (event, default) = match self.context.state {
+            // There's no service for the client at all (section 3.1 of RFC-5321)
+            Phase::Connect => (module::Event::Connect, Status::TransactionFailed),
+            Phase::Ehlo | Phase::Helo => (module::Event::Helo, Status::Error),
+            Phase::MailFrom if !self.exceeds_maximum(vctx.declared_size.unwrap_or_default()) => {
+                (module::Event::MailFrom, Status::Error)
+            }
+            Phase::RcptTo => (module::Event::RcptTo, Status::Error),
+            _ => return None,
         };
 
-        status
+        vctx.response = None;
+        let response = module::validate(event, vctx)
+            .instrument(stage!(self, "dispatch"))
+            .await;
+        if response == 0 {
+            return None;
+        }
+
+        self.metrics.screened.increment();
+
+        // Modules can choose the reply, so long as it's a negative one
+        let status = Status::from_code(response)
+            .filter(|status| status.is_negative())
+            .unwrap_or(default);
+        reply!(
+            out,
+            "{} {}",
+            status,
+            vctx.response.as_deref().unwrap_or("Rejected")
+        );
+
+        match self.context.state {
+            Phase::Ehlo | Phase::Helo => {
+                vctx.id.clear();
+                self.context.state = Phase::Connect;
+            }
+            Phase::MailFrom => {
+                vctx.reset();
+                self.context.state = Phase::Ehlo;
+            }
+            Phase::RcptTo => {
+                vctx.rcpt_to.truncate(self.context.recipients);
+                self.context.state = if vctx.rcpt_to.is_empty() {
+                    Phase::MailFrom
+                } else {
+                    Phase::RcptTo
+                };
+            }
+            _ => {}
+        }
+
+        // A client that was rejected outright, or that a module wants gone,
+        // isn't given the chance to try anything else
+        if event == module::Event::Connect || status == Status::Unavailable {
+            Some(Event::ConnectionClose)
+        } else {
+            Some(Event::ConnectionKeepAlive)
+        }
+    }
+
+    /// Run the received message past the modules, noting if any of them
+    /// rejected it
+    async fn validate(&mut self, vctx: &mut context::Context) {
+        if !self.context.rejected {
+            let response = module::validate(module::Event::ValidateData, vctx)
+                .instrument(stage!(self, "dispatch"))
+                .await;
+            self.context.rejected = response != 0;
+
+            // A module can ask for the message to be sent again later
+            if let Some(status) = Status::from_code(response).filter(|status| status.is_transient())
+            {
+                self.context.failure = Some((status, LOCAL_ERROR));
+            }
+        }
+
+        // Streaming modules are always told the data has ended, even if they
+        // had already rejected it, so that they can clean up
+        self.context.rejected |= !dispatch(module::Event::DataEnd, vctx)
+            .instrument(stage!(self, "dispatch"))
+            .await;
+    }
+
+    /// Whether enough has been received from the client to handle the next
+    /// command (or some part of the message body), without reading any more
+    fn has_input(&self, input: &[u8]) -> bool {
+        if self.context.state == Phase::Reading {
+            !input.is_empty()
+        } else if self.context.state == Phase::Chunk {
+            // The rest of a chunk is read directly into the body
+            !input.is_empty() || self.context.chunk == 0
+        } else {
+            // A line that is too long is handled as is, and will be rejected
+            memchr(b'\n', input).is_some() || input.len() >= MAX_LINE_LENGTH
+        }
+    }
+
+    /// Handle some part of the message body, returning how much of it was
+    /// consumed
+    async fn receive_data(&mut self, received: &[u8], vctx: &mut context::Context) -> usize {
+        // The body is taken out while the chunk is dispatched, so that the
+        // modules can be handed the chunk directly from it. If nothing needs
+        // the whole message, the chunk is decoded into the session instead.
+        let mut body = vctx.data.take();
+        if body.is_none() {
+            self.context.message.clear();
+        }
+
+        let buffer = body.as_mut().unwrap_or(&mut self.context.message);
+        let start = buffer.len();
+        let consumed = self.context.decoder.decode(received, buffer);
+
+        self.received(vctx, body, start, consumed.is_some()).await;
+
+        consumed.map_or(received.len(), |consumed| {
+            self.finish_body(Phase::DataReceived);
+            consumed
+        })
+    }
+
+    ///
+    /// Receive some of a chunk sent with `BDAT`. Anything that was received
+    /// along with the command is used first, and the rest is then read directly
+    /// into the body. Unlike with `DATA`, there's no terminator to look for, and
+    /// nothing to unstuff.
+    ///
+    async fn receive_chunk<Stream: AsyncRead + AsyncWrite + Unpin + Send + Sync>(
+        &mut self,
+        connection: &mut Connection<Stream>,
+        input: &mut Vec<u8>,
+        vctx: &mut context::Context,
+    ) -> std::io::Result<()> {
+        let mut body = vctx.data.take();
+        if body.is_none() {
+            self.context.message.clear();
+        }
+
+        let buffer = body.as_mut().unwrap_or(&mut self.context.message);
+        let start = buffer.len();
+
+        if input.is_empty() {
+            let wanted = self.context.chunk.min(CHUNK_READ_SIZE);
+            buffer.resize(start + wanted, 0);
+            connection
+                .receive_exact(&mut buffer[start..])
+                .instrument(stage!(self, "read"))
+                .await?;
+            self.metrics.received.add(wanted as u64);
+        } else {
+            let buffered = self.context.chunk.min(input.len());
+            buffer.extend_from_slice(&input[..buffered]);
+            input.drain(..buffered);
+        }
+
+        self.context.chunk -= buffer.len() - start;
+        let end = self.context.chunk == 0;
+        let last = self.context.last;
+
+        self.received(vctx, body, start, end && last).await;
+
+        if end {
+            self.finish_body(if last {
+                Phase::DataReceived
+            } else {
+                Phase::ChunkReceived
+            });
+        }
+
+        Ok(())
+    }
+
+    ///
+    /// Handle the part of the body from `start` that has just been received
+    /// into `body`, or into the session if the body isn't being kept. It's
+    /// passed along to the modules, and kept until the `end` of the message
+    /// unless it has been rejected.
+    ///
+    async fn received(
+        &mut self,
+        vctx: &mut context::Context,
+        mut body: Option<Vec<u8>>,
+        start: usize,
+        end: bool,
+    ) {
+        let buffer = body.as_deref().unwrap_or(&self.context.message);
+        self.context.size += buffer.len() - start;
+
+        // The rest of the message still has to be read, but none of it is kept
+        if !self.context.rejected
+            && self.max_message_size != 0
+            && self.context.size > self.max_message_size
+        {
+            self.context.rejected = true;
+            self.context.failure = Some((Status::ExceededStorage, EXCEEDED_STORAGE));
+        }
+
+        // Once the message has been rejected, there's no need to keep passing
+        // it along to any modules, or to keep it around
+        if !self.context.rejected && !module::dispatch_chunk(vctx, &buffer[start..]) {
+            self.context.rejected = true;
+        }
+
+        if !self.context.rejected {
+            if let Some(ref mut data) = body {
+                if let Err(err) = self.spill(vctx, data, end).await {
+                    internal!(level = ERROR, "Unable to spill message: {err}");
+                    self.context.rejected = true;
+                    self.context.failure = Some((Status::ActionUnavailable, LOCAL_ERROR));
+                }
+            }
+        }
+
+        if self.context.rejected {
+            body = None;
+            vctx.spilled = None;
+        }
+
+        vctx.data = body;
+    }
+
+    /// Move on to `state` once the message, or a chunk of it, has been received
+    fn finish_body(&mut self, state: Phase) {
+        self.context = Context {
+            state,
+            message: std::mem::take(&mut self.context.message),
+            rejected: self.context.rejected,
+            failure: self.context.failure,
+            size: self.context.size,
+            ..Default::default()
+        };
     }
 
+    /// Handle the next command, or part of the message body, from the client,
+    /// only reading from the connection if there isn't enough to do so already.
+    ///
+    /// Returns `true` if the connection has been closed.
     async fn receive<Stream: AsyncRead + AsyncWrite + Unpin + Send + Sync>(
         &mut self,
         connection: &mut Connection<Stream>,
+        input: &mut Vec<u8>,
         vctx: &mut context::Context,
     ) -> std::io::Result<bool> {
-        let mut received_data = [0; 4096];
+        if self.context.state == Phase::Chunk {
+            return self
+                .receive_chunk(connection, input, vctx)
+                .await
+                .map(|()| false);
+        }
 
-        match connection.receive(&mut received_data).await {
-            // Consider any errors received here to be fatal
-            Err(err) => {
-                internal!("Error: {err}");
-                Err(err)
+        if !self.has_input(input) {
+            match connection
+                .receive(input)
+                .instrument(stage!(self, "read"))
+                .await
+            {
+                // Consider any errors received here to be fatal
+                Err(err) => {
+                    internal!("Error: {err}");
+                    return Err(err);
+                }
+                Ok(0) => {
+                    // Reading 0 bytes means the other side has closed the
+                    // connection or is done writing, then so are we.
+                    return Ok(true);
+                }
+                Ok(received) => {
+                    self.metrics.received.add(received as u64);
+
+                    if !self.has_input(input) {
+                        return Ok(false);
+                    }
+                }
             }
-            Ok(0) => {
-                // Reading 0 bytes means the other side has closed the
-                // connection or is done writing, then so are we.
-                Ok(false)
+        }
+
+        if self.context.state == Phase::Reading {
+            let consumed = self.receive_data(input, vctx).await;
+            input.drain(..consumed);
+        } else {
+            let parse = stage!(self, "parse").entered();
+
+            let end = memchr(b'\n', input).map_or(input.len(), |end| end + 1);
+            let line = input[..end].strip_suffix(b"\n").unwrap_or(&input[..end]);
+            let line = line.strip_suffix(b"\r").unwrap_or(line);
+
+            let command = Command::from(line);
+            input.drain(..end);
+
+            // Only an invalid command needs to be held on to, to report it back.
+            // The buffer is reused for the whole session.
+            let mut message = std::mem::take(&mut self.context.message);
+            message.clear();
+            if let Command::Invalid(ref command) = command {
+                message.extend_from_slice(command.as_bytes());
             }
-            Ok(bytes_read) => {
-                let received = &received_data[..bytes_read];
 
-                if self.context.state == Phase::Reading {
-                    self.context.message.extend(received);
+            incoming!("{command}");
 
-                    if self.context.message.ends_with(b"\r\n.\r\n") {
-                        self.context = Context {
-                            state: Phase::DataReceived,
-                            message: self.context.message.clone(),
-                            sent: false,
-                        };
+            let chunk = if let Command::Bdat { size, last } = command {
+                Some((size, last))
+            } else {
+                None
+            };
 
-                        vctx.data = Some(self.context.message.clone());
-                    }
-                } else {
-                    let command = Command::from(received);
-                    let message = command.inner().into_bytes();
+            let previous = std::mem::take(&mut self.context);
+            let recipients = vctx.rcpt_to.len();
+            self.context = Context {
+                state: previous.state.transition(command, vctx),
+                message,
+                recipients,
+                ..Default::default()
+            };
 
-                    incoming!("{command}");
+            // Once parsed, the current span is the session's own again
+            drop(parse);
+            Span::current().record("phase", field::debug(self.context.state));
 
-                    self.context = Context {
-                        state: self.context.state.transition(command, vctx),
-                        message,
-                        sent: false,
-                    };
+            if let (Phase::Chunk, Some((size, last))) = (self.context.state, chunk) {
+                if previous.state == Phase::RcptTo {
+                    self.begin_body(vctx).await;
+                } else {
+                    // Every chunk is part of the same message
+                    self.context.size = previous.size;
+                    self.context.rejected = previous.rejected;
+                    self.context.failure = previous.failure;
                 }
 
-                Ok(false)
+                self.context.chunk = size;
+                self.context.last = last;
             }
         }
+
+        Ok(false)
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use std::{
+        net::{IpAddr, Ipv4Addr, Ipv6Addr, SocketAddr},
+        sync::{atomic::AtomicU64, Arc},
+    };
+
+    use empath_common::{context, listener::Listener};
+    use empath_smtp_proto::phase::Phase;
+    use tokio::io::{AsyncReadExt, AsyncWriteExt};
+
+    use super::{Connection, Smtp};
+
+    async fn session(input: &[u8]) -> String {
+        session_with(Smtp::default(), input).await
+    }
+
+    async fn session_with(smtp: Smtp, input: &[u8]) -> String {
+        session_prepared(smtp.prepare().unwrap(), input).await
+    }
+
+    async fn session_prepared(smtp: Smtp, input: &[u8]) -> String {
+        let (mut client, server) = tokio::io::duplex(4096);
+        let peer = SocketAddr::new(IpAddr::V6(Ipv6Addr::LOCALHOST), 0);
+
+        let session = tokio::spawn(smtp.connect(Arc::new(AtomicU64::default()), server, peer));
+
+        client.write_all(input).await.unwrap();
+
+        let mut output = String::new();
+        client.read_to_string(&mut output).await.unwrap();
+        session.await.unwrap().unwrap();
+
+        output
+    }
+
+    #[tokio::test]
+    async fn test_pipelining() {
+        let output = session(
+            b"EHLO test\r\nMAIL FROM:<test@test.com>\r\nRCPT TO:<test@gmail.com>\r\nDATA\r\n\
+              Hello\r\n..World\r\n.\r\nQUIT\r\n",
+        )
+        .await;
+
+        assert_eq!(
+            output,
+            "220 localhost\r\n\
+             250-Hello test\r\n\
+             250-PIPELINING\r\n\
+             250-SIZE\r\n\
+             250-CHUNKING\r\n\
+             250 8BITMIME\r\n\
+             250 Ok\r\n\
+             250 Ok\r\n\
+             354 End data with <CR><LF>.<CR><LF>\r\n\
+             250 Ok: queued as 0\r\n\
+             221 Bye\r\n"
+        );
+    }
+
+    #[tokio::test]
+    async fn test_transactions() {
+        let output = session(
+            b"EHLO test\r\nMAIL FROM:<test@test.com>\r\nRCPT TO:<test@gmail.com>\r\nDATA\r\n\
+              One\r\n.\r\nMAIL FROM:<test@test.com>\r\nRCPT TO:<test@gmail.com>\r\nDATA\r\n\
+              Two\r\n.\r\nQUIT\r\n",
+        )
+        .await;
+
+        assert_eq!(
+            output,
+            "220 localhost\r\n\
+             250-Hello test\r\n\
+             250-PIPELINING\r\n\
+             250-SIZE\r\n\
+             250-CHUNKING\r\n\
+             250 8BITMIME\r\n\
+             250 Ok\r\n\
+             250 Ok\r\n\
+             354 End data with <CR><LF>.<CR><LF>\r\n\
+             250 Ok: queued as 0\r\n\
+             250 Ok\r\n\
+             250 Ok\r\n\
+             354 End data with <CR><LF>.<CR><LF>\r\n\
+             250 Ok: queued as 1\r\n\
+             221 Bye\r\n"
+        );
+    }
+
+    #[tokio::test]
+    async fn test_max_message_size() {
+        let smtp = Smtp {
+            max_message_size: 8,
+            ..Default::default()
+        }
+        .prepare()
+        .unwrap();
+        let metrics = Arc::clone(&smtp.metrics);
+
+        let output = session_prepared(
+            smtp,
+            b"EHLO test\r\nMAIL FROM:<test@test.com> SIZE=9\r\nMAIL FROM:<test@test.com>\r\n\
+              RCPT TO:<test@gmail.com>\r\nDATA\r\nToo large\r\n.\r\nQUIT\r\n",
+        )
+        .await;
+
+        assert_eq!(
+            output,
+            "220 localhost\r\n\
+             250-Hello test\r\n\
+             250-PIPELINING\r\n\
+             250-SIZE 8\r\n\
+             250-CHUNKING\r\n\
+             250 8BITMIME\r\n\
+             552 Message size exceeds fixed maximum message size\r\n\
+             250 Ok\r\n\
+             250 Ok\r\n\
+             354 End data with <CR><LF>.<CR><LF>\r\n\
+             552 Message size exceeds fixed maximum message size\r\n\
+             221 Bye\r\n"
+        );
+
+        // Neither refusal was the modules' doing
+        assert_eq!(metrics.oversized.value(), 2);
+        assert_eq!(metrics.rejected.value(), 0);
+    }
+
+    #[tokio::test]
+    async fn test_chunking() {
+        let mut input = b"EHLO test\r\nMAIL FROM:<test@test.com> BODY=8BITMIME\r\n\
+              RCPT TO:<test@gmail.com>\r\nBDAT 10\r\nFirst\r\n.\r\nBDAT 5000\r\n"
+            .to_vec();
+        input.extend_from_slice(&[b'.'; 5000]);
+        input.extend_from_slice(b"BDAT 0 LAST\r\nQUIT\r\n");
+
+        let output = session(&input).await;
+
+        assert_eq!(
+            output,
+            "220 localhost\r\n\
+             250-Hello test\r\n\
+             250-PIPELINING\r\n\
+             250-SIZE\r\n\
+             250-CHUNKING\r\n\
+             250 8BITMIME\r\n\
+             250 Ok\r\n\
+             250 Ok\r\n\
+             250 Ok\r\n\
+             250 Ok\r\n\
+             250 Ok: queued as 0\r\n\
+             221 Bye\r\n"
+        );
+    }
+
+    #[tokio::test]
+    async fn test_chunked_body() {
+        // Nothing is unstuffed, and a line with only a dot doesn't end anything
+        let chunks: [&[u8]; 3] = [b"First\r\n", b"\r\n.\r\n..Dots\r\n", b""];
+        let mut input = Vec::new();
+        for (idx, chunk) in chunks.iter().enumerate() {
+            let last = if idx == chunks.len() - 1 { " LAST" } else { "" };
+            input.extend_from_slice(format!("BDAT {}{last}\r\n", chunk.len()).as_bytes());
+            input.extend_from_slice(chunk);
+        }
+
+        // Both held in memory, and spilled to a file part way through
+        for spill_threshold in [0, 8] {
+            let mut smtp = Smtp {
+                spill_threshold,
+                ..Default::default()
+            }
+            .prepare()
+            .unwrap();
+            let (mut client, server) = tokio::io::duplex(4096);
+            let mut connection = Connection::Plain { stream: server };
+
+            // As if a module needed the whole body, and the message had been
+            // started with an empty chunk
+            let mut vctx = context::Context {
+                data: Some(Vec::new()),
+                ..Default::default()
+            };
+            smtp.context.state = Phase::ChunkReceived;
+
+            client.write_all(&input).await.unwrap();
+            let mut received = Vec::new();
+            while smtp.context.state != Phase::DataReceived {
+                assert!(!smtp
+                    .receive(&mut connection, &mut received, &mut vctx)
+                    .await
+                    .unwrap());
+            }
+
+            assert_eq!(vctx.body(), Some(&b"First\r\n\r\n.\r\n..Dots\r\n"[..]));
+            assert_eq!(vctx.spilled.is_some(), spill_threshold != 0);
+            assert_eq!(smtp.context.size, 20);
+        }
+    }
+
+    #[tokio::test]
+    async fn test_spill() {
+        let smtp = Smtp {
+            spill_threshold: 8,
+            ..Default::default()
+        };
+        let mut vctx = context::Context::default();
+        let mut data = b"Small".to_vec();
+
+        smtp.spill(&mut vctx, &mut data, false).await.unwrap();
+        assert!(vctx.spilled.is_none());
+
+        // Once spilled, the buffer only holds what hasn't been written yet
+        data.extend_from_slice(b" and then larger");
+        smtp.spill(&mut vctx, &mut data, false).await.unwrap();
+        assert!(vctx.spilled.is_some());
+        assert_eq!(data.len(), 21);
+
+        smtp.spill(&mut vctx, &mut data, true).await.unwrap();
+        assert!(data.is_empty());
+        assert_eq!(vctx.body(), Some(&b"Small and then larger"[..]));
+    }
+
+    #[tokio::test]
+    async fn test_open() {
+        let taken = std::net::TcpListener::bind((Ipv4Addr::LOCALHOST, 0)).unwrap();
+        let local = |port| Smtp {
+            address: IpAddr::V4(Ipv4Addr::LOCALHOST),
+            port,
+            acceptors: 2,
+            ..Default::default()
+        };
+
+        let mut smtp = local(0);
+        smtp.open().unwrap();
+        assert_eq!(smtp.sockets.lock().unwrap().len(), 2);
+
+        // A listener that can't start says so, rather than taking the server down
+        assert!(local(taken.local_addr().unwrap().port()).open().is_err());
+
+        let mut smtp = Smtp {
+            tls_context: toml::from_str("certificate = \"/nonexistent\"\nkey = \"/nonexistent\"")
+                .unwrap(),
+            ..local(0)
+        };
+        assert!(smtp.open().is_err());
+        assert!(smtp.sockets.lock().unwrap().is_empty());
+    }
+
+    #[tokio::test]
+    async fn test_split_commands() {
+        let (mut client, server) = tokio::io::duplex(4096);
+        let peer = SocketAddr::new(IpAddr::V6(Ipv6Addr::LOCALHOST), 0);
+
+        let session = tokio::spawn(Smtp::default().prepare().unwrap().connect(
+            Arc::new(AtomicU64::default()),
+            server,
+            peer,
+        ));
+
+        let mut banner = [0; 15];
+        client.read_exact(&mut banner).await.unwrap();
+        assert_eq!(&banner, b"220 localhost\r\n");
+
+        // A command is only handled once the whole line has been received
+        client.write_all(b"QU").await.unwrap();
+        tokio::task::yield_now().await;
+        client.write_all(b"IT\r\n").await.unwrap();
+
+        let mut output = String::new();
+        client.read_to_string(&mut output).await.unwrap();
+        session.await.unwrap().unwrap();
+
+        assert_eq!(output, "221 Bye\r\n");
     }
 }
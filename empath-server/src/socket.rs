@@ -0,0 +1,198 @@
+use std::{
+    collections::HashMap,
+    net::SocketAddr,
+    sync::{Arc, LazyLock, Mutex},
+};
+
+use empath_common::internal;
+use tokio::net::{TcpListener, TcpSocket};
+
+/// How many connections can be waiting to be accepted, on each socket
+const BACKLOG: u32 = 1024;
+
+/// A listening socket, which stays open for as long as any listener holds it
+pub type Socket = Arc<std::net::TcpListener>;
+
+/// Every listening socket that has been opened by `listen`, by address and
+/// acceptor. These are kept open across a reload, so that the listeners that
+/// replace the old ones take over their sockets, rather than closing them and
+/// binding again, which would drop any connections waiting to be accepted.
+static SOCKETS: LazyLock<Mutex<HashMap<(SocketAddr, usize), Socket>>> =
+    LazyLock::new(Mutex::default);
+
+pub fn default_acceptors() -> usize {
+    std::thread::available_parallelism().map_or(1, std::num::NonZeroUsize::get)
+}
+
+///
+/// Bind a listening socket to `address`. With `reuse_port`, several sockets can
+/// be bound to the same address, and the kernel spreads new connections
+/// between them.
+///
+/// This must be called from within the runtime that will accept on it.
+///
+/// # Errors
+/// If the socket can't be created, or bound to the address
+///
+pub fn bind(address: SocketAddr, reuse_port: bool) -> std::io::Result<TcpListener> {
+    let socket = if address.is_ipv4() {
+        TcpSocket::new_v4()?
+    } else {
+        TcpSocket::new_v6()?
+    };
+
+    socket.set_reuseaddr(true)?;
+    if reuse_port {
+        socket.set_reuseport(true)?;
+    }
+
+    socket.bind(address)?;
+    socket.listen(BACKLOG)
+}
+
+///
+/// Open the socket for one of the acceptors of a listener, or take over the
+/// one that is already open for it. The returned socket must be held for as
+/// long as the listener is accepting on it.
+///
+/// This must be called from within a runtime, though not necessarily the one
+/// that will accept on it (see `accept_on`).
+///
+/// # Errors
+/// If the socket can't be created, or bound to the address
+///
+/// # Panics
+/// This will panic if the open sockets have been poisoned
+///
+pub fn listen(address: SocketAddr, acceptor: usize, reuse_port: bool) -> std::io::Result<Socket> {
+    // There's no way to tell which socket was meant, if any port will do
+    if address.port() == 0 {
+        return Ok(Arc::new(bind(address, reuse_port)?.into_std()?));
+    }
+
+    let mut sockets = SOCKETS.lock().expect("Unable to read sockets");
+
+    if let Some(socket) = sockets.get(&(address, acceptor)) {
+        internal!("Taking over the socket for {address} ({acceptor})");
+        return Ok(Arc::clone(socket));
+    }
+
+    let socket = Arc::new(bind(address, reuse_port)?.into_std()?);
+    sockets.insert((address, acceptor), Arc::clone(&socket));
+
+    Ok(socket)
+}
+
+///
+/// Accept connections on `socket` from the current runtime
+///
+/// # Errors
+/// If the socket can't be registered with the runtime
+///
+pub fn accept_on(socket: &Socket) -> std::io::Result<TcpListener> {
+    TcpListener::from_std(socket.try_clone()?)
+}
+
+///
+/// Close every socket opened by `listen` that no listener is holding anymore
+///
+/// # Panics
+/// This will panic if the open sockets have been poisoned
+///
+pub fn release() {
+    SOCKETS
+        .lock()
+        .expect("Unable to write sockets")
+        .retain(|_, socket| Arc::strong_count(socket) > 1);
+}
+
+///
+/// Pin the current thread to a single core, so that everything it runs stays
+/// in that core's caches. This is only supported on Linux, and is otherwise
+/// left to the scheduler.
+///
+#[cfg(target_os = "linux")]
+pub fn pin_to_core(core: usize) {
+    let core = core % default_acceptors();
+
+    // SAFETY: The set is zeroed before it's used, and only refers to this thread
+    let pinned = unsafe {
+        let mut set = std::mem::zeroed::<libc::cpu_set_t>();
+        libc::CPU_ZERO(&mut set);
+        libc::CPU_SET(core, &mut set);
+        libc::sched_setaffinity(0, std::mem::size_of::<libc::cpu_set_t>(), &raw const set)
+    };
+
+    if pinned != 0 {
+        internal!(
+            level = WARN,
+            "Unable to pin thread to core {core}: {}",
+            std::io::Error::last_os_error()
+        );
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+pub fn pin_to_core(_core: usize) {}
+
+#[cfg(test)]
+mod test {
+    use std::net::{IpAddr, Ipv4Addr, SocketAddr};
+
+    use tokio::{io::AsyncWriteExt, net::TcpStream};
+
+    use super::{accept_on, bind, listen, release, SOCKETS};
+
+    #[tokio::test]
+    async fn test_reuse_port() {
+        let first = bind(SocketAddr::new(IpAddr::V4(Ipv4Addr::LOCALHOST), 0), true).unwrap();
+        let address = first.local_addr().unwrap();
+        let second = bind(address, true).unwrap();
+
+        // Without SO_REUSEPORT, the address is already taken
+        assert!(bind(address, false).is_err());
+
+        let mut accepted = 0;
+        for _ in 0..64 {
+            let mut client = TcpStream::connect(address).await.unwrap();
+            client.shutdown().await.unwrap();
+
+            tokio::select! {
+                Ok(_) = first.accept() => accepted |= 1,
+                Ok(_) = second.accept() => accepted |= 2,
+            }
+        }
+
+        // The kernel picks a socket for each connection by hashing its address,
+        // so with this many connections both will have accepted some of them
+        assert_eq!(accepted, 3);
+    }
+
+    #[tokio::test]
+    async fn test_takeover() {
+        let address = bind(SocketAddr::new(IpAddr::V4(Ipv4Addr::LOCALHOST), 0), false)
+            .unwrap()
+            .local_addr()
+            .unwrap();
+
+        let socket = listen(address, 0, false).unwrap();
+        let first = accept_on(&socket).unwrap();
+
+        // A connection that arrives while the first listener is being replaced
+        // is still accepted by the one that replaces it
+        let mut client = TcpStream::connect(address).await.unwrap();
+        drop((first, socket));
+
+        let socket = listen(address, 0, false).unwrap();
+        let second = accept_on(&socket).unwrap();
+        client.shutdown().await.unwrap();
+        assert!(second.accept().await.is_ok());
+
+        release();
+        assert!(SOCKETS.lock().unwrap().contains_key(&(address, 0)));
+
+        drop((second, socket));
+        release();
+        assert!(!SOCKETS.lock().unwrap().contains_key(&(address, 0)));
+    }
+}
@@ -0,0 +1,1000 @@
+use std::{
+    collections::HashSet,
+    fs::{File, OpenOptions},
+    io::{IoSlice, SeekFrom, Write},
+    ops::Range,
+    os::unix::fs::FileExt,
+    path::{Path, PathBuf},
+    sync::OnceLock,
+    time::Duration,
+};
+
+use empath_common::{context::Context, internal};
+use serde::{Deserialize, Serialize};
+use tokio::{
+    io::{AsyncReadExt, AsyncSeekExt, Take},
+    sync::{mpsc, oneshot},
+    time::Instant,
+};
+
+/// Marks the start of every record, so that a torn write can be told apart
+/// from the next record
+const MAGIC: u32 = u32::from_be_bytes(*b"EMSP");
+
+/// The magic, length and checksum that precede every record
+const HEADER_LENGTH: usize = 12;
+
+/// How much of a body is read from a file at once, to copy it into a segment
+/// or check it against its checksum
+const PIECE_SIZE: usize = 256 << 10;
+
+/// The extension every segment file has
+const SEGMENT_EXTENSION: &str = "seg";
+
+/// The extension of the file that records which messages in a segment have
+/// been dealt with
+const DONE_EXTENSION: &str = "done";
+
+/// The spool every listener writes accepted messages to, if one is configured
+static SPOOL: OnceLock<Spool> = OnceLock::new();
+
+fn default_path() -> PathBuf {
+    PathBuf::from("./spool")
+}
+
+const fn default_segment_size() -> u64 {
+    64 << 20
+}
+
+const fn default_batch() -> usize {
+    256
+}
+
+const fn default_queue() -> usize {
+    1024
+}
+
+#[derive(Serialize, Deserialize, Clone, Debug)]
+pub struct Config {
+    /// The directory the segments are written to
+    #[serde(default = "default_path")]
+    pub path: PathBuf,
+    /// Once a segment reaches this size, in bytes, the next message starts a
+    /// new one
+    #[serde(default = "default_segment_size")]
+    pub segment_size: u64,
+    /// How long to wait for more messages before committing a batch, in
+    /// milliseconds. With 0, a batch is whatever arrived while the last one was
+    /// being committed.
+    #[serde(default)]
+    pub window: u64,
+    /// The most messages committed in a single batch
+    #[serde(default = "default_batch")]
+    pub batch: usize,
+    /// The most messages that can be waiting to be committed. Once there are
+    /// this many, sessions wait for room rather than holding any more in
+    /// memory, e.g. while the disk is slow.
+    #[serde(default = "default_queue")]
+    pub queue: usize,
+}
+
+impl Default for Config {
+    fn default() -> Self {
+        Self {
+            path: default_path(),
+            segment_size: default_segment_size(),
+            window: 0,
+            batch: default_batch(),
+            queue: default_queue(),
+        }
+    }
+}
+
+///
+/// A message as it was written to the spool. Only the envelope is held in
+/// memory, and the body is read from the segment when it's needed.
+///
+#[derive(Default, Debug, PartialEq, Eq)]
+pub struct Message {
+    /// The segment the message is in (the upper 32 bits), and where in it
+    /// (the lower 32 bits)
+    pub id: u64,
+    pub sender: String,
+    pub recipients: Vec<String>,
+    /// Whether the body was declared to be `8BITMIME`
+    pub eight_bit: bool,
+    /// Where the body is in the segment
+    pub body: Range<u64>,
+}
+
+/// FNV-1a, which is plenty to catch a record that was only partly written
+fn checksum(bytes: &[u8]) -> u32 {
+    resume_checksum(0x811c_9dc5, bytes)
+}
+
+/// Carry on with a checksum, from where it got to with the bytes before these
+fn resume_checksum(hash: u32, bytes: &[u8]) -> u32 {
+    bytes.iter().fold(hash, |hash, byte| {
+        (hash ^ u32::from(*byte)).wrapping_mul(0x0100_0193)
+    })
+}
+
+///
+/// Read `length` bytes of `file` from `start`, a piece at a time rather than
+/// all at once
+///
+fn pieces(
+    file: &File,
+    start: u64,
+    length: u64,
+    mut each: impl FnMut(&[u8]) -> std::io::Result<()>,
+) -> std::io::Result<()> {
+    let at_most =
+        |bytes: u64| usize::try_from(bytes).map_or(PIECE_SIZE, |bytes| bytes.min(PIECE_SIZE));
+    let mut buffer = vec![0; at_most(length)];
+    let mut offset = 0;
+
+    while offset < length {
+        let wanted = at_most(length - offset);
+        let read = file.read_at(&mut buffer[..wanted], start + offset)?;
+        if read == 0 {
+            return Err(std::io::ErrorKind::UnexpectedEof.into());
+        }
+
+        each(&buffer[..read])?;
+        offset += read as u64;
+    }
+
+    Ok(())
+}
+
+/// Where the body of a record is, while it waits to be written
+enum Body {
+    /// Taken from the context, which it's given back to once it's written
+    Held(Option<Vec<u8>>),
+    /// The file a spilled body is in, and its length
+    Spilled(File, u64),
+}
+
+///
+/// A message encoded for the spool. The body isn't copied into the record, but
+/// written straight after it: from the context's own buffer, or a piece at a
+/// time from the file it was spilled to.
+///
+pub struct Record {
+    /// The header and envelope, ending with the body's length. For a spilled
+    /// body, the checksum is only of the envelope until the record is written.
+    bytes: Vec<u8>,
+    body: Body,
+}
+
+impl Record {
+    fn len(&self) -> u64 {
+        self.bytes.len() as u64
+            + match self.body {
+                Body::Held(ref body) => body.as_ref().map_or(0, Vec::len) as u64,
+                Body::Spilled(_, length) => length,
+            }
+    }
+
+    fn write_to(&mut self, segment: &mut impl Write) -> std::io::Result<()> {
+        let (file, length) = match self.body {
+            Body::Held(ref body) => {
+                let body = body.as_deref().unwrap_or_default();
+                return segment
+                    .write_all_vectored(&mut [IoSlice::new(&self.bytes), IoSlice::new(body)]);
+            }
+            Body::Spilled(ref file, length) => (file, length),
+        };
+
+        let mut checksum = word(&self.bytes, 8).unwrap_or_default();
+        pieces(file, 0, length, |piece| {
+            checksum = resume_checksum(checksum, piece);
+            Ok(())
+        })?;
+        self.bytes[8..12].copy_from_slice(&checksum.to_le_bytes());
+
+        segment.write_all(&self.bytes)?;
+        pieces(file, 0, length, |piece| segment.write_all(piece))
+    }
+
+    /// The message as it was written at `id`, for whoever is delivering it
+    fn message(&self, id: u64) -> Option<Message> {
+        // Only the body's length follows the envelope, as the body itself is
+        // kept apart from the record
+        let mut message = envelope(id, &mut &self.bytes[HEADER_LENGTH..])?;
+
+        let start = (id & u64::from(u32::MAX)) + self.bytes.len() as u64;
+        message.body = start..start + (self.len() - self.bytes.len() as u64);
+
+        Some(message)
+    }
+
+    /// Give a body held in memory back to the context it was taken from
+    fn restore(self, context: &mut Context) {
+        if let Body::Held(Some(body)) = self.body {
+            context.data = Some(body);
+        }
+    }
+}
+
+fn put(record: &mut Vec<u8>, field: &[u8]) -> std::io::Result<()> {
+    let length = u32::try_from(field.len()).map_err(|_| invalid("Field is too large"))?;
+    record.extend_from_slice(&length.to_le_bytes());
+    record.extend_from_slice(field);
+
+    Ok(())
+}
+
+fn invalid(message: &str) -> std::io::Error {
+    std::io::Error::new(std::io::ErrorKind::InvalidData, message)
+}
+
+///
+/// Encode the envelope of a message into a record, and take its body to be
+/// written after it. A body held in memory is taken from `context` until the
+/// record is written, and a spilled body is left where it is, to be copied
+/// straight from its file.
+///
+/// # Errors
+/// If any part of the message is too large to be encoded, or a spilled body's
+/// file can't be duplicated
+///
+pub fn encode(context: &mut Context) -> std::io::Result<Record> {
+    let spilled = match context.spilled {
+        Some(ref spill) if !spill.is_empty() => Some((spill.file()?, spill.len() as u64)),
+        _ => None,
+    };
+    let length = spilled.as_ref().map_or_else(
+        || context.data.as_ref().map_or(0, Vec::len) as u64,
+        |(_, length)| *length,
+    );
+
+    let mut record = Vec::with_capacity(HEADER_LENGTH + 256);
+    record.resize(HEADER_LENGTH, 0);
+
+    put(&mut record, context.sender_address().as_bytes())?;
+    put(
+        &mut record,
+        &u32::try_from(context.recipient_count())
+            .map_err(|_| invalid("Too many recipients"))?
+            .to_le_bytes(),
+    )?;
+    for recipient in (0..context.recipient_count()).filter_map(|idx| context.recipient_address(idx))
+    {
+        put(&mut record, recipient.as_bytes())?;
+    }
+    put(&mut record, &[u8::from(context.eight_bit)])?;
+
+    // The body's length is written like any other field's, just without the
+    // body after it
+    record.extend_from_slice(
+        &u32::try_from(length)
+            .map_err(|_| invalid("Field is too large"))?
+            .to_le_bytes(),
+    );
+    let total = u32::try_from((record.len() - HEADER_LENGTH) as u64 + length)
+        .map_err(|_| invalid("Message is too large"))?;
+
+    // Nothing can fail from here on, so the body can be taken
+    let body = match spilled {
+        Some((file, length)) => Body::Spilled(file, length),
+        None => Body::Held(context.data.take()),
+    };
+
+    let mut checksum = checksum(&record[HEADER_LENGTH..]);
+    if let Body::Held(Some(ref body)) = body {
+        checksum = resume_checksum(checksum, body);
+    }
+
+    record[0..4].copy_from_slice(&MAGIC.to_le_bytes());
+    record[4..8].copy_from_slice(&total.to_le_bytes());
+    record[8..12].copy_from_slice(&checksum.to_le_bytes());
+
+    Ok(Record {
+        bytes: record,
+        body,
+    })
+}
+
+fn word(bytes: &[u8], at: usize) -> Option<u32> {
+    Some(u32::from_le_bytes(bytes.get(at..at + 4)?.try_into().ok()?))
+}
+
+fn take<'a>(payload: &mut &'a [u8]) -> Option<&'a [u8]> {
+    let length = word(payload, 0)? as usize;
+    let field = payload.get(4..4 + length)?;
+    *payload = &payload[4 + length..];
+
+    Some(field)
+}
+
+/// Decode the sender, recipients and body type at the start of `payload`,
+/// leaving it at the body's length
+fn envelope(id: u64, payload: &mut &[u8]) -> Option<Message> {
+    let sender = String::from_utf8(take(payload)?.to_vec()).ok()?;
+    let count = u32::from_le_bytes(take(payload)?.try_into().ok()?);
+    let recipients = (0..count)
+        .map(|_| String::from_utf8(take(payload)?.to_vec()).ok())
+        .collect::<Option<Vec<_>>>()?;
+    let eight_bit = match take(payload)? {
+        [0] => false,
+        [1] => true,
+        _ => return None,
+    };
+
+    Some(Message {
+        id,
+        sender,
+        recipients,
+        eight_bit,
+        body: 0..0,
+    })
+}
+
+/// What the spool tells whoever is delivering its messages
+#[derive(Debug)]
+pub enum Event {
+    /// A message has been committed to the spool
+    Committed(Message),
+    /// A segment is full, and won't have anything else written to it
+    Sealed(u64),
+}
+
+fn segment_path(path: &Path, number: u64) -> PathBuf {
+    path.join(format!("{number:016x}.{SEGMENT_EXTENSION}"))
+}
+
+fn done_path(path: &Path, number: u64) -> PathBuf {
+    path.join(format!("{number:016x}.{DONE_EXTENSION}"))
+}
+
+///
+/// Record that a message has been dealt with, and doesn't need to be
+/// delivered again. This isn't synced, so after a crash a message may be
+/// delivered twice, but never lost.
+///
+/// # Errors
+/// If the record can't be written
+///
+pub fn mark_done(path: &Path, id: u64) -> std::io::Result<()> {
+    OpenOptions::new()
+        .append(true)
+        .create(true)
+        .open(done_path(path, id >> 32))?
+        .write_all(&id.to_le_bytes())
+}
+
+///
+/// The ids of every message in a segment that has been dealt with
+///
+/// # Errors
+/// If the record exists, but can't be read
+///
+pub fn read_done(path: &Path, number: u64) -> std::io::Result<HashSet<u64>> {
+    match std::fs::read(done_path(path, number)) {
+        Ok(done) => Ok(done
+            .chunks_exact(8)
+            .filter_map(|id| id.try_into().ok().map(u64::from_le_bytes))
+            .collect()),
+        Err(err) if err.kind() == std::io::ErrorKind::NotFound => Ok(HashSet::new()),
+        Err(err) => Err(err),
+    }
+}
+
+///
+/// Remove a sealed segment, once every message in it has been dealt with
+///
+/// # Errors
+/// If the segment can't be removed
+///
+pub fn remove_segment(path: &Path, number: u64) -> std::io::Result<()> {
+    std::fs::remove_file(segment_path(path, number))?;
+
+    match std::fs::remove_file(done_path(path, number)) {
+        Err(err) if err.kind() != std::io::ErrorKind::NotFound => Err(err),
+        _ => Ok(()),
+    }
+}
+
+///
+/// The numbers of the segments in the spool at `path`, oldest first
+///
+/// # Errors
+/// If the spool directory can't be read
+///
+pub fn segments(path: &Path) -> std::io::Result<Vec<u64>> {
+    let mut segments = std::fs::read_dir(path)?
+        .filter_map(|entry| {
+            let path = entry.ok()?.path();
+            if path.extension()? != SEGMENT_EXTENSION {
+                return None;
+            }
+
+            u64::from_str_radix(path.file_stem()?.to_str()?, 16).ok()
+        })
+        .collect::<Vec<_>>();
+
+    segments.sort_unstable();
+    Ok(segments)
+}
+
+///
+/// Read back the envelope of every message in a segment. Each record is still
+/// checked against its checksum, but only a piece at a time, so that none of
+/// the bodies are held in memory. Reading stops at the first record that is
+/// incomplete or corrupt, which can only be the result of a write that was
+/// never acknowledged.
+///
+/// # Errors
+/// If the segment can't be read
+///
+pub fn read_segment(path: &Path, number: u64) -> std::io::Result<Vec<Message>> {
+    let segment = File::open(segment_path(path, number))?;
+    let size = segment.metadata()?.len();
+    let mut messages = Vec::new();
+    let mut offset = 0;
+
+    while let Some(message) = read_record(&segment, number << 32 | offset, size)? {
+        offset = message.body.end;
+        messages.push(message);
+    }
+
+    Ok(messages)
+}
+
+/// Read the envelope of the record at `id`, if it's complete and intact
+fn read_record(segment: &File, id: u64, size: u64) -> std::io::Result<Option<Message>> {
+    let offset = id & u64::from(u32::MAX);
+    let start = offset + HEADER_LENGTH as u64;
+    if start > size {
+        return Ok(None);
+    }
+
+    let mut header = [0; HEADER_LENGTH];
+    segment.read_exact_at(&mut header, offset)?;
+    let field = |at| word(&header, at);
+    let (Some(MAGIC), Some(length), Some(expected)) = (field(0), field(4), field(8)) else {
+        return Ok(None);
+    };
+
+    let length = u64::from(length);
+    if start + length > size {
+        return Ok(None);
+    }
+
+    // However long the envelope is, it ends up in the first piece or so
+    let mut hash = checksum(&[]);
+    let mut head = Vec::new();
+    let mut message = None;
+    pieces(segment, start, length, |piece| {
+        hash = resume_checksum(hash, piece);
+
+        if message.is_none() {
+            head.extend_from_slice(piece);
+
+            let mut rest = head.as_slice();
+            if let (Some(mut envelope), Some(body)) = (envelope(id, &mut rest), word(rest, 0)) {
+                let body_start = start + (head.len() - rest.len()) as u64 + 4;
+                envelope.body = body_start..body_start + u64::from(body);
+                message = Some(envelope);
+                head = Vec::new();
+            }
+        }
+
+        Ok(())
+    })?;
+
+    Ok(message.filter(|message| hash == expected && message.body.end == start + length))
+}
+
+///
+/// Open the body of a message where it is in its segment, so that it can be
+/// read from there rather than held in memory
+///
+/// # Errors
+/// If the segment can't be opened
+///
+pub async fn open_body(path: &Path, message: &Message) -> std::io::Result<Take<tokio::fs::File>> {
+    let mut segment = tokio::fs::File::open(segment_path(path, message.id >> 32)).await?;
+    segment.seek(SeekFrom::Start(message.body.start)).await?;
+
+    Ok(segment.take(message.body.end - message.body.start))
+}
+
+///
+/// The append-only log of segments that the spool writes to. Only the newest
+/// segment is ever written to, and a new one is started on every restart so
+/// that nothing already acknowledged is ever written over.
+///
+struct Log {
+    path: PathBuf,
+    segment_size: u64,
+    segment: File,
+    number: u64,
+    offset: u64,
+    /// Set when a write has failed, as the current segment may now end in a
+    /// partial record
+    rotate: bool,
+}
+
+impl Log {
+    fn open(config: &Config) -> std::io::Result<Self> {
+        std::fs::create_dir_all(&config.path)?;
+
+        let number = segments(&config.path)?.last().map_or(0, |last| last + 1);
+
+        Ok(Self {
+            segment: Self::create(&config.path, number)?,
+            path: config.path.clone(),
+            // Ids only have room for 32 bits of offset
+            segment_size: config.segment_size.clamp(1, u64::from(u32::MAX)),
+            number,
+            offset: 0,
+            rotate: false,
+        })
+    }
+
+    fn create(path: &Path, number: u64) -> std::io::Result<File> {
+        let segment = OpenOptions::new()
+            .append(true)
+            .create_new(true)
+            .open(segment_path(path, number))?;
+
+        // The segment itself needs to be durable, not just what's written to it
+        File::open(path)?.sync_all()?;
+
+        Ok(segment)
+    }
+
+    fn rotate(&mut self) -> std::io::Result<()> {
+        self.segment.sync_data()?;
+        self.segment = Self::create(&self.path, self.number + 1)?;
+        self.number += 1;
+        self.offset = 0;
+        self.rotate = false;
+
+        Ok(())
+    }
+
+    ///
+    /// Write out every record, returning their ids once they're all durable.
+    /// However many records there are, this only syncs once (unless a segment
+    /// fills up part way through).
+    ///
+    fn append(&mut self, records: &mut [Record]) -> std::io::Result<Vec<u64>> {
+        let result = self.write(records);
+        self.rotate |= result.is_err();
+
+        result
+    }
+
+    fn write(&mut self, records: &mut [Record]) -> std::io::Result<Vec<u64>> {
+        if self.rotate {
+            self.rotate()?;
+        }
+
+        let mut ids = Vec::with_capacity(records.len());
+
+        for record in records {
+            let length = record.len();
+            if self.offset > 0 && self.offset + length > self.segment_size {
+                self.rotate()?;
+            }
+
+            record.write_to(&mut self.segment)?;
+            ids.push(self.number << 32 | self.offset);
+            self.offset += length;
+        }
+
+        self.segment.sync_data()?;
+
+        Ok(ids)
+    }
+}
+
+struct Entry {
+    record: Record,
+    /// Told the message's id once it's durable, and given the record back for
+    /// its body
+    done: oneshot::Sender<(std::io::Result<u64>, Record)>,
+}
+
+///
+/// Writes accepted messages to disk, committing those from concurrent sessions
+/// together so that they share a single sync
+///
+pub struct Spool {
+    sender: mpsc::Sender<Entry>,
+}
+
+impl Spool {
+    ///
+    /// Open the spool, starting a new segment after any that are already there.
+    /// This must be called from within a runtime, which the spool commits on.
+    ///
+    /// Every message is sent to `events` once it has been committed. If whoever
+    /// is receiving them falls behind, nothing more is committed until they
+    /// catch up.
+    ///
+    /// # Errors
+    /// If the spool directory, or the new segment, can't be created
+    ///
+    pub fn open(config: &Config, events: Option<mpsc::Sender<Event>>) -> std::io::Result<Self> {
+        let log = Log::open(config)?;
+        let (sender, receiver) = mpsc::channel(config.queue.max(1));
+
+        tokio::spawn(Self::commit(
+            log,
+            receiver,
+            events,
+            Duration::from_millis(config.window),
+            config.batch.max(1),
+        ));
+
+        Ok(Self { sender })
+    }
+
+    ///
+    /// Write a message to the spool, returning its id once it is durable. The
+    /// body is taken from `context` while it's being written, rather than
+    /// copied, and given back after.
+    ///
+    /// # Errors
+    /// If the message couldn't be written, or synced, to disk
+    ///
+    pub async fn write(&self, context: &mut Context) -> std::io::Result<u64> {
+        let closed = || std::io::Error::new(std::io::ErrorKind::BrokenPipe, "Spool is closed");
+        let (done, receiver) = oneshot::channel();
+        let record = encode(context)?;
+
+        if let Err(mpsc::error::SendError(entry)) = self.sender.send(Entry { record, done }).await {
+            entry.record.restore(context);
+            return Err(closed());
+        }
+
+        let (result, record) = receiver.await.map_err(|_| closed())?;
+        record.restore(context);
+
+        result
+    }
+
+    async fn commit(
+        mut log: Log,
+        mut receiver: mpsc::Receiver<Entry>,
+        events: Option<mpsc::Sender<Event>>,
+        window: Duration,
+        batch: usize,
+    ) {
+        let mut entries = Vec::with_capacity(batch);
+
+        while let Some(entry) = receiver.recv().await {
+            entries.push(entry);
+
+            // Everything that arrived while the last batch was being committed
+            // goes in this one, along with anything that arrives in the window
+            let deadline = Instant::now() + window;
+            while entries.len() < batch {
+                match receiver.try_recv() {
+                    Ok(entry) => entries.push(entry),
+                    Err(_) if window.is_zero() => break,
+                    Err(_) => match tokio::time::timeout_at(deadline, receiver.recv()).await {
+                        Ok(Some(entry)) => entries.push(entry),
+                        Ok(None) | Err(_) => break,
+                    },
+                }
+            }
+
+            let (mut records, done): (Vec<_>, Vec<_>) = entries
+                .drain(..)
+                .map(|entry| (entry.record, entry.done))
+                .unzip();
+
+            let first = log.number;
+            let (returned, records, result) = tokio::task::spawn_blocking(move || {
+                let result = log.append(&mut records);
+                (log, records, result)
+            })
+            .await
+            .expect("Spool writer panicked");
+            log = returned;
+
+            let mut committed = Vec::new();
+            match result {
+                Ok(ids) => {
+                    for ((done, record), id) in done.into_iter().zip(records).zip(ids) {
+                        if events.is_some() {
+                            committed.extend(record.message(id));
+                        }
+
+                        let _ = done.send((Ok(id), record));
+                    }
+                }
+                Err(err) => {
+                    internal!(level = ERROR, "Unable to write to spool: {err}");
+
+                    for (done, record) in done.into_iter().zip(records) {
+                        let err = std::io::Error::new(err.kind(), err.to_string());
+                        let _ = done.send((Err(err), record));
+                    }
+                }
+            }
+
+            // Sealed segments are only announced once every message in the
+            // batch is known about, as one with nothing outstanding is removed
+            if let Some(ref events) = events {
+                let sealed = (first..log.number).map(Event::Sealed);
+                for event in committed.into_iter().map(Event::Committed).chain(sealed) {
+                    let _ = events.send(event).await;
+                }
+            }
+        }
+    }
+}
+
+///
+/// Open the spool that every listener writes accepted messages to, sending
+/// everything committed to it on to `events`
+///
+/// # Errors
+/// If the spool can't be opened, or has already been
+///
+pub fn init(config: &Config, events: Option<mpsc::Sender<Event>>) -> std::io::Result<()> {
+    let opened = || {
+        std::io::Error::new(
+            std::io::ErrorKind::AlreadyExists,
+            "The spool has already been opened",
+        )
+    };
+
+    // Checked first, so that a second spool isn't opened only to be dropped
+    if SPOOL.get().is_some() {
+        return Err(opened());
+    }
+    SPOOL
+        .set(Spool::open(config, events)?)
+        .map_err(|_| opened())?;
+
+    internal!(
+        level = INFO,
+        "Spooling messages to {}",
+        config.path.display()
+    );
+
+    Ok(())
+}
+
+/// The spool accepted messages should be written to, if there is one
+pub fn get() -> Option<&'static Spool> {
+    SPOOL.get()
+}
+
+#[cfg(test)]
+mod test {
+    use std::{io::Write, path::PathBuf};
+
+    use empath_common::context::{Addresses, Context, Spill};
+
+    use tokio::{io::AsyncReadExt, sync::mpsc};
+
+    use super::{open_body, read_segment, segment_path, segments, Config, Event, Message, Spool};
+
+    fn config(name: &str) -> Config {
+        let path: PathBuf =
+            std::env::temp_dir().join(format!("empath-spool-{name}-{}", std::process::id()));
+        let _ = std::fs::remove_dir_all(&path);
+
+        Config {
+            path,
+            ..Default::default()
+        }
+    }
+
+    fn message(body: &str) -> Context {
+        Context {
+            mail_from: Addresses::from(&mailparse::addrparse("sender@example.com").unwrap()),
+            rcpt_to: Addresses::from(
+                &mailparse::addrparse("first@example.org, second@example.org").unwrap(),
+            ),
+            data: Some(body.as_bytes().to_vec()),
+            ..Default::default()
+        }
+    }
+
+    async fn body(config: &Config, message: &Message) -> Vec<u8> {
+        let mut body = Vec::new();
+        open_body(&config.path, message)
+            .await
+            .unwrap()
+            .read_to_end(&mut body)
+            .await
+            .unwrap();
+
+        body
+    }
+
+    #[tokio::test(flavor = "multi_thread")]
+    async fn test_group_commit() {
+        let config = config("group");
+        let spool = Spool::open(&config, None).unwrap();
+        let mut contexts = (0..16)
+            .map(|idx| message(&format!("Message {idx}")))
+            .collect::<Vec<_>>();
+
+        let ids = futures_util::future::join_all(contexts.iter_mut().map(|ctx| spool.write(ctx)))
+            .await
+            .into_iter()
+            .collect::<std::io::Result<Vec<_>>>()
+            .unwrap();
+
+        // Every body was given back once it had been written
+        assert!(contexts.iter().all(|ctx| ctx
+            .data
+            .as_ref()
+            .is_some_and(|data| data.starts_with(b"Message "))));
+
+        let messages = read_segment(&config.path, 0).unwrap();
+        assert_eq!(messages.len(), 16);
+        assert_eq!(messages[0].sender, "sender@example.com");
+        assert_eq!(
+            messages[0].recipients,
+            ["first@example.org", "second@example.org"]
+        );
+
+        for id in ids {
+            let message = messages.iter().find(|message| message.id == id).unwrap();
+            assert!(body(&config, message).await.starts_with(b"Message "));
+        }
+
+        // Reopening always starts a new segment
+        drop(spool);
+        let _spool = Spool::open(&config, None).unwrap();
+        assert_eq!(segments(&config.path).unwrap(), [0, 1]);
+
+        std::fs::remove_dir_all(config.path).unwrap();
+    }
+
+    #[tokio::test]
+    async fn test_rotation() {
+        let config = Config {
+            segment_size: 64,
+            ..config("rotation")
+        };
+        let spool = Spool::open(&config, None).unwrap();
+
+        let first = spool.write(&mut message("First")).await.unwrap();
+        let mut context = message("Second");
+        context.eight_bit = true;
+        let second = spool.write(&mut context).await.unwrap();
+
+        assert_eq!(first, 0);
+        assert_eq!(second, 1 << 32);
+        assert_eq!(segments(&config.path).unwrap(), [0, 1]);
+        let messages = read_segment(&config.path, 1).unwrap();
+        assert_eq!(body(&config, &messages[0]).await, b"Second");
+        assert!(messages[0].eight_bit);
+        assert!(!read_segment(&config.path, 0).unwrap()[0].eight_bit);
+
+        std::fs::remove_dir_all(config.path).unwrap();
+    }
+
+    #[tokio::test(flavor = "multi_thread")]
+    async fn test_rotation_events() {
+        let config = Config {
+            segment_size: 64,
+            window: 100,
+            ..config("events")
+        };
+        let (events, mut received) = mpsc::channel(16);
+        let spool = Spool::open(&config, Some(events)).unwrap();
+
+        // All of these are committed in a single batch, which fills several
+        // segments
+        let mut contexts = (0..4)
+            .map(|idx| message(&format!("Message {idx}")))
+            .collect::<Vec<_>>();
+        let ids = futures_util::future::join_all(contexts.iter_mut().map(|ctx| spool.write(ctx)))
+            .await
+            .into_iter()
+            .collect::<std::io::Result<Vec<_>>>()
+            .unwrap();
+        assert!(segments(&config.path).unwrap().len() > 1);
+
+        drop(spool);
+        let mut committed = Vec::new();
+        while let Some(event) = received.recv().await {
+            match event {
+                Event::Committed(message) => committed.push(message.id),
+                // Every message in a segment is known about before it's sealed
+                Event::Sealed(number) => {
+                    let ids = ids.iter().filter(|id| *id >> 32 == number);
+                    assert!(ids.clone().count() > 0);
+                    assert!(ids.into_iter().all(|id| committed.contains(id)));
+                }
+            }
+        }
+
+        assert_eq!(committed.len(), ids.len());
+
+        std::fs::remove_dir_all(config.path).unwrap();
+    }
+
+    #[tokio::test]
+    async fn test_spilled() {
+        let config = config("spilled");
+        let (events, mut committed) = mpsc::channel(1);
+        let spool = Spool::open(&config, Some(events)).unwrap();
+
+        let mut spill = Spill::create(&std::env::temp_dir()).unwrap();
+        spill.write(b"Spilled ").unwrap();
+        spill.write(b"body").unwrap();
+        spill.map().unwrap();
+
+        let mut context = message("");
+        context.data = None;
+        context.spilled = Some(spill);
+        let id = spool.write(&mut context).await.unwrap();
+
+        // The body is copied from its file, checksum and all
+        let messages = read_segment(&config.path, 0).unwrap();
+        assert_eq!(messages.len(), 1);
+        assert_eq!(messages[0].id, id);
+        assert_eq!(body(&config, &messages[0]).await, b"Spilled body");
+
+        let Some(Event::Committed(message)) = committed.recv().await else {
+            panic!("The message wasn't announced");
+        };
+        assert_eq!(message, messages[0]);
+
+        std::fs::remove_dir_all(config.path).unwrap();
+    }
+
+    #[tokio::test]
+    async fn test_large_envelope() {
+        let config = config("envelope");
+        let spool = Spool::open(&config, None).unwrap();
+
+        // More recipients than fit in the first piece read back
+        let recipients = (0..4096)
+            .map(|idx| format!("{}{idx}@example.org", "recipient".repeat(8)))
+            .collect::<Vec<_>>();
+        let mut context = message("Body");
+        context.rcpt_to = Addresses::from(&mailparse::addrparse(&recipients.join(", ")).unwrap());
+        spool.write(&mut context).await.unwrap();
+        spool.write(&mut message("Next")).await.unwrap();
+
+        let messages = read_segment(&config.path, 0).unwrap();
+        assert_eq!(messages.len(), 2);
+        assert_eq!(messages[0].recipients, recipients);
+        assert_eq!(body(&config, &messages[0]).await, b"Body");
+        assert_eq!(body(&config, &messages[1]).await, b"Next");
+
+        std::fs::remove_dir_all(config.path).unwrap();
+    }
+
+    #[tokio::test]
+    async fn test_torn_write() {
+        let config = config("torn");
+        let spool = Spool::open(&config, None).unwrap();
+        spool.write(&mut message("Durable")).await.unwrap();
+
+        // Simulate a crash part way through writing the next record
+        let mut record = Vec::new();
+        super::encode(&mut message("Torn"))
+            .unwrap()
+            .write_to(&mut record)
+            .unwrap();
+        std::fs::OpenOptions::new()
+            .append(true)
+            .open(segment_path(&config.path, 0))
+            .unwrap()
+            .write_all(&record[..record.len() - 2])
+            .unwrap();
+
+        let messages = read_segment(&config.path, 0).unwrap();
+        assert_eq!(messages.len(), 1);
+        assert_eq!(body(&config, &messages[0]).await, b"Durable");
+
+        std::fs::remove_dir_all(config.path).unwrap();
+    }
+}
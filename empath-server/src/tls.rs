@@ -0,0 +1,163 @@
+use std::{
+    fs::File,
+    io::BufReader,
+    sync::{Arc, RwLock},
+    time::{Duration, SystemTime},
+};
+
+use empath_common::internal;
+use serde::{Deserialize, Serialize};
+use tokio::signal::unix::{signal, SignalKind};
+use tokio_rustls::{
+    rustls::{
+        server::{AllowAnyAnonymousOrAuthenticatedClient, ServerSessionMemoryCache},
+        Certificate, PrivateKey, RootCertStore, ServerConfig, Ticketer,
+    },
+    TlsAcceptor,
+};
+
+/// How many TLS sessions to remember, so that clients reconnecting can
+/// resume them with an abbreviated handshake
+const SESSION_CACHE_SIZE: usize = 4096;
+
+/// How often to check whether the certificate or key have been changed
+const RELOAD_INTERVAL: Duration = Duration::from_secs(30);
+
+fn invalid<E: ToString>(err: E) -> std::io::Error {
+    std::io::Error::new(std::io::ErrorKind::InvalidData, err.to_string())
+}
+
+#[derive(Serialize, Deserialize, Clone, Default)]
+pub struct TlsContext {
+    certificate: String,
+    key: String,
+    /// The acceptor built from the certificate and key. This is shared between
+    /// every session on a listener, and replaced whenever they're reloaded.
+    #[serde(skip)]
+    acceptor: Arc<RwLock<Option<TlsAcceptor>>>,
+}
+
+impl TlsContext {
+    pub fn is_enabled(&self) -> bool {
+        !self.certificate.is_empty() && !self.key.is_empty()
+    }
+
+    ///
+    /// Retrieve the current acceptor, if the certificate and key have been loaded
+    ///
+    /// # Panics
+    /// This will panic if the acceptor lock has been poisoned
+    ///
+    pub fn acceptor(&self) -> Option<TlsAcceptor> {
+        self.acceptor
+            .read()
+            .expect("Unable to read TLS acceptor")
+            .clone()
+    }
+
+    ///
+    /// Load the certificate and key, and build the acceptor that will be
+    /// used for every session from them
+    ///
+    /// # Errors
+    /// If the certificate or key can't be read, or are invalid
+    ///
+    /// # Panics
+    /// This will panic if the acceptor lock has been poisoned
+    ///
+    pub fn load(&self) -> std::io::Result<()> {
+        let certs = rustls_pemfile::certs(&mut BufReader::new(File::open(&self.certificate)?))?
+            .into_iter()
+            .map(Certificate)
+            .collect::<Vec<_>>();
+
+        let key = match rustls_pemfile::read_one(&mut BufReader::new(File::open(&self.key)?))? {
+            Some(
+                rustls_pemfile::Item::RSAKey(key)
+                | rustls_pemfile::Item::PKCS8Key(key)
+                | rustls_pemfile::Item::ECKey(key),
+            ) => PrivateKey(key),
+            _ => return Err(invalid("Unable to determine key file")),
+        };
+
+        let mut cert_store = RootCertStore::empty();
+        cert_store
+            .add(
+                certs
+                    .first()
+                    .ok_or_else(|| invalid("No certificates found"))?,
+            )
+            .map_err(invalid)?;
+
+        let mut config = ServerConfig::builder()
+            .with_safe_default_cipher_suites()
+            .with_safe_default_kx_groups()
+            .with_safe_default_protocol_versions()
+            .map_err(invalid)?
+            .with_client_cert_verifier(Arc::new(AllowAnyAnonymousOrAuthenticatedClient::new(
+                cert_store,
+            )))
+            .with_single_cert_with_ocsp_and_sct(certs, key, Vec::new(), Vec::new())
+            .map_err(invalid)?;
+
+        // Allow for both stateful and stateless resumption
+        config.session_storage = ServerSessionMemoryCache::new(SESSION_CACHE_SIZE);
+        config.ticketer = Ticketer::new().map_err(invalid)?;
+
+        *self.acceptor.write().expect("Unable to write TLS acceptor") =
+            Some(TlsAcceptor::from(Arc::new(config)));
+
+        Ok(())
+    }
+
+    /// When the certificate and key were last modified
+    fn modified(&self) -> (Option<SystemTime>, Option<SystemTime>) {
+        let modified = |path| {
+            std::fs::metadata(path)
+                .and_then(|meta| meta.modified())
+                .ok()
+        };
+
+        (modified(&self.certificate), modified(&self.key))
+    }
+
+    ///
+    /// Reload the certificate and key whenever they change on disk, or when a
+    /// SIGHUP is received. Sessions that are already running keep using the
+    /// acceptor they started with.
+    ///
+    /// # Panics
+    /// This will panic if it is unable to listen for SIGHUP
+    ///
+    pub async fn watch(self) {
+        let mut hangup = signal(SignalKind::hangup()).expect("Unable to listen for SIGHUP");
+        let mut interval = tokio::time::interval(RELOAD_INTERVAL);
+        let mut modified = self.modified();
+
+        loop {
+            tokio::select! {
+                _ = hangup.recv() => {}
+                _ = interval.tick() => {
+                    if modified == self.modified() {
+                        continue;
+                    }
+                }
+            }
+
+            modified = self.modified();
+
+            match self.load() {
+                Ok(()) => internal!(
+                    level = INFO,
+                    "Reloaded TLS certificate {}",
+                    self.certificate
+                ),
+                Err(err) => internal!(
+                    level = ERROR,
+                    "Unable to reload TLS certificate {}: {err}",
+                    self.certificate
+                ),
+            }
+        }
+    }
+}
@@ -0,0 +1,50 @@
+use criterion::{black_box, criterion_group, criterion_main, Criterion, Throughput};
+use empath_smtp_proto::command::{Command, Request};
+
+const COMMANDS: &[&[u8]] = &[
+    b"EHLO client.example.com\r\n",
+    b"MAIL FROM:<sender@example.com>\r\n",
+    b"RCPT TO:<first@example.org>\r\n",
+    b"RCPT TO:<second@example.org>\r\n",
+    b"DATA\r\n",
+    b"QUIT\r\n",
+];
+
+fn parse(c: &mut Criterion) {
+    let mut group = c.benchmark_group("command");
+    group.throughput(Throughput::Elements(COMMANDS.len() as u64));
+
+    group.bench_function("request", |b| {
+        b.iter(|| {
+            for command in COMMANDS {
+                black_box(Request::parse(black_box(command)));
+            }
+        });
+    });
+
+    group.bench_function("command", |b| {
+        b.iter(|| {
+            for command in COMMANDS {
+                black_box(Command::from(black_box(*command)));
+            }
+        });
+    });
+
+    group.bench_function("from_str", |b| {
+        let commands = COMMANDS
+            .iter()
+            .map(|command| std::str::from_utf8(command).unwrap())
+            .collect::<Vec<_>>();
+
+        b.iter(|| {
+            for command in &commands {
+                black_box(black_box(command).parse::<Command>().ok());
+            }
+        });
+    });
+
+    group.finish();
+}
+
+criterion_group!(benches, parse);
+criterion_main!(benches);
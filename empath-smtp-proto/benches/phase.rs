@@ -0,0 +1,45 @@
+use criterion::{black_box, criterion_group, criterion_main, BatchSize, Criterion, Throughput};
+use empath_common::context::Context;
+use empath_smtp_proto::{command::Command, phase::Phase};
+
+const TRANSACTION: &[&str] = &[
+    "EHLO client.example.com",
+    "MAIL FROM:<sender@example.com> SIZE=4096",
+    "RCPT TO:<first@example.org>",
+    "RCPT TO:<second@example.org>",
+    "DATA",
+];
+
+fn transition(c: &mut Criterion) {
+    let mut group = c.benchmark_group("phase");
+    group.throughput(Throughput::Elements(TRANSACTION.len() as u64));
+
+    // The context is reused between transactions, as it is by a session
+    let mut vctx = Context::default();
+
+    group.bench_function("transition", |b| {
+        b.iter_batched(
+            || {
+                TRANSACTION
+                    .iter()
+                    .map(|command| Command::from(*command))
+                    .collect::<Vec<_>>()
+            },
+            |commands| {
+                let mut phase = Phase::Connect;
+                for command in commands {
+                    phase = phase.transition(black_box(command), &mut vctx);
+                }
+
+                vctx.reset();
+                black_box(phase)
+            },
+            BatchSize::SmallInput,
+        );
+    });
+
+    group.finish();
+}
+
+criterion_group!(benches, transition);
+criterion_main!(benches);
@@ -21,14 +21,105 @@ impl Display for HeloVariant {
     }
 }
 
+/// The encoding of a message body, from [RFC-6152](https://www.ietf.org/rfc/rfc6152.txt)
+#[derive(Eq, PartialEq, Debug, Clone, Copy)]
+pub enum Body {
+    SevenBit,
+    EightBitMime,
+}
+
+impl Display for Body {
+    fn fmt(&self, fmt: &mut Formatter<'_>) -> std::fmt::Result {
+        fmt.write_str(match self {
+            Self::SevenBit => "7BIT",
+            Self::EightBitMime => "8BITMIME",
+        })
+    }
+}
+
+/// The parameters that can follow the reverse-path of a `MAIL FROM`
+#[derive(Eq, PartialEq, Debug, Default, Clone)]
+pub struct MailParameters {
+    /// The size the client expects the message to be, in bytes, from
+    /// [RFC-1870](https://www.ietf.org/rfc/rfc1870.txt)
+    pub size: Option<usize>,
+    pub body: Option<Body>,
+}
+
+impl MailParameters {
+    ///
+    /// Parse the parameters following the reverse-path. Anything that isn't
+    /// understood is ignored.
+    ///
+    /// # Errors
+    /// If a parameter that is understood has an invalid value
+    ///
+    fn parse(parameters: &str) -> Result<Self, String> {
+        let mut parsed = Self::default();
+
+        for parameter in parameters.split_ascii_whitespace() {
+            let (keyword, value) = parameter.split_once('=').unwrap_or((parameter, ""));
+
+            if keyword.eq_ignore_ascii_case("SIZE") {
+                parsed.size = Some(
+                    value
+                        .parse()
+                        .map_err(|_| format!("Invalid SIZE '{value}'"))?,
+                );
+            } else if keyword.eq_ignore_ascii_case("BODY") {
+                parsed.body = Some(if value.eq_ignore_ascii_case("7BIT") {
+                    Body::SevenBit
+                } else if value.eq_ignore_ascii_case("8BITMIME") {
+                    Body::EightBitMime
+                } else {
+                    return Err(format!("Invalid BODY '{value}'"));
+                });
+            }
+        }
+
+        Ok(parsed)
+    }
+}
+
+impl Display for MailParameters {
+    fn fmt(&self, fmt: &mut Formatter<'_>) -> std::fmt::Result {
+        if let Some(size) = self.size {
+            write!(fmt, " SIZE={size}")?;
+        }
+
+        if let Some(body) = self.body {
+            write!(fmt, " BODY={body}")?;
+        }
+
+        Ok(())
+    }
+}
+
+/// Split the argument of a `MAIL FROM` into its reverse-path, and parameters
+fn split_path(argument: &str) -> (&str, &str) {
+    let end = if argument.starts_with('<') {
+        argument.find('>').map(|end| end + 1)
+    } else {
+        argument.find(char::is_whitespace)
+    };
+
+    end.map_or((argument, ""), |end| argument.split_at(end))
+}
+
 #[derive(Eq, PartialEq, Debug)]
 pub enum Command {
     Helo(HeloVariant),
     /// If this is `None`, then it should be assumed this is the `null sender`, or `null reverse-path`,
     /// from [RFC-5321](https://www.ietf.org/rfc/rfc5321.txt).
-    MailFrom(Option<MailAddrList>),
+    MailFrom(Option<MailAddrList>, MailParameters),
     RcptTo(MailAddrList),
     Data,
+    /// A chunk of the message of exactly `size` bytes, which immediately
+    /// follows the command, from [RFC-3030](https://www.ietf.org/rfc/rfc3030.txt)
+    Bdat {
+        size: usize,
+        last: bool,
+    },
     Quit,
     StartTLS,
     Invalid(String),
@@ -37,7 +128,7 @@ pub enum Command {
 impl Command {
     pub fn inner(&self) -> String {
         match self {
-            Self::MailFrom(from) => from.clone().map(|f| f.to_string()).unwrap_or_default(),
+            Self::MailFrom(from, _) => from.clone().map(|f| f.to_string()).unwrap_or_default(),
             Self::RcptTo(to) => to.to_string(),
             Self::Invalid(command) => command.clone(),
             Self::Helo(HeloVariant::Ehlo(id) | HeloVariant::Helo(id)) => id.clone(),
@@ -50,12 +141,15 @@ impl Display for Command {
     fn fmt(&self, fmt: &mut Formatter<'_>) -> Result<(), std::fmt::Error> {
         match self {
             Self::Helo(v) => fmt.write_fmt(format_args!("{} {}", v, self.inner())),
-            Self::MailFrom(s) => fmt.write_fmt(format_args!(
-                "MAIL FROM:{}",
+            Self::MailFrom(s, parameters) => fmt.write_fmt(format_args!(
+                "MAIL FROM:{}{parameters}",
                 s.clone().map(|f| f.to_string()).unwrap_or_default()
             )),
             Self::RcptTo(rcpt) => fmt.write_fmt(format_args!("RCPT TO:{rcpt}")),
             Self::Data => fmt.write_str("DATA"),
+            Self::Bdat { size, last } => {
+                write!(fmt, "BDAT {size}{}", if *last { " LAST" } else { "" })
+            }
             Self::Quit => fmt.write_str("QUIT"),
             Self::StartTLS => fmt.write_str("STARTTLS"),
             Self::Invalid(s) => fmt.write_str(s),
@@ -63,58 +157,144 @@ impl Display for Command {
     }
 }
 
-impl FromStr for Command {
-    type Err = Self;
+///
+/// A command as it was received from the client, with its arguments borrowed
+/// from the line it was parsed from.
+///
+/// Parsing one of these never allocates, so it's cheap to inspect a command
+/// before deciding whether anything from it needs to be kept. Converting it into
+/// a [`Command`] is what materializes the arguments.
+///
+#[derive(PartialEq, Eq, Debug, Clone, Copy)]
+pub enum Request<'a> {
+    Ehlo(&'a [u8]),
+    Helo(&'a [u8]),
+    MailFrom(&'a [u8]),
+    RcptTo(&'a [u8]),
+    Data,
+    Bdat(&'a [u8]),
+    Quit,
+    StartTLS,
+    Invalid(&'a [u8]),
+}
 
-    fn from_str(command: &str) -> Result<Self, <Self as FromStr>::Err> {
-        let comm = command.to_ascii_uppercase();
-        let comm = comm.trim();
+/// Strip `prefix` from the start of `line`, ignoring ascii case
+fn strip_prefix<'a>(line: &'a [u8], prefix: &[u8]) -> Option<&'a [u8]> {
+    line.get(..prefix.len())
+        .filter(|start| start.eq_ignore_ascii_case(prefix))
+        .map(|_| &line[prefix.len()..])
+}
 
-        if comm.starts_with("MAIL FROM:") {
-            let from = mailparse::addrparse(command[command.find(':').unwrap() + 1..].trim())
-                .map_err(|e| {
+/// Retrieve everything following a command like `BDAT`, if it is indeed that command
+fn arguments_after<'a>(line: &'a [u8], command: &[u8]) -> Option<&'a [u8]> {
+    let rest = strip_prefix(line, command)?;
+
+    (rest.is_empty() || rest[0].is_ascii_whitespace()).then(|| rest.trim_ascii_start())
+}
+
+/// Retrieve the word following a command like `EHLO`, if it is indeed that command
+fn word_after<'a>(line: &'a [u8], command: &[u8]) -> Option<&'a [u8]> {
+    arguments_after(line, command).map(|rest| {
+        rest.split(u8::is_ascii_whitespace)
+            .next()
+            .unwrap_or_default()
+    })
+}
+
+impl<'a> Request<'a> {
+    ///
+    /// Parse a single command line (with or without the trailing `<CRLF>`)
+    ///
+    pub fn parse(line: &'a [u8]) -> Self {
+        let line = line.trim_ascii();
+
+        if let Some(from) = strip_prefix(line, b"MAIL FROM:") {
+            Self::MailFrom(from.trim_ascii())
+        } else if let Some(to) = strip_prefix(line, b"RCPT TO:") {
+            Self::RcptTo(to.trim_ascii())
+        } else if let Some(id) = word_after(line, b"EHLO") {
+            Self::Ehlo(id)
+        } else if let Some(id) = word_after(line, b"HELO") {
+            Self::Helo(id)
+        } else if line.eq_ignore_ascii_case(b"DATA") {
+            Self::Data
+        } else if let Some(arguments) = arguments_after(line, b"BDAT") {
+            Self::Bdat(arguments)
+        } else if line.eq_ignore_ascii_case(b"QUIT") {
+            Self::Quit
+        } else if line.eq_ignore_ascii_case(b"STARTTLS") {
+            Self::StartTLS
+        } else {
+            Self::Invalid(line)
+        }
+    }
+}
+
+impl TryFrom<Request<'_>> for Command {
+    type Error = Self;
+
+    fn try_from(request: Request<'_>) -> Result<Self, Self::Error> {
+        let text = |arg| {
+            std::str::from_utf8(arg)
+                .map_err(|_| Self::Invalid("Unable to interpret command".to_string()))
+        };
+
+        match request {
+            Request::MailFrom(from) => {
+                let (from, parameters) = split_path(text(from)?);
+                let parameters = MailParameters::parse(parameters).map_err(Self::Invalid)?;
+                let from = mailparse::addrparse(from).map_err(|e| {
                     error!("{e}");
                     e.to_string()
                 })?;
 
-            Ok(Self::MailFrom(if from.is_empty() {
-                None
-            } else {
-                Some(from)
-            }))
-        } else if comm.starts_with("RCPT TO:") {
-            let to = mailparse::addrparse(command[command.find(':').unwrap() + 1..].trim())
-                .map_err(|e| e.to_string())?;
-            Ok(Self::RcptTo(to))
-        } else if comm.starts_with("EHLO") {
-            Ok(Self::Helo(HeloVariant::Ehlo(
-                command
-                    .split(' ')
-                    .nth(1)
-                    .unwrap_or_default()
-                    .trim()
-                    .to_string(),
-            )))
-        } else if comm.starts_with("HELO") {
-            Ok(Self::Helo(HeloVariant::Helo(
-                command
-                    .split(' ')
-                    .nth(1)
-                    .unwrap_or_default()
-                    .trim()
-                    .to_string(),
-            )))
-        } else {
-            match comm {
-                "DATA" => Ok(Self::Data),
-                "QUIT" => Ok(Self::Quit),
-                "STARTTLS" => Ok(Self::StartTLS),
-                _ => Err(Self::Invalid(command.to_owned())),
+                Ok(Self::MailFrom(
+                    if from.is_empty() { None } else { Some(from) },
+                    parameters,
+                ))
+            }
+            Request::RcptTo(to) => {
+                let to = mailparse::addrparse(text(to)?).map_err(|e| e.to_string())?;
+                Ok(Self::RcptTo(to))
+            }
+            Request::Ehlo(id) => Ok(Self::Helo(HeloVariant::Ehlo(text(id)?.to_string()))),
+            Request::Helo(id) => Ok(Self::Helo(HeloVariant::Helo(text(id)?.to_string()))),
+            Request::Data => Ok(Self::Data),
+            Request::Bdat(arguments) => {
+                let invalid = || Self::Invalid("Invalid BDAT".to_string());
+                let mut arguments = text(arguments)?.split_ascii_whitespace();
+
+                let size = arguments
+                    .next()
+                    .and_then(|size| size.parse().ok())
+                    .ok_or_else(invalid)?;
+                let last = match arguments.next() {
+                    None => false,
+                    Some(last) if last.eq_ignore_ascii_case("LAST") => true,
+                    Some(_) => return Err(invalid()),
+                };
+
+                if arguments.next().is_some() {
+                    return Err(invalid());
+                }
+
+                Ok(Self::Bdat { size, last })
             }
+            Request::Quit => Ok(Self::Quit),
+            Request::StartTLS => Ok(Self::StartTLS),
+            Request::Invalid(command) => Err(Self::Invalid(text(command)?.to_string())),
         }
     }
 }
 
+impl FromStr for Command {
+    type Err = Self;
+
+    fn from_str(command: &str) -> Result<Self, <Self as FromStr>::Err> {
+        Self::try_from(Request::parse(command.as_bytes()))
+    }
+}
+
 impl From<&str> for Command {
     fn from(val: &str) -> Self {
         Self::from_str(val).unwrap_or_else(|e| e)
@@ -129,9 +309,98 @@ impl From<String> for Command {
 
 impl From<&[u8]> for Command {
     fn from(val: &[u8]) -> Self {
-        std::str::from_utf8(val).map_or(
-            Self::Invalid("Unable to interpret command".to_string()),
-            |s| Self::from_str(s).unwrap_or_else(|e| e),
-        )
+        Self::try_from(Request::parse(val)).unwrap_or_else(|e| e)
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::{Body, Command, HeloVariant, MailParameters, Request};
+
+    #[test]
+    fn test_parse() {
+        assert_eq!(
+            Request::parse(b"ehlo test.com\r\n"),
+            Request::Ehlo(b"test.com")
+        );
+        assert_eq!(
+            Request::parse(b"HELO  test.com"),
+            Request::Helo(b"test.com")
+        );
+        assert_eq!(Request::parse(b"EHLO"), Request::Ehlo(b""));
+        assert_eq!(Request::parse(b"EHLOtest"), Request::Invalid(b"EHLOtest"));
+        assert_eq!(
+            Request::parse(b"Mail From: <test@test.com>\r\n"),
+            Request::MailFrom(b"<test@test.com>")
+        );
+        assert_eq!(
+            Request::parse(b"rcpt to:<test@test.com>"),
+            Request::RcptTo(b"<test@test.com>")
+        );
+        assert_eq!(Request::parse(b"data\r\n"), Request::Data);
+        assert_eq!(
+            Request::parse(b"BDAT 1024 LAST\r\n"),
+            Request::Bdat(b"1024 LAST")
+        );
+        assert_eq!(Request::parse(b"BDATA"), Request::Invalid(b"BDATA"));
+        assert_eq!(Request::parse(b"Quit"), Request::Quit);
+        assert_eq!(Request::parse(b"StartTls"), Request::StartTLS);
+        assert_eq!(Request::parse(b"NOOP\r\n"), Request::Invalid(b"NOOP"));
+    }
+
+    #[test]
+    fn test_command() {
+        assert_eq!(
+            Command::from(&b"EHLO test.com\r\n"[..]),
+            Command::Helo(HeloVariant::Ehlo("test.com".to_string()))
+        );
+        assert_eq!(
+            Command::from("MAIL FROM:<>"),
+            Command::MailFrom(None, MailParameters::default())
+        );
+        assert_eq!(
+            Command::from("MAIL FROM:<test@test.com> size=1024 BODY=8bitmime OTHER"),
+            Command::MailFrom(
+                mailparse::addrparse("test@test.com").ok(),
+                MailParameters {
+                    size: Some(1024),
+                    body: Some(Body::EightBitMime)
+                }
+            )
+        );
+        assert_eq!(
+            Command::from("MAIL FROM:<test@test.com> BODY=BINARYMIME"),
+            Command::Invalid("Invalid BODY 'BINARYMIME'".to_string())
+        );
+        assert_eq!(
+            Command::from("BDAT 512"),
+            Command::Bdat {
+                size: 512,
+                last: false
+            }
+        );
+        assert_eq!(
+            Command::from("bdat 0 last"),
+            Command::Bdat {
+                size: 0,
+                last: true
+            }
+        );
+        assert_eq!(
+            Command::from("BDAT 512 NEXT"),
+            Command::Invalid("Invalid BDAT".to_string())
+        );
+        assert_eq!(
+            Command::from("MAIL FROM:<test@test.com> SIZE=big"),
+            Command::Invalid("Invalid SIZE 'big'".to_string())
+        );
+        assert_eq!(
+            Command::from("RCPT TO:<test@test.com>"),
+            Command::RcptTo(mailparse::addrparse("test@test.com").unwrap())
+        );
+        assert_eq!(
+            Command::from(&b"\xff\xfe"[..]),
+            Command::Invalid("Unable to interpret command".to_string())
+        );
     }
 }
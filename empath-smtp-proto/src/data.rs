@@ -0,0 +1,209 @@
+use memchr::memmem;
+
+/// Where in the stream of data the decoder currently is. This is what allows
+/// for the terminator (or a stuffed dot) to be split across reads.
+#[derive(PartialEq, Eq, Debug, Clone, Copy, Default)]
+enum State {
+    /// Somewhere in the middle of a line
+    #[default]
+    Text,
+    /// Just after a `<CR>` in the middle of a line
+    Cr,
+    /// At the start of a line
+    LineStart,
+    /// Just after a `.` at the start of a line
+    Dot,
+    /// Just after `.<CR>` at the start of a line
+    DotCr,
+}
+
+///
+/// An incremental decoder for the body of a `DATA` command.
+///
+/// Each chunk read from the client is scanned exactly once, searching for
+/// `<CRLF>.` to find both the end of the data and any lines that need to be
+/// unstuffed, as per section 4.5.2 of [RFC-5321](https://www.ietf.org/rfc/rfc5321.txt).
+/// Everything between those is copied in bulk.
+///
+#[derive(PartialEq, Eq, Debug, Clone, Copy)]
+pub struct Decoder {
+    state: State,
+}
+
+impl Default for Decoder {
+    fn default() -> Self {
+        // The data starts immediately after the `<CRLF>` of the DATA command
+        Self {
+            state: State::LineStart,
+        }
+    }
+}
+
+impl Decoder {
+    ///
+    /// Decode a chunk of data received from the client, appending the unstuffed
+    /// message to `out`.
+    ///
+    /// If this chunk contains the end of the data, the number of bytes of `input`
+    /// that were consumed (including the terminator) is returned, and anything
+    /// after that belongs to whatever the client sent next. The decoder is then
+    /// ready to be used for another message.
+    ///
+    pub fn decode(&mut self, input: &[u8], out: &mut Vec<u8>) -> Option<usize> {
+        let mut idx = 0;
+
+        while idx < input.len() {
+            match self.state {
+                State::Text => {
+                    let rest = &input[idx..];
+
+                    if let Some(pos) = memmem::find(rest, b"\r\n.") {
+                        out.extend_from_slice(&rest[..pos + 2]);
+                        self.state = State::Dot;
+                        idx += pos + 3;
+                    } else {
+                        out.extend_from_slice(rest);
+                        self.state = if rest.ends_with(b"\r\n") {
+                            State::LineStart
+                        } else if rest.ends_with(b"\r") {
+                            State::Cr
+                        } else {
+                            State::Text
+                        };
+                        idx = input.len();
+                    }
+                }
+                State::Cr => {
+                    if input[idx] == b'\n' {
+                        out.push(b'\n');
+                        self.state = State::LineStart;
+                        idx += 1;
+                    } else {
+                        self.state = State::Text;
+                    }
+                }
+                State::LineStart => {
+                    if input[idx] == b'.' {
+                        self.state = State::Dot;
+                        idx += 1;
+                    } else {
+                        self.state = State::Text;
+                    }
+                }
+                State::Dot => {
+                    // Either this is the terminator, or the leading dot is dropped
+                    if input[idx] == b'\r' {
+                        self.state = State::DotCr;
+                        idx += 1;
+                    } else {
+                        self.state = State::Text;
+                    }
+                }
+                State::DotCr => {
+                    if input[idx] == b'\n' {
+                        *self = Self::default();
+                        return Some(idx + 1);
+                    }
+
+                    out.push(b'\r');
+                    self.state = State::Cr;
+                }
+            }
+        }
+
+        None
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::Decoder;
+
+    fn decode_chunks(chunks: &[&[u8]]) -> (Vec<u8>, Option<(usize, usize)>) {
+        let mut decoder = Decoder::default();
+        let mut out = Vec::new();
+
+        for (idx, chunk) in chunks.iter().enumerate() {
+            if let Some(consumed) = decoder.decode(chunk, &mut out) {
+                return (out, Some((idx, consumed)));
+            }
+        }
+
+        (out, None)
+    }
+
+    #[test]
+    fn test_simple() {
+        let (out, end) = decode_chunks(&[b"Subject: Test\r\n\r\nHello\r\n.\r\n"]);
+
+        assert_eq!(out, b"Subject: Test\r\n\r\nHello\r\n");
+        assert_eq!(end, Some((0, 27)));
+    }
+
+    #[test]
+    fn test_empty() {
+        let (out, end) = decode_chunks(&[b".\r\n"]);
+
+        assert!(out.is_empty());
+        assert_eq!(end, Some((0, 3)));
+    }
+
+    #[test]
+    fn test_incomplete() {
+        let (out, end) = decode_chunks(&[b"Hello\r\n", b"World\r\n."]);
+
+        assert_eq!(out, b"Hello\r\nWorld\r\n");
+        assert_eq!(end, None);
+    }
+
+    #[test]
+    fn test_split_terminator() {
+        let expected = b"Hello\r\n";
+        let message = b"Hello\r\n.\r\n";
+
+        for split in 1..message.len() {
+            let (out, end) = decode_chunks(&[&message[..split], &message[split..]]);
+
+            assert_eq!(out, expected, "split at {split}");
+            assert_eq!(end, Some((1, message.len() - split)), "split at {split}");
+        }
+    }
+
+    #[test]
+    fn test_unstuffing() {
+        let (out, end) = decode_chunks(&[b"..Hello\r\n.\r\r\n...\r\n.World\r\n.\r\n"]);
+
+        assert_eq!(out, b".Hello\r\n\r\r\n..\r\nWorld\r\n");
+        assert!(end.is_some());
+    }
+
+    #[test]
+    fn test_split_unstuffing() {
+        let (out, end) = decode_chunks(&[b"Hello\r\n.", b".World\r\n.\r", b"a\r\n.", b"\r\n"]);
+
+        assert_eq!(out, b"Hello\r\n.World\r\n\ra\r\n");
+        assert_eq!(end, Some((3, 2)));
+    }
+
+    #[test]
+    fn test_pipelined() {
+        let message = b"Hello\r\n.\r\nQUIT\r\n";
+        let (out, end) = decode_chunks(&[message]);
+
+        assert_eq!(out, b"Hello\r\n");
+        assert_eq!(end, Some((0, 10)));
+        assert_eq!(&message[10..], b"QUIT\r\n");
+    }
+
+    #[test]
+    fn test_reuse() {
+        let mut decoder = Decoder::default();
+        let mut out = Vec::new();
+
+        assert_eq!(decoder.decode(b"One\r\n.\r\n", &mut out), Some(8));
+        out.clear();
+
+        assert_eq!(decoder.decode(b"..Two\r\n.\r\n", &mut out), Some(10));
+        assert_eq!(out, b".Two\r\n");
+    }
+}
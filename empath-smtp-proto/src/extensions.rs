@@ -5,12 +5,26 @@ use serde::{Deserialize, Serialize};
 #[derive(Serialize, Deserialize, Clone)]
 pub enum Extension {
     STARTTLS,
+    /// Command pipelining, from [RFC-2920](https://www.ietf.org/rfc/rfc2920.txt)
+    PIPELINING,
+    /// Message size declaration, from [RFC-1870](https://www.ietf.org/rfc/rfc1870.txt),
+    /// with the largest message that will be accepted (or 0, if there's no limit)
+    SIZE(usize),
+    /// Sending the message in sized chunks with `BDAT`, from [RFC-3030](https://www.ietf.org/rfc/rfc3030.txt)
+    CHUNKING,
+    /// Sending 8 bit message bodies, from [RFC-6152](https://www.ietf.org/rfc/rfc6152.txt)
+    EIGHTBITMIME,
 }
 
 impl Display for Extension {
     fn fmt(&self, fmt: &mut std::fmt::Formatter<'_>) -> std::result::Result<(), std::fmt::Error> {
         match self {
             Self::STARTTLS => fmt.write_str("STARTTLS"),
+            Self::PIPELINING => fmt.write_str("PIPELINING"),
+            Self::SIZE(0) => fmt.write_str("SIZE"),
+            Self::SIZE(max) => write!(fmt, "SIZE {max}"),
+            Self::CHUNKING => fmt.write_str("CHUNKING"),
+            Self::EIGHTBITMIME => fmt.write_str("8BITMIME"),
         }
     }
 }
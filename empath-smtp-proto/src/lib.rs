@@ -1,4 +1,5 @@
 pub mod command;
+pub mod data;
 pub mod extensions;
 pub mod phase;
 pub mod status;
@@ -1,10 +1,9 @@
 use std::{
-    borrow::BorrowMut,
     fmt::{Display, Formatter},
     str::FromStr,
 };
 
-use crate::command::{Command, HeloVariant};
+use crate::command::{Body, Command, HeloVariant};
 use empath_common::context::Context;
 use serde::{Deserialize, Serialize};
 
@@ -20,6 +19,10 @@ pub enum Phase {
     Data,
     Reading,
     DataReceived,
+    /// Receiving a chunk of the message sent with `BDAT`
+    Chunk,
+    /// A chunk has been received, but it wasn't the last one
+    ChunkReceived,
     Quit,
     InvalidCommandSequence,
     Invalid,
@@ -29,7 +32,7 @@ pub enum Phase {
 impl Display for Phase {
     fn fmt(&self, fmt: &mut Formatter<'_>) -> Result<(), std::fmt::Error> {
         fmt.write_str(match self {
-            Self::Reading | Self::DataReceived => "",
+            Self::Reading | Self::DataReceived | Self::Chunk | Self::ChunkReceived => "",
             Self::Connect => "Connect",
             Self::Close => "Close",
             Self::Ehlo => "EHLO",
@@ -75,19 +78,27 @@ impl Phase {
                 Self::Helo
             }
             (Self::Ehlo | Self::Helo, Command::StartTLS) => Self::StartTLS,
-            (Self::Ehlo | Self::Helo | Self::StartTLS, Command::MailFrom(from)) => {
-                vctx.mail_from = from;
+            (Self::Ehlo | Self::Helo | Self::StartTLS, Command::MailFrom(from, parameters)) => {
+                vctx.mail_from.set(from.as_ref());
+                vctx.declared_size = parameters.size;
+                vctx.eight_bit = parameters.body == Some(Body::EightBitMime);
+                Self::MailFrom
+            }
+            // A new transaction on the same session
+            (Self::DataReceived, Command::MailFrom(from, parameters)) => {
+                vctx.reset();
+                vctx.mail_from.set(from.as_ref());
+                vctx.declared_size = parameters.size;
+                vctx.eight_bit = parameters.body == Some(Body::EightBitMime);
                 Self::MailFrom
             }
             (Self::RcptTo | Self::MailFrom, Command::RcptTo(to)) => {
-                if let Some(rcpts) = vctx.rcpt_to.borrow_mut() {
-                    rcpts.extend_from_slice(&to[..]);
-                } else {
-                    vctx.rcpt_to = Some(to);
-                }
+                vctx.rcpt_to.extend(&to);
                 Self::RcptTo
             }
             (Self::RcptTo, Command::Data) => Self::Data,
+            // Once a message has been started with BDAT, it has to be finished with it
+            (Self::RcptTo | Self::ChunkReceived, Command::Bdat { .. }) => Self::Chunk,
             (Self::Data, comm) if comm != Command::Quit => Self::Connect,
             (_, Command::Quit) => Self::Quit,
             (Self::Invalid, _) => Self::Invalid,
@@ -95,3 +106,31 @@ impl Phase {
         }
     }
 }
+
+#[cfg(test)]
+mod test {
+    use empath_common::context::Context;
+
+    use super::Phase;
+    use crate::command::Command;
+
+    #[test]
+    fn test_body_type() {
+        let mut vctx = Context::default();
+
+        let phase = Phase::Ehlo.transition(
+            Command::from("MAIL FROM:<test@test.com> BODY=8BITMIME"),
+            &mut vctx,
+        );
+        assert_eq!(phase, Phase::MailFrom);
+        assert!(vctx.eight_bit);
+
+        // The next transaction on the session declares its own
+        let phase = Phase::DataReceived.transition(
+            Command::from("MAIL FROM:<test@test.com> BODY=7BIT"),
+            &mut vctx,
+        );
+        assert_eq!(phase, Phase::MailFrom);
+        assert!(!vctx.eight_bit);
+    }
+}
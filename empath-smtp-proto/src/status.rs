@@ -1,6 +1,6 @@
 use std::fmt::{Display, Formatter};
 
-#[derive(Clone, Copy, PartialEq, Eq, PartialOrd)]
+#[derive(Clone, Copy, PartialEq, Eq, PartialOrd, Debug)]
 #[repr(C)]
 pub enum Status {
     ServiceReady = 220,
@@ -8,9 +8,45 @@ pub enum Status {
     Ok = 250,
     StartMailInput = 354,
     Unavailable = 421,
+    MailboxUnavailable = 450,
     ActionUnavailable = 451,
     InvalidCommandSequence = 503,
     Error = 550,
+    ExceededStorage = 552,
+    TransactionFailed = 554,
+}
+
+impl Status {
+    /// The status with the given reply code, if there is one
+    #[must_use]
+    pub const fn from_code(code: i32) -> Option<Self> {
+        Some(match code {
+            220 => Self::ServiceReady,
+            221 => Self::GoodBye,
+            250 => Self::Ok,
+            354 => Self::StartMailInput,
+            421 => Self::Unavailable,
+            450 => Self::MailboxUnavailable,
+            451 => Self::ActionUnavailable,
+            503 => Self::InvalidCommandSequence,
+            550 => Self::Error,
+            552 => Self::ExceededStorage,
+            554 => Self::TransactionFailed,
+            _ => return None,
+        })
+    }
+
+    /// Whether this status means the command failed, rather than succeeded
+    #[must_use]
+    pub const fn is_negative(self) -> bool {
+        self as i32 >= 400
+    }
+
+    /// Whether the command might succeed if it's tried again later
+    #[must_use]
+    pub const fn is_transient(self) -> bool {
+        self.is_negative() && (self as i32) < 500
+    }
 }
 
 impl Display for Status {
@@ -18,3 +54,25 @@ impl Display for Status {
         write!(fmt, "{}", *self as i32)
     }
 }
+
+#[cfg(test)]
+mod test {
+    use super::Status;
+
+    #[test]
+    fn test_from_code() {
+        for status in [
+            Status::Ok,
+            Status::MailboxUnavailable,
+            Status::TransactionFailed,
+        ] {
+            assert_eq!(Status::from_code(status as i32), Some(status));
+        }
+
+        assert_eq!(Status::from_code(1), None);
+        assert!(!Status::Ok.is_negative());
+        assert!(Status::Unavailable.is_negative());
+        assert!(Status::ActionUnavailable.is_transient());
+        assert!(!Status::Error.is_transient());
+    }
+}
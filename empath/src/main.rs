@@ -1,4 +1,4 @@
-use empath_common::internal;
+use empath_common::{internal, logging};
 use empath_server::Server;
 
 #[cfg(not(any(target_os = "macos", unix)))]
@@ -17,6 +17,7 @@ async fn main() -> std::io::Result<()> {
     };
 
     internal!("Shutting down...");
+    logging::flush();
 
     resp
 }
@@ -1,9 +1,11 @@
 // Compile with
-//   gcc example.c -fpic -shared -o libexample.so -l empath_common -L \
+//   gcc example.c -fpic -shared -pthread -o libexample.so -l empath_common -L \
 //     ../target/debug
 //
 
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "../target/empath/common.h"
 #include "../target/empath/smtp/proto.h"
@@ -37,6 +39,16 @@ int validate_data(Context *vctx) {
   String data = context_get_data(vctx);
   printf("Data:\n%s\n", data.data);
 
+  // The views borrow directly from the context, so there is no copy made,
+  // and nothing to free. They are only valid during this callback.
+  StringView body = context_view_data(vctx);
+  printf("Data (%zu bytes):\n%.*s\n", body.len, (int)body.len, body.data);
+
+  for (size_t i = 0; i < context_recipient_count(vctx); i++) {
+    StringView rcpt = context_recipient_at(vctx, i);
+    printf("Recipient address: %.*s\n", (int)rcpt.len, rcpt.data);
+  }
+
   if (context_set_data_response(vctx, "Test Response") != 0) {
     printf("Unable to set data response\n");
   }
@@ -48,6 +60,85 @@ int validate_data(Context *vctx) {
   return 0;
 }
 
+// This can be set in place of validate_data, for validations that need to wait
+// on something else (e.g. a network service). It should return straight away,
+// and complete the handle exactly once, from any thread. The context is valid
+// until then.
+void validate_data_async(Context *vctx, Completion *handle) {
+  test(vctx);
+  context_complete(handle, 0);
+}
+
+// Or, this can be set for modules that are more efficient when validating
+// several messages at once. The result for each context is written to the
+// matching entry in results.
+void validate_data_batch(Context **contexts, size_t len, int *results) {
+  for (size_t i = 0; i < len; i++) {
+    test(contexts[i]);
+    results[i] = 0;
+  }
+}
+
+// These are only called if the module is loaded with `streaming = true`, in
+// which case `validate_data` won't be called. Each chunk is only valid for the
+// duration of the call.
+//
+// Several sessions can be receiving data at once, on different threads, so
+// anything kept between calls has to be kept per context. on_data_end is always
+// called once the data has ended, even if it was rejected, so that's where it's
+// cleaned up.
+typedef struct Received {
+  Context *vctx;
+  size_t bytes;
+  struct Received *next;
+} Received;
+
+static Received *received = NULL;
+static pthread_mutex_t received_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Find where the count for a context is, or would be, in the list. The lock
+// must be held.
+static Received **find_received(Context *vctx) {
+  Received **entry = &received;
+  while (*entry != NULL && (*entry)->vctx != vctx) {
+    entry = &(*entry)->next;
+  }
+  return entry;
+}
+
+int on_data_chunk(Context *vctx, const uint8_t *chunk, size_t len) {
+  pthread_mutex_lock(&received_lock);
+
+  Received **entry = find_received(vctx);
+  if (*entry == NULL) {
+    *entry = calloc(1, sizeof(Received));
+  }
+  if (*entry != NULL) {
+    (*entry)->vctx = vctx;
+    (*entry)->bytes += len;
+  }
+
+  pthread_mutex_unlock(&received_lock);
+  return 0;
+}
+
+int on_data_end(Context *vctx) {
+  size_t bytes = 0;
+  pthread_mutex_lock(&received_lock);
+
+  Received **entry = find_received(vctx);
+  if (*entry != NULL) {
+    Received *done = *entry;
+    bytes = done->bytes;
+    *entry = done->next;
+    free(done);
+  }
+
+  pthread_mutex_unlock(&received_lock);
+  printf("Received %zu bytes of data\n", bytes);
+  return 0;
+}
+
 int init(StringVector arguments) {
   printf("INIT CALLED\n");
   something = 2;
@@ -59,7 +150,15 @@ int init(StringVector arguments) {
   return 0;
 }
 
+// This module changes the context in validate_data, so can't be flagged with
+// MODULE_CONCURRENT, which would let it run alongside other modules. Declaring
+// its capabilities means it's only ever called for the events it handles.
 EM_DECLARE_MODULE("dll", init,
                   {
                       validate_data,
-                  });
+                      on_data_chunk,
+                      on_data_end,
+                  },
+                  0,
+                  CAPABILITY_VALIDATE_DATA | CAPABILITY_DATA_CHUNK |
+                      CAPABILITY_DATA_END);